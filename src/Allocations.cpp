@@ -0,0 +1,144 @@
+#include "Allocations.h"
+
+#if KLEMMUI_LS_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+namespace allocations
+{
+	// Only trivial thread locals are used here, they can't allocate themselves.
+	static thread_local Counters ThreadCounters;
+
+	static void* Allocate(std::size_t Size)
+	{
+		ThreadCounters.Count++;
+		ThreadCounters.Bytes += Size;
+		void* Allocated = std::malloc(Size ? Size : 1);
+		if (!Allocated)
+			throw std::bad_alloc();
+		return Allocated;
+	}
+
+	static void* AllocateAligned(std::size_t Size, std::align_val_t Alignment)
+	{
+		ThreadCounters.Count++;
+		ThreadCounters.Bytes += Size;
+		std::size_t AlignmentSize = std::size_t(Alignment);
+#ifdef _WIN32
+		void* Allocated = _aligned_malloc(Size ? Size : 1, AlignmentSize);
+#else
+		// aligned_alloc requires the size to be a multiple of the alignment.
+		void* Allocated = std::aligned_alloc(AlignmentSize, (Size + AlignmentSize - 1) / AlignmentSize * AlignmentSize);
+#endif
+		if (!Allocated)
+			throw std::bad_alloc();
+		return Allocated;
+	}
+
+	static void FreeAligned(void* Pointer)
+	{
+#ifdef _WIN32
+		_aligned_free(Pointer);
+#else
+		std::free(Pointer);
+#endif
+	}
+}
+
+void* operator new(std::size_t Size)
+{
+	return allocations::Allocate(Size);
+}
+
+void* operator new[](std::size_t Size)
+{
+	return allocations::Allocate(Size);
+}
+
+void* operator new(std::size_t Size, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return allocations::Allocate(Size);
+	}
+	catch (std::bad_alloc&)
+	{
+		return nullptr;
+	}
+}
+
+void* operator new[](std::size_t Size, const std::nothrow_t&) noexcept
+{
+	return operator new(Size, std::nothrow);
+}
+
+void* operator new(std::size_t Size, std::align_val_t Alignment)
+{
+	return allocations::AllocateAligned(Size, Alignment);
+}
+
+void* operator new[](std::size_t Size, std::align_val_t Alignment)
+{
+	return allocations::AllocateAligned(Size, Alignment);
+}
+
+void operator delete(void* Pointer) noexcept
+{
+	std::free(Pointer);
+}
+
+void operator delete[](void* Pointer) noexcept
+{
+	std::free(Pointer);
+}
+
+void operator delete(void* Pointer, std::size_t) noexcept
+{
+	std::free(Pointer);
+}
+
+void operator delete[](void* Pointer, std::size_t) noexcept
+{
+	std::free(Pointer);
+}
+
+void operator delete(void* Pointer, const std::nothrow_t&) noexcept
+{
+	std::free(Pointer);
+}
+
+void operator delete[](void* Pointer, const std::nothrow_t&) noexcept
+{
+	std::free(Pointer);
+}
+
+void operator delete(void* Pointer, std::align_val_t) noexcept
+{
+	allocations::FreeAligned(Pointer);
+}
+
+void operator delete[](void* Pointer, std::align_val_t) noexcept
+{
+	allocations::FreeAligned(Pointer);
+}
+
+void operator delete(void* Pointer, std::size_t, std::align_val_t) noexcept
+{
+	allocations::FreeAligned(Pointer);
+}
+
+void operator delete[](void* Pointer, std::size_t, std::align_val_t) noexcept
+{
+	allocations::FreeAligned(Pointer);
+}
+
+allocations::Counters allocations::GetThreadCounters()
+{
+	return ThreadCounters;
+}
+#else
+allocations::Counters allocations::GetThreadCounters()
+{
+	return Counters();
+}
+#endif
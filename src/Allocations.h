@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * Heap allocation counting.
+ *
+ * If the server is built with KLEMMUI_LS_COUNT_ALLOCATIONS, the global operator new is replaced
+ * to count the allocations made by each thread. Otherwise all counters stay zero.
+ */
+namespace allocations
+{
+#if KLEMMUI_LS_COUNT_ALLOCATIONS
+	constexpr bool Enabled = true;
+#else
+	constexpr bool Enabled = false;
+#endif
+
+	struct Counters
+	{
+		uint64_t Count = 0;
+		uint64_t Bytes = 0;
+
+		Counters operator-(const Counters& Other) const
+		{
+			return Counters{ Count - Other.Count, Bytes - Other.Bytes };
+		}
+
+		Counters& operator+=(const Counters& Other)
+		{
+			Count += Other.Count;
+			Bytes += Other.Bytes;
+			return *this;
+		}
+	};
+
+	// Returns the number of allocations made by the calling thread so far.
+	Counters GetThreadCounters();
+}
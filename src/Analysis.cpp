@@ -0,0 +1,359 @@
+#include "Analysis.h"
+#include "Util/StrUtil.h"
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+// Initial size of a snapshot's arena. The arena grows geometrically from here,
+// so even large workspaces only need a few allocations.
+constexpr size_t INITIAL_ARENA_SIZE = 64 * 1024;
+
+analysis::TokenPosition::TokenPosition(const kui::stringParse::StringToken& From)
+{
+	Line = From.Line;
+	BeginChar = From.BeginChar;
+	EndChar = From.EndChar;
+}
+
+bool analysis::TokenPosition::Contains(size_t Line, size_t Character) const
+{
+	return BeginChar <= Character && EndChar > Character && this->Line == Line;
+}
+
+void* analysis::CountingResource::do_allocate(size_t Bytes, size_t Alignment)
+{
+	Allocated += Bytes;
+	return std::pmr::get_default_resource()->allocate(Bytes, Alignment);
+}
+
+void analysis::CountingResource::do_deallocate(void* Pointer, size_t Bytes, size_t Alignment)
+{
+	Allocated -= Bytes;
+	std::pmr::get_default_resource()->deallocate(Pointer, Bytes, Alignment);
+}
+
+bool analysis::CountingResource::do_is_equal(const std::pmr::memory_resource& Other) const noexcept
+{
+	return this == &Other;
+}
+
+analysis::Snapshot::Snapshot()
+	: Arena(INITIAL_ARENA_SIZE, &ArenaUpstream),
+	VariableUsages(&Arena),
+	Outlines(&Arena),
+	Symbols(&Arena),
+	Occurrences(&Arena)
+{
+}
+
+bool analysis::OutlineNode::Contains(size_t Line, size_t Character) const
+{
+	if (Line < StartLine || Line > EndLine)
+		return false;
+	if (Line == StartLine && Character < StartChar)
+		return false;
+	if (Line == EndLine && Character >= EndChar)
+		return false;
+	return true;
+}
+
+// Extends the range of the node so it contains its name.
+static void IncludeSelection(analysis::OutlineNode& Node)
+{
+	const analysis::TokenPosition& Name = Node.Selection;
+	if (Name.Line < Node.StartLine || (Name.Line == Node.StartLine && Name.BeginChar < Node.StartChar))
+	{
+		Node.StartLine = Name.Line;
+		Node.StartChar = Name.BeginChar;
+	}
+	if (Name.Line > Node.EndLine || (Name.Line == Node.EndLine && Name.EndChar > Node.EndChar))
+	{
+		Node.EndLine = Name.Line;
+		Node.EndChar = Name.EndChar;
+	}
+}
+
+static void AddOutlineElement(analysis::FileOutline& Into, const kui::MarkupStructure::UIElement& From,
+	analysis::OutlineNode Node, uint32_t Parent)
+{
+	uint32_t Index = uint32_t(Into.size());
+	Node.Detail = StrUtil::Intern(From.TypeName.Text);
+	Node.StartLine = From.StartLine;
+	Node.StartChar = From.StartChar;
+	Node.EndLine = From.EndLine;
+	// The end character of an element is the position of its closing brace.
+	Node.EndChar = From.EndChar + 1;
+	Node.FoldLine = From.TypeName.Line;
+	Node.FoldChar = From.TypeName.EndChar;
+	Node.Parent = Parent;
+	IncludeSelection(Node);
+	Into.push_back(Node);
+
+	for (auto& Child : From.Children)
+	{
+		bool Named = !Child.ElementName.Empty();
+		AddOutlineElement(Into, Child, analysis::OutlineNode{
+			.Kind = analysis::OutlineNode::Child,
+			.Name = StrUtil::Intern(Named ? Child.ElementName.Text : Child.TypeName.Text),
+			.Selection = Named ? Child.ElementName : Child.TypeName,
+			}, Index);
+	}
+	Into[Index].SubtreeEnd = uint32_t(Into.size());
+}
+
+void analysis::Snapshot::BuildOutlines()
+{
+	auto GetOutline = [this](const std::string& File) -> FileOutline& {
+		return Outlines.try_emplace(StrUtil::Intern(File)).first->second;
+		};
+
+	for (auto& i : Parsed.Elements)
+	{
+		FileOutline& Outline = GetOutline(i.File);
+		AddOutlineElement(Outline, i.Root, OutlineNode{
+			.Kind = OutlineNode::Element,
+			.Name = StrUtil::Intern(i.FromToken.Text),
+			.Selection = i.FromToken,
+			}, OutlineNode::NO_PARENT);
+	}
+
+	auto AddDeclaration = [&](OutlineNode::NodeKind Kind, const std::string& File, const kui::stringParse::StringToken& Name) {
+		FileOutline& Outline = GetOutline(File);
+		TokenPosition Position = Name;
+		Outline.push_back(OutlineNode{
+			.Kind = Kind,
+			.Name = StrUtil::Intern(Name.Text),
+			.Detail = Kind == OutlineNode::Global ? "global" : "const",
+			.StartLine = Position.Line,
+			.StartChar = Position.BeginChar,
+			.EndLine = Position.Line,
+			.EndChar = Position.EndChar,
+			.Selection = Position,
+			.SubtreeEnd = uint32_t(Outline.size() + 1),
+			});
+		};
+
+	for (auto& i : Parsed.Globals)
+	{
+		AddDeclaration(OutlineNode::Global, i.File, i.Name);
+	}
+	for (auto& i : Parsed.Constants)
+	{
+		AddDeclaration(OutlineNode::Constant, i.File, i.Name);
+	}
+}
+
+static bool CompareLocations(const analysis::SymbolLocation& a, const analysis::SymbolLocation& b)
+{
+	return std::tie(a.File, a.Token.Line, a.Token.BeginChar) < std::tie(b.File, b.Token.Line, b.Token.BeginChar);
+}
+
+std::pair<const analysis::SymbolLocation*, const analysis::SymbolLocation*> analysis::Symbol::GetReferencesIn(std::string_view File) const
+{
+	auto Range = std::equal_range(References.begin(), References.end(), SymbolLocation{ .File = File },
+		[](const SymbolLocation& a, const SymbolLocation& b) {
+			return a.File < b.File;
+		});
+	return { std::to_address(Range.first), std::to_address(Range.second) };
+}
+
+// Key: Interned name of an element, value: its vars by their interned name.
+using VarIndex = std::unordered_map<std::string_view, std::unordered_map<std::string_view, uint32_t>>;
+
+/**
+ * Adds the user defined element types used by the element and its children.
+ * Properties set on instances of user defined elements are references to the element's vars.
+ */
+static void AddElementReferences(const kui::MarkupStructure::UIElement& From, std::string_view File,
+	const std::unordered_map<std::string_view, uint32_t>& ElementsByName, const VarIndex& VarsByElement,
+	std::pmr::vector<analysis::Symbol>& Symbols)
+{
+	auto Found = ElementsByName.find(From.TypeName.Text);
+	if (Found != ElementsByName.end())
+		Symbols[Found->second].References.push_back(analysis::SymbolLocation{ .File = File, .Token = From.TypeName });
+
+	auto Vars = VarsByElement.find(From.TypeName.Text);
+	if (Vars != VarsByElement.end())
+	{
+		for (auto& Property : From.ElementProperties)
+		{
+			auto Var = Vars->second.find(Property.Name.Text);
+			if (Var != Vars->second.end())
+				Symbols[Var->second].References.push_back(analysis::SymbolLocation{ .File = File, .Token = Property.Name });
+		}
+	}
+
+	for (auto& Child : From.Children)
+	{
+		AddElementReferences(Child, File, ElementsByName, VarsByElement, Symbols);
+	}
+}
+
+void analysis::Snapshot::BuildSymbolIndex()
+{
+	using Key = std::tuple<Symbol::SymbolKind, const void*, std::string_view>;
+
+	// Only used while building the index. Globals, constants and elements are identified by their declaration,
+	// vars by the element declaring them and their name.
+	std::map<Key, uint32_t> ByDeclaration;
+	std::unordered_map<std::string_view, uint32_t> ElementsByName;
+	VarIndex VarsByElement;
+
+	auto AddSymbol = [&](Symbol::SymbolKind Kind, const void* Declaration, const std::string& Name, const std::string& File, TokenPosition Token) {
+		uint32_t Index = uint32_t(Symbols.size());
+		std::string_view InternedName = StrUtil::Intern(Name);
+		Symbols.push_back(Symbol{
+			.Kind = Kind,
+			.Name = InternedName,
+			.Definition = SymbolLocation{ .File = StrUtil::Intern(File), .Token = Token },
+			.References = std::pmr::vector<SymbolLocation>(&Arena),
+			});
+		ByDeclaration.insert({ Key{ Kind, Declaration, Kind == Symbol::Var ? InternedName : std::string_view() }, Index });
+		return Index;
+		};
+
+	for (auto& i : Parsed.Elements)
+	{
+		uint32_t Index = AddSymbol(Symbol::Element, &i, i.FromToken.Text, i.File, i.FromToken);
+		ElementsByName.insert({ Symbols[Index].Name, Index });
+		auto& Vars = VarsByElement[Symbols[Index].Name];
+		for (auto& [Name, Variable] : i.Root.Variables)
+		{
+			uint32_t VarSymbol = AddSymbol(Symbol::Var, &i, Name, i.File, Variable.Token);
+			Symbols[VarSymbol].Owner = Index;
+			Vars.insert({ Symbols[VarSymbol].Name, VarSymbol });
+		}
+	}
+	for (auto& i : Parsed.Globals)
+	{
+		AddSymbol(Symbol::Global, &i, i.Name.Text, i.File, i.Name);
+	}
+	for (auto& i : Parsed.Constants)
+	{
+		AddSymbol(Symbol::Constant, &i, i.Name.Text, i.File, i.Name);
+	}
+
+	for (auto& [Name, Usages] : VariableUsages)
+	{
+		for (const VariableUsage& Usage : Usages)
+		{
+			Key UsageKey;
+			switch (Usage.Type)
+			{
+			case VariableUsage::Global:
+				UsageKey = Key{ Symbol::Global, Usage.FromGlobal, std::string_view() };
+				break;
+			case VariableUsage::Const:
+				UsageKey = Key{ Symbol::Constant, Usage.FromConstant, std::string_view() };
+				break;
+			case VariableUsage::Var:
+				UsageKey = Key{ Symbol::Var, Usage.VariableElement, Name };
+				break;
+			}
+			auto Found = ByDeclaration.find(UsageKey);
+			if (Found != ByDeclaration.end())
+				Symbols[Found->second].References.push_back(SymbolLocation{ .File = Usage.File, .Token = Usage.Token });
+		}
+	}
+
+	for (auto& i : Parsed.Elements)
+	{
+		AddElementReferences(i.Root, StrUtil::Intern(i.File), ElementsByName, VarsByElement, Symbols);
+	}
+
+	for (uint32_t Index = 0; Index < Symbols.size(); Index++)
+	{
+		Symbol& Current = Symbols[Index];
+		std::sort(Current.References.begin(), Current.References.end(), CompareLocations);
+		// The type name of an element's root can be the declaration's own name token.
+		std::erase_if(Current.References, [&Current](const SymbolLocation& Reference) {
+			return !CompareLocations(Reference, Current.Definition) && !CompareLocations(Current.Definition, Reference);
+			});
+
+		Occurrences[Current.Definition.File].push_back(SymbolOccurrence{
+			.Token = Current.Definition.Token,
+			.Symbol = Index,
+			.IsDefinition = true,
+			});
+		for (const SymbolLocation& Reference : Current.References)
+		{
+			Occurrences[Reference.File].push_back(SymbolOccurrence{
+				.Token = Reference.Token,
+				.Symbol = Index,
+				});
+		}
+	}
+
+	for (auto& [File, FileOccurrences] : Occurrences)
+	{
+		std::sort(FileOccurrences.begin(), FileOccurrences.end(), [](const SymbolOccurrence& a, const SymbolOccurrence& b) {
+			return std::tie(a.Token.Line, a.Token.BeginChar) < std::tie(b.Token.Line, b.Token.BeginChar);
+			});
+	}
+}
+
+const analysis::Symbol* analysis::Snapshot::GetSymbolAt(std::string_view File, size_t Line, size_t Character) const
+{
+	auto Found = Occurrences.find(File);
+	if (Found == Occurrences.end())
+		return nullptr;
+
+	// Finds the last occurrence starting at or before the position. Occurrences don't overlap.
+	const auto& FileOccurrences = Found->second;
+	auto After = std::upper_bound(FileOccurrences.begin(), FileOccurrences.end(), std::pair{ Line, Character },
+		[](const std::pair<size_t, size_t>& Position, const SymbolOccurrence& Occurrence) {
+			return Position < std::pair{ Occurrence.Token.Line, Occurrence.Token.BeginChar };
+		});
+	if (After == FileOccurrences.begin())
+		return nullptr;
+
+	const SymbolOccurrence& At = *std::prev(After);
+	if (!At.Token.Contains(Line, Character))
+		return nullptr;
+	return &Symbols[At.Symbol];
+}
+
+static size_t GetTokenSize(const kui::stringParse::StringToken& From)
+{
+	return sizeof(From) + From.Text.capacity();
+}
+
+static size_t GetElementSize(const kui::MarkupStructure::UIElement& From)
+{
+	size_t Size = sizeof(From) + GetTokenSize(From.TypeName) + GetTokenSize(From.ElementName);
+	for (auto& i : From.ElementProperties)
+	{
+		Size += GetTokenSize(i.Name) + GetTokenSize(i.Value);
+	}
+	for (auto& i : From.Variables)
+	{
+		Size += sizeof(i) + i.first.capacity() + i.second.Value.capacity();
+	}
+	for (auto& i : From.Children)
+	{
+		Size += GetElementSize(i);
+	}
+	return Size;
+}
+
+size_t analysis::Snapshot::GetMemoryUsage() const
+{
+	size_t Size = ArenaUpstream.Allocated;
+	for (auto& i : Parsed.Elements)
+	{
+		Size += GetElementSize(i.Root) + GetTokenSize(i.FromToken) + i.File.capacity();
+	}
+	for (auto& i : Parsed.Globals)
+	{
+		Size += sizeof(i) + i.Name.Text.capacity() + i.Value.capacity();
+	}
+	for (auto& i : Parsed.Constants)
+	{
+		Size += sizeof(i) + i.Name.Text.capacity() + i.Value.capacity();
+	}
+	for (auto& i : Diagnostics)
+	{
+		Size += sizeof(i) + i.Message.capacity();
+	}
+	return Size;
+}
@@ -0,0 +1,192 @@
+#pragma once
+#include <Markup/MarkupStructure.h>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include "Protocol.h"
+#include "Document.h"
+
+namespace analysis
+{
+	// Location of a token in a file. Unlike kui::stringParse::StringToken, this doesn't own a copy of the text.
+	struct TokenPosition
+	{
+		size_t Line = 0, BeginChar = 0, EndChar = 0;
+
+		TokenPosition() = default;
+		TokenPosition(const kui::stringParse::StringToken& From);
+
+		bool Contains(size_t Line, size_t Character) const;
+	};
+
+	struct VariableUsage
+	{
+		enum UsageType
+		{
+			Global,
+			Const,
+			Var,
+		};
+
+		UsageType Type = Global;
+		TokenPosition Token;
+		// Interned path of the file containing the usage.
+		std::string_view File;
+
+		union
+		{
+			kui::MarkupStructure::Global* FromGlobal;
+			kui::MarkupStructure::Constant* FromConstant;
+			kui::MarkupStructure::MarkupElement* VariableElement;
+		};
+	};
+
+	/**
+	 * An entry in the outline of a file. Element declarations with their child elements, globals and constants.
+	 * Positions are byte based.
+	 */
+	struct OutlineNode
+	{
+		enum NodeKind
+		{
+			Element,
+			Child,
+			Global,
+			Constant,
+		};
+
+		static constexpr uint32_t NO_PARENT = UINT32_MAX;
+
+		NodeKind Kind = Element;
+		// Interned name and type of the node.
+		std::string_view Name;
+		std::string_view Detail;
+		// Range of the whole declaration.
+		size_t StartLine = 0, StartChar = 0, EndLine = 0, EndChar = 0;
+		// Range of the declaration's name.
+		TokenPosition Selection;
+		// End of the element's type name, where its folding range begins. Only used by elements.
+		size_t FoldLine = 0, FoldChar = 0;
+		uint32_t Parent = NO_PARENT;
+		// Nodes are stored in document order, children directly follow their parent.
+		// This is the index one past the node's last descendant.
+		uint32_t SubtreeEnd = 0;
+
+		bool Contains(size_t Line, size_t Character) const;
+	};
+
+	using FileOutline = std::pmr::vector<OutlineNode>;
+
+	struct SymbolLocation
+	{
+		// Interned name of the file.
+		std::string_view File;
+		TokenPosition Token;
+	};
+
+	// A declaration that can be referenced: an element, a global, a constant or a var of an element.
+	struct Symbol
+	{
+		enum SymbolKind
+		{
+			Element,
+			Global,
+			Constant,
+			Var,
+		};
+
+		static constexpr uint32_t NO_OWNER = UINT32_MAX;
+
+		SymbolKind Kind = Element;
+		std::string_view Name;
+		SymbolLocation Definition;
+		// Index of the element symbol declaring a var.
+		uint32_t Owner = NO_OWNER;
+		// All usages of the symbol, sorted by file and position.
+		std::pmr::vector<SymbolLocation> References;
+
+		// Returns the range of References in the given file.
+		std::pair<const SymbolLocation*, const SymbolLocation*> GetReferencesIn(std::string_view File) const;
+	};
+
+	// The definition or a reference of a symbol in a file.
+	struct SymbolOccurrence
+	{
+		TokenPosition Token;
+		// Index into Snapshot::Symbols.
+		uint32_t Symbol = 0;
+		bool IsDefinition = false;
+	};
+
+	/**
+	 * Parse result of a single closed file whose content was evicted by the memory budget.
+	 * Analyses add it to their parse result instead of reading and parsing the file again.
+	 * The parser handles each file on its own, elements used from other files are only resolved by the verifier,
+	 * so a summary stays valid while other files change.
+	 */
+	struct FileSummary
+	{
+		std::vector<kui::MarkupStructure::MarkupElement> Elements;
+		std::vector<kui::MarkupStructure::Constant> Constants;
+		std::vector<kui::MarkupStructure::Global> Globals;
+		// Errors found while parsing the file.
+		std::vector<protocol::DiagnosticError> Diagnostics;
+	};
+
+	// Forwards allocations to the default memory resource and counts the allocated bytes.
+	class CountingResource : public std::pmr::memory_resource
+	{
+	public:
+		size_t Allocated = 0;
+
+	private:
+		void* do_allocate(size_t Bytes, size_t Alignment) override;
+		void do_deallocate(void* Pointer, size_t Bytes, size_t Alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource& Other) const noexcept override;
+	};
+
+	/**
+	 * The result of one analysis pass over the workspace.
+	 *
+	 * Data created by the analysis is allocated from the snapshot's arena,
+	 * so destroying the snapshot releases all of it at once.
+	 * Identifiers and file names are interned with StrUtil::Intern().
+	 */
+	struct Snapshot
+	{
+		Snapshot();
+		Snapshot(const Snapshot&) = delete;
+
+		// Creates the outline of every file from the parse result.
+		void BuildOutlines();
+		// Creates Symbols and Occurrences from the parse result and the variable usages.
+		void BuildSymbolIndex();
+
+		// Returns the symbol defined or referenced at the given byte based position, or nullptr.
+		const Symbol* GetSymbolAt(std::string_view File, size_t Line, size_t Character) const;
+
+		/**
+		 * Returns the approximate number of bytes used by the snapshot.
+		 * The size of the parse result is estimated from its elements, file contents shared with the workspace are not included.
+		 */
+		size_t GetMemoryUsage() const;
+
+		CountingResource ArenaUpstream;
+		std::pmr::monotonic_buffer_resource Arena;
+
+		kui::MarkupStructure::ParseResult Parsed;
+		// Key: Interned name of the variable.
+		std::pmr::unordered_map<std::string_view, std::pmr::vector<VariableUsage>> VariableUsages;
+		// Key: Interned name of the file.
+		std::pmr::unordered_map<std::string_view, FileOutline> Outlines;
+		std::pmr::vector<Symbol> Symbols;
+		// Key: Interned name of the file. Sorted by position.
+		std::pmr::unordered_map<std::string_view, std::pmr::vector<SymbolOccurrence>> Occurrences;
+		std::vector<protocol::DiagnosticError> Diagnostics;
+		// Contents of the files the snapshot was created from. Files evicted by the memory budget are not included.
+		std::map<std::string, workspace::ContentBuffer, std::less<>> Files;
+	};
+}
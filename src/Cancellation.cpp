@@ -0,0 +1,16 @@
+#include "Cancellation.h"
+
+std::atomic<uint64_t> analysis::DocumentGeneration = 0;
+
+analysis::CancellationToken analysis::CancellationToken::ForCurrentGeneration()
+{
+	CancellationToken Token;
+	Token.Cancellable = true;
+	Token.Generation = DocumentGeneration.load(std::memory_order_relaxed);
+	return Token;
+}
+
+bool analysis::CancellationToken::IsCancelled() const
+{
+	return Cancellable && DocumentGeneration.load(std::memory_order_relaxed) != Generation;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace analysis
+{
+	/**
+	 * Incremented by the reader thread whenever the client changes a document.
+	 * Work based on an older generation is outdated and can be abandoned.
+	 */
+	extern std::atomic<uint64_t> DocumentGeneration;
+
+	/**
+	 * Checked by the analysis stages between files and elements.
+	 * A default constructed token is never cancelled.
+	 */
+	class CancellationToken
+	{
+	public:
+		CancellationToken() = default;
+
+		// Returns a token that is cancelled once the client changes a document.
+		static CancellationToken ForCurrentGeneration();
+
+		bool IsCancelled() const;
+
+	private:
+		bool Cancellable = false;
+		uint64_t Generation = 0;
+	};
+}
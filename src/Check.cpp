@@ -0,0 +1,218 @@
+#include "Check.h"
+#include "Protocol.h"
+#include "Workspace.h"
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+namespace filesystem = std::filesystem;
+
+namespace check
+{
+	// A diagnostic with 1 based positions. Columns are counted in UTF-16 code units, like the language server does by default.
+	struct Diagnostic
+	{
+		const protocol::DiagnosticError* Error = nullptr;
+		size_t Line = 0, Column = 0, EndColumn = 0;
+	};
+
+	struct FileDiagnostics
+	{
+		std::string Path;
+		// The path relative to the checked directory, with forward slashes.
+		std::string RelativePath;
+		std::vector<Diagnostic> Diagnostics;
+	};
+
+	static const char* GetSeverityName(int32_t Severity)
+	{
+		switch (Severity)
+		{
+		case 1:
+			return "error";
+		case 2:
+			return "warning";
+		default:
+			return "note";
+		}
+	}
+
+	static const char* GetRuleId(const protocol::DiagnosticError& Error)
+	{
+		return Error.Type == protocol::DiagnosticError::Verify ? "kuiVerify" : "kuiParse";
+	}
+
+	// Converts the server's grouping of the diagnostics. Files without diagnostics are left out.
+	static std::vector<FileDiagnostics> GroupDiagnostics(const std::vector<protocol::DiagnosticError>& Errors, const std::string& Directory)
+	{
+		std::vector<FileDiagnostics> Out;
+		for (const protocol::FileDiagnostics& File : protocol::GroupDiagnostics(Errors))
+		{
+			if (File.Errors.empty())
+				continue;
+
+			FileDiagnostics& Grouped = Out.emplace_back();
+			Grouped.Path = File.File;
+			Grouped.RelativePath = filesystem::path(File.File).lexically_relative(Directory).generic_string();
+			if (Grouped.RelativePath.empty())
+				Grouped.RelativePath = filesystem::path(File.File).generic_string();
+
+			for (const protocol::DiagnosticError* Error : File.Errors)
+			{
+				Grouped.Diagnostics.push_back(Diagnostic{
+					.Error = Error,
+					.Line = Error->Line + 1,
+					.Column = (File.Lines ? File.Lines->ToClientColumn(Error->Line, Error->Begin) : Error->Begin) + 1,
+					.EndColumn = (File.Lines ? File.Lines->ToClientColumn(Error->Line, Error->End) : Error->End) + 1,
+					});
+			}
+		}
+		return Out;
+	}
+
+	static void WriteText(const std::vector<FileDiagnostics>& Files)
+	{
+		for (const FileDiagnostics& File : Files)
+		{
+			for (const Diagnostic& i : File.Diagnostics)
+			{
+				std::cout << File.Path << ":" << i.Line << ":" << i.Column << ": "
+					<< GetSeverityName(i.Error->Severity) << ": " << i.Error->Message
+					<< " [" << GetRuleId(*i.Error) << "]\n";
+			}
+		}
+	}
+
+	static json GetJson(const std::vector<FileDiagnostics>& Files, size_t CheckedFiles, size_t Errors)
+	{
+		json FilesJson = json::array();
+		for (const FileDiagnostics& File : Files)
+		{
+			json Diagnostics = json::array();
+			for (const Diagnostic& i : File.Diagnostics)
+			{
+				Diagnostics.push_back({
+					{ "line", i.Line },
+					{ "column", i.Column },
+					{ "endColumn", i.EndColumn },
+					{ "severity", GetSeverityName(i.Error->Severity) },
+					{ "code", GetRuleId(*i.Error) },
+					{ "message", i.Error->Message },
+					});
+			}
+			FilesJson.push_back({
+				{ "file", File.Path },
+				{ "diagnostics", std::move(Diagnostics) },
+				});
+		}
+
+		return {
+			{ "checkedFiles", CheckedFiles },
+			{ "errors", Errors },
+			{ "files", std::move(FilesJson) },
+		};
+	}
+
+	static json GetSarif(const std::vector<FileDiagnostics>& Files, const std::string& Directory)
+	{
+		json Results = json::array();
+		for (const FileDiagnostics& File : Files)
+		{
+			for (const Diagnostic& i : File.Diagnostics)
+			{
+				Results.push_back({
+					{ "ruleId", GetRuleId(*i.Error) },
+					{ "level", GetSeverityName(i.Error->Severity) },
+					{ "message", { { "text", i.Error->Message } } },
+					{ "locations", { {
+						{ "physicalLocation", {
+							{ "artifactLocation", {
+								{ "uri", File.RelativePath },
+								{ "uriBaseId", "SRCROOT" },
+							} },
+							{ "region", {
+								{ "startLine", i.Line },
+								{ "startColumn", i.Column },
+								{ "endColumn", std::max(i.EndColumn, i.Column + 1) },
+							} },
+						} },
+					} } },
+					});
+			}
+		}
+
+		std::string Root = filesystem::absolute(Directory).generic_string();
+		if (!Root.ends_with('/'))
+			Root.push_back('/');
+		if (!Root.starts_with('/'))
+			Root.insert(Root.begin(), '/');
+
+		return {
+			{ "$schema", "https://json.schemastore.org/sarif-2.1.0.json" },
+			{ "version", "2.1.0" },
+			{ "runs", { {
+				{ "tool", { { "driver", {
+					{ "name", "KlemmUILanguageServer" },
+					{ "rules", {
+						{ { "id", "kuiParse" }, { "shortDescription", { { "text", "KlemmUI markup parse error" } } } },
+						{ { "id", "kuiVerify" }, { "shortDescription", { { "text", "KlemmUI markup verification error" } } } },
+					} },
+				} } } },
+				{ "originalUriBaseIds", { { "SRCROOT", { { "uri", "file://" + Root } } } } },
+				{ "results", std::move(Results) },
+			} } },
+		};
+	}
+}
+
+bool check::ParseFormat(std::string_view Name, OutputFormat& Out)
+{
+	if (Name == "text")
+		Out = OutputFormat::Text;
+	else if (Name == "json")
+		Out = OutputFormat::Json;
+	else if (Name == "sarif")
+		Out = OutputFormat::Sarif;
+	else
+		return false;
+	return true;
+}
+
+int check::Run(std::string Directory, OutputFormat Format, size_t Threads)
+{
+	if (!filesystem::is_directory(Directory))
+	{
+		std::cerr << "not a directory: " << Directory << std::endl;
+		return 2;
+	}
+	if (Threads == 0)
+		Threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	workspace::CurrentWorkspacePath = Directory;
+	workspace::LoadAllFiles(Threads);
+	protocol::UpdateAnalysis();
+
+	const std::vector<protocol::DiagnosticError>& Diagnostics = protocol::GetDiagnostics();
+	std::vector<FileDiagnostics> Grouped = GroupDiagnostics(Diagnostics, Directory);
+	size_t Errors = std::count_if(Diagnostics.begin(), Diagnostics.end(), [](const protocol::DiagnosticError& i) {
+		return i.Severity == 1;
+		});
+
+	switch (Format)
+	{
+	case OutputFormat::Text:
+		WriteText(Grouped);
+		std::cerr << "checked " << workspace::Files.size() << " files: "
+			<< Errors << " errors in " << Grouped.size() << " files" << std::endl;
+		break;
+	case OutputFormat::Json:
+		std::cout << GetJson(Grouped, workspace::Files.size(), Errors).dump(2) << std::endl;
+		break;
+	case OutputFormat::Sarif:
+		std::cout << GetSarif(Grouped, Directory).dump(2) << std::endl;
+		break;
+	}
+	std::cout << std::flush;
+
+	return Errors > 0 ? 1 : 0;
+}
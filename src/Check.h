@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+/**
+ * Headless checking of a directory, for CI.
+ *
+ * Runs the same parse and verify passes as the language server on all UI files in the directory
+ * and writes the diagnostics to stdout.
+ */
+namespace check
+{
+	enum class OutputFormat
+	{
+		// One "file:line:column: severity: message" line per diagnostic.
+		Text,
+		Json,
+		// SARIF 2.1.0, understood by most CI code scanning tools.
+		Sarif,
+	};
+
+	// Parses the name of an output format. Returns false if the name is unknown.
+	bool ParseFormat(std::string_view Name, OutputFormat& Out);
+
+	/**
+	 * Checks the directory. Files are read on the given number of threads, 0 uses one thread per core.
+	 * Parsing and verifying is a single pass over all files on the calling thread, like in the server.
+	 * Returns the exit code of the process: 0 if there were no errors, 1 if there were errors and 2 if the directory couldn't be checked.
+	 */
+	int Run(std::string Directory, OutputFormat Format, size_t Threads);
+}
@@ -0,0 +1,222 @@
+#include "Document.h"
+#include <algorithm>
+
+workspace::Document::Document(ContentBuffer Text)
+{
+	SetText(Text);
+}
+
+void workspace::Document::SetText(ContentBuffer Text)
+{
+	Original = Text ? Text : std::make_shared<const std::string>();
+	Added.clear();
+	Pieces.clear();
+	Size = Original->size();
+	if (Size)
+		Pieces.push_back(Piece{ .FromAdded = false, .Start = 0, .Length = Size });
+
+	LineStarts = { 0 };
+	for (size_t i = 0; i < Size; i++)
+	{
+		if ((*Original)[i] == '\n')
+			LineStarts.push_back(i + 1);
+	}
+
+	Content = Original;
+	ChangedLines = LineRange{ 0, LineStarts.size() - 1 };
+}
+
+void workspace::Document::Replace(Position Begin, Position End, std::string_view NewText)
+{
+	size_t BeginOffset = GetOffset(Begin);
+	size_t EndOffset = GetOffset(End);
+	if (EndOffset < BeginOffset)
+	{
+		std::swap(BeginOffset, EndOffset);
+		std::swap(Begin, End);
+	}
+	size_t BeginLine = std::min(Begin.Line, LineStarts.size() - 1);
+	size_t EndLine = std::min(End.Line, LineStarts.size() - 1);
+
+	size_t First = SplitAt(BeginOffset);
+	size_t Last = SplitAt(EndOffset);
+	Pieces.erase(Pieces.begin() + First, Pieces.begin() + Last);
+
+	if (!NewText.empty())
+	{
+		size_t AddedStart = Added.size();
+		Added.append(NewText);
+
+		// Consecutive typing appends to the previous piece instead of creating a new one.
+		if (First > 0
+			&& Pieces[First - 1].FromAdded
+			&& Pieces[First - 1].Start + Pieces[First - 1].Length == AddedStart)
+		{
+			Pieces[First - 1].Length += NewText.size();
+		}
+		else
+		{
+			Pieces.insert(Pieces.begin() + First, Piece{ .FromAdded = true, .Start = AddedStart, .Length = NewText.size() });
+		}
+	}
+
+	Size = Size - (EndOffset - BeginOffset) + NewText.size();
+
+	// Update the line index: Remove the line breaks inside the replaced range,
+	// move the following lines and add the line breaks of the inserted text.
+	auto FirstRemoved = std::upper_bound(LineStarts.begin(), LineStarts.end(), BeginOffset);
+	auto LastRemoved = std::upper_bound(FirstRemoved, LineStarts.end(), EndOffset);
+	auto Inserted = LineStarts.erase(FirstRemoved, LastRemoved);
+
+	for (auto i = Inserted; i < LineStarts.end(); i++)
+	{
+		*i = *i + NewText.size() - (EndOffset - BeginOffset);
+	}
+
+	std::vector<size_t> NewLineStarts;
+	for (size_t i = 0; i < NewText.size(); i++)
+	{
+		if (NewText[i] == '\n')
+			NewLineStarts.push_back(BeginOffset + i + 1);
+	}
+	LineStarts.insert(Inserted, NewLineStarts.begin(), NewLineStarts.end());
+
+	MarkChanged(BeginLine, EndLine - BeginLine, NewLineStarts.size());
+	Content = nullptr;
+}
+
+workspace::ContentBuffer workspace::Document::GetContent()
+{
+	if (Content)
+		return Content;
+
+	std::string Text;
+	Text.reserve(Size);
+	for (const Piece& i : Pieces)
+	{
+		if (i.FromAdded)
+			Text.append(Added, i.Start, i.Length);
+		else
+			Text.append(*Original, i.Start, i.Length);
+	}
+
+	// The created text becomes the new original buffer, which keeps the piece table short.
+	Original = std::make_shared<const std::string>(std::move(Text));
+	Added.clear();
+	Pieces.clear();
+	if (Size)
+		Pieces.push_back(Piece{ .FromAdded = false, .Start = 0, .Length = Size });
+	Content = Original;
+	return Content;
+}
+
+size_t workspace::Document::GetSize() const
+{
+	return Size;
+}
+
+size_t workspace::Document::GetLineCount() const
+{
+	return LineStarts.size();
+}
+
+size_t workspace::Document::GetLineStart(size_t Line) const
+{
+	if (Line >= LineStarts.size())
+		return Size;
+	return LineStarts[Line];
+}
+
+size_t workspace::Document::GetOffset(Position At) const
+{
+	if (At.Line >= LineStarts.size())
+		return Size;
+
+	size_t LineStart = LineStarts[At.Line];
+	// A character past the end of the line refers to the end of the line, before the line break.
+	size_t LineEnd = At.Line + 1 < LineStarts.size() ? LineStarts[At.Line + 1] - 1 : Size;
+	return std::min(LineStart + At.Character, LineEnd);
+}
+
+std::string workspace::Document::GetLine(size_t Line) const
+{
+	size_t Begin = GetLineStart(Line);
+	size_t End = GetLineStart(Line + 1);
+
+	std::string Out;
+	size_t PieceStart = 0;
+	for (const Piece& i : Pieces)
+	{
+		size_t PieceEnd = PieceStart + i.Length;
+		if (PieceEnd > Begin && PieceStart < End)
+		{
+			size_t From = std::max(Begin, PieceStart) - PieceStart;
+			size_t To = std::min(End, PieceEnd) - PieceStart;
+			const std::string& Buffer = i.FromAdded ? Added : *Original;
+			Out.append(Buffer, i.Start + From, To - From);
+		}
+		if (PieceEnd >= End)
+			break;
+		PieceStart = PieceEnd;
+	}
+	return Out;
+}
+
+std::optional<workspace::Document::LineRange> workspace::Document::TakeChangedLines()
+{
+	auto Changed = ChangedLines;
+	ChangedLines.reset();
+	return Changed;
+}
+
+size_t workspace::Document::SplitAt(size_t Offset)
+{
+	size_t PieceStart = 0;
+	for (size_t i = 0; i < Pieces.size(); i++)
+	{
+		Piece& Current = Pieces[i];
+		if (PieceStart == Offset)
+			return i;
+
+		if (PieceStart + Current.Length > Offset)
+		{
+			size_t SplitLength = Offset - PieceStart;
+			Piece Second = Piece{
+				.FromAdded = Current.FromAdded,
+				.Start = Current.Start + SplitLength,
+				.Length = Current.Length - SplitLength,
+			};
+			Current.Length = SplitLength;
+			Pieces.insert(Pieces.begin() + i + 1, Second);
+			return i + 1;
+		}
+		PieceStart += Current.Length;
+	}
+	return Pieces.size();
+}
+
+void workspace::Document::MarkChanged(size_t FirstLine, size_t RemovedLines, size_t InsertedLines)
+{
+	LineRange Changed = LineRange{ FirstLine, FirstLine + InsertedLines };
+
+	if (ChangedLines.has_value())
+	{
+		LineRange& Previous = ChangedLines.value();
+		// Lines after the edit moved by the number of added or removed line breaks.
+		if (Previous.Last > FirstLine + RemovedLines)
+			Previous.Last = Previous.Last + InsertedLines - RemovedLines;
+		else if (Previous.Last > FirstLine)
+			Previous.Last = FirstLine + InsertedLines;
+
+		Changed.First = std::min(Changed.First, Previous.First);
+		Changed.Last = std::max(Changed.Last, Previous.Last);
+	}
+	ChangedLines = Changed;
+}
+
+size_t workspace::Document::GetMemoryUsage() const
+{
+	return Added.capacity()
+		+ Pieces.capacity() * sizeof(Piece)
+		+ LineStarts.capacity() * sizeof(size_t);
+}
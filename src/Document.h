@@ -0,0 +1,86 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <memory>
+
+namespace workspace
+{
+	/**
+	 * The content of a file. Buffers are never modified after they have been created,
+	 * so they can be shared between the workspace, the parser and the preview without copying.
+	 */
+	using ContentBuffer = std::shared_ptr<const std::string>;
+
+	/**
+	 * The text of a document opened by the client.
+	 *
+	 * The text is stored as a piece table, so applying an edit only appends the inserted text
+	 * and doesn't copy the document. The full text is only created when GetContent() is called.
+	 * A line start index is kept up to date with every edit.
+	 */
+	class Document
+	{
+	public:
+		struct Position
+		{
+			size_t Line = 0;
+			// Byte offset into the line.
+			size_t Character = 0;
+		};
+
+		// Range of lines, including the last line.
+		struct LineRange
+		{
+			size_t First = 0;
+			size_t Last = 0;
+		};
+
+		Document(ContentBuffer Text);
+
+		void SetText(ContentBuffer Text);
+		void Replace(Position Begin, Position End, std::string_view NewText);
+
+		ContentBuffer GetContent();
+
+		size_t GetSize() const;
+		size_t GetLineCount() const;
+		size_t GetLineStart(size_t Line) const;
+		size_t GetOffset(Position At) const;
+		// Returns the text of the given line, including the line break.
+		std::string GetLine(size_t Line) const;
+
+		/**
+		 * Returns the lines modified since the last call and resets the modified range.
+		 * Lines are in the coordinates of the current text.
+		 */
+		std::optional<LineRange> TakeChangedLines();
+
+		// Returns the number of bytes used by the edit buffers, not including the original text.
+		size_t GetMemoryUsage() const;
+
+	private:
+		struct Piece
+		{
+			bool FromAdded = false;
+			size_t Start = 0;
+			size_t Length = 0;
+		};
+
+		size_t SplitAt(size_t Offset);
+		void MarkChanged(size_t FirstLine, size_t RemovedLines, size_t InsertedLines);
+
+		// Immutable buffer containing the text the pieces were created from.
+		ContentBuffer Original;
+		// Append-only buffer containing all inserted text.
+		std::string Added;
+		std::vector<Piece> Pieces;
+		std::vector<size_t> LineStarts;
+		size_t Size = 0;
+
+		// Cached result of GetContent(), reset by edits.
+		ContentBuffer Content;
+		std::optional<LineRange> ChangedLines;
+	};
+}
@@ -0,0 +1,246 @@
+#include "DocumentChange.h"
+#include <initializer_list>
+
+using namespace nlohmann;
+
+namespace
+{
+	class ChangeDecoder : public json::json_sax_t
+	{
+	public:
+		DocumentChange Out;
+		bool IsChange = false;
+		bool IsJsonRpc = false;
+		bool HasID = false;
+		// Number of changes that have a text.
+		size_t HasText = 0;
+		// The position fields found in the range of each change, see RangeField.
+		std::vector<uint8_t> RangeFields;
+
+		enum RangeField : uint8_t
+		{
+			StartLine = 1,
+			StartCharacter = 2,
+			EndLine = 4,
+			EndCharacter = 8,
+			AllFields = 15,
+		};
+
+		bool null() override
+		{
+			return Scalar();
+		}
+		bool boolean(bool) override
+		{
+			return Scalar();
+		}
+		bool number_integer(number_integer_t Number) override
+		{
+			return Integer(Number);
+		}
+		bool number_unsigned(number_unsigned_t Number) override
+		{
+			return Integer(int64_t(Number));
+		}
+		bool number_float(number_float_t, const string_t&) override
+		{
+			return Scalar();
+		}
+		bool binary(binary_t&) override
+		{
+			return Scalar();
+		}
+
+		bool string(string_t& Text) override
+		{
+			if (Is({ "jsonrpc" }))
+				IsJsonRpc = Text == "2.0";
+			else if (Is({ "method" }))
+			{
+				// Other messages are parsed as json, there's no point in decoding the rest.
+				IsChange = Text == "textDocument/didChange";
+				if (!IsChange)
+					return false;
+			}
+			else if (Is({ "params", "textDocument", "uri" }))
+				Out.Uri = std::move(Text);
+			else if (Is({ "params", "contentChanges", "[]", "text" }))
+			{
+				// The parser's token buffer is cleared before the next token, so the text can be taken instead of copied.
+				Out.Changes.back().Text = std::move(Text);
+				HasText++;
+			}
+			return Scalar();
+		}
+
+		bool start_object(std::size_t) override
+		{
+			if (Is({ "params", "contentChanges", "[]" }))
+			{
+				Out.Changes.emplace_back();
+				RangeFields.push_back(0);
+			}
+			else if (Is({ "params", "contentChanges", "[]", "range" }))
+				Out.Changes.back().HasRange = true;
+			// Ranges only contain the start and end objects with integers, anything else is left to FromJson().
+			else if (IsInRange() && Frames.size() != 5)
+				return false;
+			Value();
+			Frames.push_back(Frame{});
+			return true;
+		}
+		bool key(string_t& Key) override
+		{
+			Frames.back().Key = std::move(Key);
+			return true;
+		}
+		bool end_object() override
+		{
+			Frames.pop_back();
+			return true;
+		}
+		bool start_array(std::size_t) override
+		{
+			if (IsInRange())
+				return false;
+			Value();
+			Frames.push_back(Frame{ .Key = {}, .IsArray = true });
+			return true;
+		}
+		bool end_array() override
+		{
+			Frames.pop_back();
+			return true;
+		}
+
+		bool parse_error(std::size_t, const std::string&, const detail::exception&) override
+		{
+			return false;
+		}
+
+	private:
+		struct Frame
+		{
+			std::string Key;
+			bool IsArray = false;
+		};
+		std::vector<Frame> Frames;
+
+		// Returns true if the current value is at the given path. Array elements are matched by "[]".
+		bool Is(std::initializer_list<std::string_view> Path) const
+		{
+			if (Path.size() != Frames.size())
+				return false;
+			size_t i = 0;
+			for (std::string_view Key : Path)
+			{
+				const Frame& f = Frames[i++];
+				if (f.IsArray ? Key != "[]" : Key != f.Key)
+					return false;
+			}
+			return true;
+		}
+
+		// Returns true if the current value is the range of a change, or inside of it.
+		bool IsInRange() const
+		{
+			return Frames.size() >= 4
+				&& !Frames[0].IsArray && Frames[0].Key == "params"
+				&& !Frames[1].IsArray && Frames[1].Key == "contentChanges"
+				&& Frames[2].IsArray
+				&& !Frames[3].IsArray && Frames[3].Key == "range";
+		}
+
+		bool Value()
+		{
+			if (Is({ "id" }))
+				HasID = true;
+			return true;
+		}
+
+		// Any value other than an integer or a container.
+		bool Scalar()
+		{
+			if (IsInRange())
+				return false;
+			return Value();
+		}
+
+		bool Integer(int64_t Number)
+		{
+			if (Is({ "params", "textDocument", "version" }))
+				Out.Version = Number;
+			else if (Frames.size() == 6 && Is({ "params", "contentChanges", "[]", "range", Frames[4].Key, Frames[5].Key }))
+			{
+				DocumentChange::Change& Current = Out.Changes.back();
+				bool IsStart = Frames[4].Key == "start";
+				bool IsEnd = Frames[4].Key == "end";
+				DocumentChange::Position* At = IsStart ? &Current.Start : (IsEnd ? &Current.End : nullptr);
+
+				if (At && Frames[5].Key == "line")
+				{
+					At->Line = size_t(Number);
+					RangeFields.back() |= IsStart ? StartLine : EndLine;
+				}
+				else if (At && Frames[5].Key == "character")
+				{
+					At->Character = size_t(Number);
+					RangeFields.back() |= IsStart ? StartCharacter : EndCharacter;
+				}
+			}
+			else if (IsInRange())
+				return false;
+			return Value();
+		}
+	};
+}
+
+std::optional<DocumentChange> DocumentChange::Decode(std::string_view Content)
+{
+	// Cheap check so other messages don't go through the decoder first.
+	if (Content.find("\"textDocument/didChange\"") == std::string_view::npos)
+		return std::nullopt;
+
+	ChangeDecoder Decoder;
+	if (!json::sax_parse(Content.begin(), Content.end(), &Decoder))
+		return std::nullopt;
+	if (!Decoder.IsChange || !Decoder.IsJsonRpc || Decoder.HasID || Decoder.Out.Uri.empty()
+		|| Decoder.HasText != Decoder.Out.Changes.size())
+		return std::nullopt;
+	// Incomplete ranges are rejected by FromJson().
+	for (size_t i = 0; i < Decoder.Out.Changes.size(); i++)
+	{
+		if (Decoder.Out.Changes[i].HasRange && Decoder.RangeFields[i] != ChangeDecoder::AllFields)
+			return std::nullopt;
+	}
+	return std::move(Decoder.Out);
+}
+
+DocumentChange DocumentChange::FromJson(const json& Params)
+{
+	auto GetPosition = [](const json& From) {
+		return Position{
+			.Line = From.at("line"),
+			.Character = From.at("character"),
+		};
+		};
+
+	DocumentChange Out;
+	const json& TextDocument = Params.at("textDocument");
+	Out.Uri = TextDocument.at("uri");
+	if (TextDocument.contains("version"))
+		Out.Version = TextDocument.at("version");
+
+	for (const json& From : Params.at("contentChanges"))
+	{
+		Change& New = Out.Changes.emplace_back();
+		New.Text = From.at("text");
+		if (From.contains("range"))
+		{
+			New.HasRange = true;
+			New.Start = GetPosition(From.at("range").at("start"));
+			New.End = GetPosition(From.at("range").at("end"));
+		}
+	}
+	return Out;
+}
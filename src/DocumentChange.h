@@ -0,0 +1,45 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <cstdint>
+
+/**
+ * The parameters of a textDocument/didChange notification.
+ *
+ * These notifications are sent on every keystroke, so they're decoded with a SAX parser instead of building a json tree.
+ * The change text is unescaped once by the parser and moved into the change.
+ */
+struct DocumentChange
+{
+	struct Position
+	{
+		size_t Line = 0;
+		size_t Character = 0;
+	};
+
+	struct Change
+	{
+		// A change without a range replaces the whole document.
+		bool HasRange = false;
+		Position Start;
+		Position End;
+		std::string Text;
+	};
+
+	std::string Uri;
+	int64_t Version = 0;
+	std::vector<Change> Changes;
+
+	/**
+	 * Decodes a complete didChange message.
+	 * Returns nothing if the content is a different message or not structured as expected,
+	 * it should then be parsed as json instead.
+	 */
+	static std::optional<DocumentChange> Decode(std::string_view Content);
+
+	// Converts the params of an already parsed didChange message.
+	static DocumentChange FromJson(const nlohmann::json& Params);
+};
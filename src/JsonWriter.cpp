@@ -0,0 +1,230 @@
+#include "JsonWriter.h"
+#include <charconv>
+
+JsonWriter::JsonWriter(std::string& Out)
+	: Out(Out)
+{
+}
+
+void JsonWriter::BeginObject()
+{
+	Separate();
+	Out.push_back('{');
+	NeedsComma = false;
+}
+
+void JsonWriter::EndObject()
+{
+	Out.push_back('}');
+	NeedsComma = true;
+}
+
+void JsonWriter::BeginArray()
+{
+	Separate();
+	Out.push_back('[');
+	NeedsComma = false;
+}
+
+void JsonWriter::EndArray()
+{
+	Out.push_back(']');
+	NeedsComma = true;
+}
+
+void JsonWriter::Key(std::string_view Name)
+{
+	String(Name);
+	Out.push_back(':');
+	NeedsComma = false;
+}
+
+// Returns the length of the valid UTF-8 sequence starting at the given index, or 0 if it isn't valid.
+static size_t GetSequenceLength(std::string_view Text, size_t At)
+{
+	unsigned char c = Text[At];
+	size_t Length = 0;
+	uint32_t CodePoint = 0, Min = 0;
+	if ((c & 0xE0) == 0xC0)
+	{
+		Length = 2;
+		CodePoint = c & 0x1F;
+		Min = 0x80;
+	}
+	else if ((c & 0xF0) == 0xE0)
+	{
+		Length = 3;
+		CodePoint = c & 0x0F;
+		Min = 0x800;
+	}
+	else if ((c & 0xF8) == 0xF0)
+	{
+		Length = 4;
+		CodePoint = c & 0x07;
+		Min = 0x10000;
+	}
+	else
+		return 0;
+
+	if (At + Length > Text.size())
+		return 0;
+	for (size_t i = 1; i < Length; i++)
+	{
+		unsigned char Next = Text[At + i];
+		if ((Next & 0xC0) != 0x80)
+			return 0;
+		CodePoint = (CodePoint << 6) | (Next & 0x3F);
+	}
+	// Overlong encodings, surrogates and values outside of Unicode.
+	if (CodePoint < Min || (CodePoint >= 0xD800 && CodePoint <= 0xDFFF) || CodePoint > 0x10FFFF)
+		return 0;
+	return Length;
+}
+
+void JsonWriter::String(std::string_view Value)
+{
+	static const char HexDigits[] = "0123456789abcdef";
+
+	Separate();
+	Out.push_back('"');
+	size_t Start = 0;
+	for (size_t i = 0; i < Value.size(); i++)
+	{
+		unsigned char c = Value[i];
+		if (c >= 0x80)
+		{
+			size_t Length = GetSequenceLength(Value, i);
+			if (Length > 0)
+			{
+				i += Length - 1;
+				continue;
+			}
+			Out.append(Value.substr(Start, i - Start));
+			Start = i + 1;
+			Out.append("\xEF\xBF\xBD");
+			continue;
+		}
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		// Unescaped characters are appended in runs.
+		Out.append(Value.substr(Start, i - Start));
+		Start = i + 1;
+		switch (c)
+		{
+		case '"':
+			Out.append("\\\"");
+			break;
+		case '\\':
+			Out.append("\\\\");
+			break;
+		case '\n':
+			Out.append("\\n");
+			break;
+		case '\r':
+			Out.append("\\r");
+			break;
+		case '\t':
+			Out.append("\\t");
+			break;
+		case '\b':
+			Out.append("\\b");
+			break;
+		case '\f':
+			Out.append("\\f");
+			break;
+		default:
+			Out.append("\\u00");
+			Out.push_back(HexDigits[c >> 4]);
+			Out.push_back(HexDigits[c & 0xf]);
+			break;
+		}
+	}
+	Out.append(Value.substr(Start));
+	Out.push_back('"');
+	NeedsComma = true;
+}
+
+void JsonWriter::Int(int64_t Value)
+{
+	Separate();
+	char Buffer[24];
+	auto Result = std::to_chars(Buffer, Buffer + sizeof(Buffer), Value);
+	Out.append(Buffer, Result.ptr);
+	NeedsComma = true;
+}
+
+void JsonWriter::UInt(uint64_t Value)
+{
+	Separate();
+	char Buffer[24];
+	auto Result = std::to_chars(Buffer, Buffer + sizeof(Buffer), Value);
+	Out.append(Buffer, Result.ptr);
+	NeedsComma = true;
+}
+
+void JsonWriter::Bool(bool Value)
+{
+	Separate();
+	Out.append(Value ? "true" : "false");
+	NeedsComma = true;
+}
+
+void JsonWriter::Null()
+{
+	Separate();
+	Out.append("null");
+	NeedsComma = true;
+}
+
+void JsonWriter::Value(const nlohmann::json& Value)
+{
+	using nlohmann::json;
+
+	switch (Value.type())
+	{
+	case json::value_t::object:
+		BeginObject();
+		for (auto& [Name, Member] : Value.items())
+		{
+			Key(Name);
+			this->Value(Member);
+		}
+		EndObject();
+		break;
+	case json::value_t::array:
+		BeginArray();
+		for (const json& Element : Value)
+			this->Value(Element);
+		EndArray();
+		break;
+	case json::value_t::string:
+		String(Value.get_ref<const std::string&>());
+		break;
+	case json::value_t::number_integer:
+		Int(Value.get<int64_t>());
+		break;
+	case json::value_t::number_unsigned:
+		UInt(Value.get<uint64_t>());
+		break;
+	case json::value_t::boolean:
+		Bool(Value.get<bool>());
+		break;
+	case json::value_t::null:
+	case json::value_t::discarded:
+		Null();
+		break;
+	default:
+		// Floats and binary values aren't used by the protocol, the json library formats them.
+		Separate();
+		Out.append(Value.dump());
+		NeedsComma = true;
+		break;
+	}
+}
+
+void JsonWriter::Separate()
+{
+	if (NeedsComma)
+		Out.push_back(',');
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * Writes json text directly into a string, without building a json tree first.
+ *
+ * Used for large responses. Handlers write their result straight into the output buffer of the message.
+ * The writer only inserts separators, it doesn't check that the written structure is valid.
+ * Each byte of a string that isn't part of a valid UTF-8 sequence is written as U+FFFD, so the output always parses.
+ */
+class JsonWriter
+{
+public:
+	JsonWriter(std::string& Out);
+
+	void BeginObject();
+	void EndObject();
+	void BeginArray();
+	void EndArray();
+
+	// Writes the key of the next object member.
+	void Key(std::string_view Name);
+
+	void String(std::string_view Value);
+	void Int(int64_t Value);
+	void UInt(uint64_t Value);
+	void Bool(bool Value);
+	void Null();
+	// Writes an existing json value.
+	void Value(const nlohmann::json& Value);
+
+	template<typename T>
+	void Field(std::string_view Name, const T& Value)
+	{
+		Key(Name);
+		if constexpr (std::is_same_v<T, bool>)
+			Bool(Value);
+		else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+			Int(Value);
+		else if constexpr (std::is_integral_v<T>)
+			UInt(Value);
+		else if constexpr (std::is_convertible_v<const T&, std::string_view>)
+			String(Value);
+		else
+			this->Value(Value);
+	}
+
+private:
+	void Separate();
+
+	std::string& Out;
+	bool NeedsComma = false;
+};
@@ -0,0 +1,127 @@
+#include "LineIndex.h"
+#include <algorithm>
+
+workspace::PositionEncoding workspace::ClientEncoding = workspace::PositionEncoding::Utf16;
+
+// Returns the number of bytes of the UTF-8 sequence starting with the given byte.
+static size_t GetSequenceLength(unsigned char LeadByte)
+{
+	if (LeadByte < 0x80)
+		return 1;
+	if ((LeadByte & 0xE0) == 0xC0)
+		return 2;
+	if ((LeadByte & 0xF0) == 0xE0)
+		return 3;
+	if ((LeadByte & 0xF8) == 0xF0)
+		return 4;
+	// Invalid lead byte or continuation byte. Treated as a single character.
+	return 1;
+}
+
+workspace::LineIndex::LineIndex(ContentBuffer Content)
+{
+	this->Content = Content ? Content : std::make_shared<const std::string>();
+
+	const std::string& Text = *this->Content;
+	LineStarts.push_back(0);
+	bool Ascii = true;
+	for (size_t i = 0; i < Text.size(); i++)
+	{
+		unsigned char c = Text[i];
+		if (c >= 0x80)
+		{
+			Ascii = false;
+		}
+		else if (c == '\n')
+		{
+			AsciiLines.push_back(Ascii);
+			LineStarts.push_back(uint32_t(i + 1));
+			Ascii = true;
+		}
+	}
+	AsciiLines.push_back(Ascii);
+}
+
+const workspace::ContentBuffer& workspace::LineIndex::GetContent() const
+{
+	return Content;
+}
+
+size_t workspace::LineIndex::GetLineCount() const
+{
+	return LineStarts.size();
+}
+
+std::string_view workspace::LineIndex::GetLine(size_t Line) const
+{
+	if (Line >= LineStarts.size())
+		return {};
+	size_t End = Line + 1 < LineStarts.size() ? LineStarts[Line + 1] : Content->size();
+	return std::string_view(*Content).substr(LineStarts[Line], End - LineStarts[Line]);
+}
+
+size_t workspace::LineIndex::ToByteColumn(size_t Line, size_t Column) const
+{
+	if (ClientEncoding == PositionEncoding::Utf8 || Line >= LineStarts.size() || AsciiLines[Line])
+		return Column;
+	return Utf16ToByteColumn(GetLine(Line), Column);
+}
+
+size_t workspace::LineIndex::ToClientColumn(size_t Line, size_t ByteColumn) const
+{
+	if (ClientEncoding == PositionEncoding::Utf8 || Line >= LineStarts.size() || AsciiLines[Line])
+		return ByteColumn;
+	return ByteToUtf16Column(GetLine(Line), ByteColumn);
+}
+
+size_t workspace::LineIndex::Utf16ToByteColumn(std::string_view Line, size_t Column)
+{
+	size_t Byte = 0;
+	size_t Utf16 = 0;
+	while (Byte < Line.size() && Utf16 < Column)
+	{
+		size_t Length = GetSequenceLength(Line[Byte]);
+		// Characters outside of the basic multilingual plane are a surrogate pair in UTF-16.
+		Utf16 += Length == 4 ? 2 : 1;
+		Byte += Length;
+	}
+	if (Utf16 < Column)
+		return Byte + (Column - Utf16);
+	return std::min(Byte, Line.size());
+}
+
+size_t workspace::LineIndex::ByteToUtf16Column(std::string_view Line, size_t ByteColumn)
+{
+	size_t Byte = 0;
+	size_t Utf16 = 0;
+	while (Byte < Line.size() && Byte < ByteColumn)
+	{
+		size_t Length = GetSequenceLength(Line[Byte]);
+		Utf16 += Length == 4 ? 2 : 1;
+		Byte += Length;
+	}
+	if (Byte < ByteColumn)
+		return Utf16 + (ByteColumn - Byte);
+	return Utf16;
+}
+
+std::shared_ptr<const workspace::LineIndex> workspace::LineIndex::Compact() const
+{
+	std::string Kept;
+	auto Out = std::make_shared<LineIndex>(nullptr);
+	Out->LineStarts.clear();
+	for (size_t i = 0; i < LineStarts.size(); i++)
+	{
+		Out->LineStarts.push_back(uint32_t(Kept.size()));
+		if (!AsciiLines[i])
+			Kept.append(GetLine(i));
+	}
+	Out->AsciiLines = AsciiLines;
+	Out->Content = std::make_shared<const std::string>(std::move(Kept));
+	return Out;
+}
+
+size_t workspace::LineIndex::GetMemoryUsage() const
+{
+	return LineStarts.capacity() * sizeof(uint32_t) + AsciiLines.capacity() / 8;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "Document.h"
+#include <cstdint>
+
+namespace workspace
+{
+	enum class PositionEncoding
+	{
+		Utf8,
+		Utf16,
+	};
+
+	// The encoding of the character offsets in positions sent by and to the client.
+	extern PositionEncoding ClientEncoding;
+
+	/**
+	 * Index of the line start offsets in a file's content.
+	 *
+	 * Lines only containing ASCII characters are marked, so converting columns on them is free.
+	 * The index is only needed if the client uses an encoding other than UTF-8.
+	 */
+	class LineIndex
+	{
+	public:
+		LineIndex(ContentBuffer Content);
+
+		const ContentBuffer& GetContent() const;
+		size_t GetLineCount() const;
+		std::string_view GetLine(size_t Line) const;
+
+		// Converts a column in the client's position encoding into a byte offset into the line.
+		size_t ToByteColumn(size_t Line, size_t Column) const;
+		// Converts a byte offset into the line into a column in the client's position encoding.
+		size_t ToClientColumn(size_t Line, size_t ByteColumn) const;
+
+		// Returns the number of bytes used by the index, not including the content.
+		size_t GetMemoryUsage() const;
+
+		/**
+		 * Returns a copy of the index that only keeps the text of lines with non-ASCII characters.
+		 * Columns can still be converted, but GetLine() returns an empty string for ASCII lines and GetContent() isn't the file's content.
+		 */
+		std::shared_ptr<const LineIndex> Compact() const;
+
+		static size_t Utf16ToByteColumn(std::string_view Line, size_t Column);
+		static size_t ByteToUtf16Column(std::string_view Line, size_t ByteColumn);
+
+	private:
+		ContentBuffer Content;
+		std::vector<uint32_t> LineStarts;
+		std::vector<bool> AsciiLines;
+	};
+}
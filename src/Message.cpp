@@ -2,10 +2,29 @@
 #include <iostream>
 #include <string>
 #include "Util/StrUtil.h"
+#include "Trace.h"
+#include "Record.h"
+#include <atomic>
+#include <mutex>
+#include <map>
+
+#ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#endif
+
+static std::atomic<int> IdCounter = 0;
+
+// Messages can be sent from background threads, so writing to stdout needs to be serialized.
+static std::mutex SendMutex;
+static std::function<void(std::string_view Data)> Output;
+
+// Space reserved in front of a message for its header, which is written once the length of the content is known.
+static constexpr size_t HEADER_SPACE = 32;
 
-static int IdCounter = 0;
+// Server to client requests that haven't been answered yet.
+static std::map<int32_t, std::function<void(const Message&)>> PendingRequests;
+static std::mutex PendingRequestsMutex;
 
 Message::Message(std::string Method, json MessageJson, bool Notification)
 {
@@ -22,7 +41,16 @@ Message::Message(json FromJson)
 		std::cerr << FromJson.dump(2) << std::endl;
 	}
 
-	if (FromJson.contains("id"))
+	if (FromJson.contains("id") && !FromJson.contains("method"))
+	{
+		this->MessageID = FromJson.at("id");
+		if (FromJson.contains("result"))
+			this->MessageJson = FromJson.at("result");
+		else if (FromJson.contains("error"))
+			this->MessageJson = FromJson.at("error");
+		this->IsResponse = true;
+	}
+	else if (FromJson.contains("id"))
 	{
 		if (FromJson.contains("method"))
 			this->Method = FromJson.at("method");
@@ -45,6 +73,18 @@ Message::Message()
 }
 
 Message Message::ReadFromStdOut()
+{
+	std::optional<Message> Read = ReadFrom(std::cin);
+	// The client closed the connection, usually without sending exit.
+	if (!Read)
+	{
+		trace::Write();
+		exit(0);
+	}
+	return *Read;
+}
+
+std::optional<Message> Message::ReadFrom(std::istream& In)
 {
 	int ContentLength = 0;
 	while (true)
@@ -52,9 +92,12 @@ Message Message::ReadFromStdOut()
 		std::string ReadHeader;
 
 		char HeaderBuffer[8000];
-		std::cin.getline(HeaderBuffer, sizeof(HeaderBuffer));
+		In.getline(HeaderBuffer, sizeof(HeaderBuffer));
 		ReadHeader = HeaderBuffer;
-		if (ReadHeader.empty())
+		// Streams opened in binary mode keep the carriage return of the header's line break.
+		if (!ReadHeader.empty() && ReadHeader.back() == '\r')
+			ReadHeader.pop_back();
+		if (ReadHeader.empty() || !In)
 		{
 			break;
 		}
@@ -68,44 +111,151 @@ Message Message::ReadFromStdOut()
 	}
 
 	if (ContentLength == 0)
-		exit(0);
+		return std::nullopt;
+
+	// Only covers reading the content, waiting for the client to send a message is not included.
+	trace::Span Span = trace::Span("ReadMessage");
 
-	char* ContentBuffer = new char[ContentLength + 1]();
-	std::cin.read(ContentBuffer, ContentLength);
-	ContentBuffer[ContentLength] = 0;
+	std::string ContentBuffer = std::string(ContentLength, '\0');
+	In.read(ContentBuffer.data(), ContentLength);
 
 	Message Out;
 
+	// The recording needs the json of every message, so the fast path is only used if nothing is recorded.
+	if (!record::IsEnabled())
+	{
+		std::optional<DocumentChange> Change = DocumentChange::Decode(ContentBuffer);
+		if (Change)
+		{
+			Out.Method = "textDocument/didChange";
+			Out.Change = std::make_shared<DocumentChange>(std::move(*Change));
+			Out.ReceivedTime = std::chrono::steady_clock::now();
+			return Out;
+		}
+	}
+
 	try
 	{
 		json ContentJson = json::parse(ContentBuffer);
+		record::RecordIncoming(ContentJson);
 		if (!ContentJson.contains("jsonrpc") || ContentJson.at("jsonrpc") != "2.0")
 		{
 			return Message();
 		}
 
 		Out = ContentJson;
+		Out.ReceivedTime = std::chrono::steady_clock::now();
 	}
 	catch (json::parse_error)
 	{
+		record::RecordIncomingRaw(ContentBuffer);
 		return Message();
 	}
 
-	delete[] ContentBuffer;
-
 	return Out;
 }
 
-void Message::Send()
+// Returns a buffer with space for the header. The content of the message is appended to it.
+static std::string BeginMessage()
 {
-	std::string MessageContent = GetMessageJson().dump();
-	//std::cerr << GetMessageJson().dump(2) << std::endl;
-	std::string MessageString = StrUtil::Format("Content-Length: %i\r\n\r\n", int(MessageContent.size())) + MessageContent;
+	return std::string(HEADER_SPACE, ' ');
+}
+
+// Writes the header in front of the content of the message and sends it.
+static void WriteMessage(std::string& Buffer)
+{
+	std::string Header = StrUtil::Format("Content-Length: %i\r\n\r\n", int(Buffer.size() - HEADER_SPACE));
+	size_t Start = HEADER_SPACE - Header.size();
+	Buffer.replace(Start, Header.size(), Header);
+	std::string_view MessageString = std::string_view(Buffer).substr(Start);
+
+	std::unique_lock g{ SendMutex };
+	if (Output)
+	{
+		Output(MessageString);
+		return;
+	}
+#ifdef _WIN32
 	int _ = _setmode(_fileno(stdout), O_BINARY);
-	std::cout.write(MessageString.c_str(), MessageString.size());
+#endif
+	std::cout.write(MessageString.data(), MessageString.size());
 	std::cout << std::flush;
 }
 
+// Streamed messages only exist as text. They are parsed again for the recording.
+static void RecordStreamed(const std::string& Buffer)
+{
+	if (!record::IsEnabled())
+		return;
+	std::string_view Content = std::string_view(Buffer).substr(HEADER_SPACE);
+	try
+	{
+		record::RecordOutgoing(json::parse(Content));
+	}
+	catch (json::parse_error&)
+	{
+		record::RecordOutgoingRaw(std::string(Content));
+	}
+}
+
+void Message::Send()
+{
+	trace::Span Span = trace::Span("Send");
+	json Content = GetMessageJson();
+	record::RecordOutgoing(Content);
+	std::string Buffer = BeginMessage();
+	JsonWriter(Buffer).Value(Content);
+	WriteMessage(Buffer);
+}
+
+void Message::SendNotification(std::string_view Method, const std::function<void(JsonWriter& Params)>& WriteParams)
+{
+	trace::Span Span = trace::Span("Send");
+	std::string Buffer = BeginMessage();
+	JsonWriter Writer = JsonWriter(Buffer);
+	Writer.BeginObject();
+	Writer.Field("jsonrpc", "2.0");
+	Writer.Field("method", Method);
+	Writer.Key("params");
+	WriteParams(Writer);
+	Writer.EndObject();
+	RecordStreamed(Buffer);
+	WriteMessage(Buffer);
+}
+
+void Message::SetOutput(std::function<void(std::string_view Data)> NewOutput)
+{
+	std::unique_lock g{ SendMutex };
+	Output = NewOutput;
+}
+
+void Message::SendRequest(std::function<void(const Message& Response)> OnResponse)
+{
+	IsRequest = true;
+	{
+		std::unique_lock g{ PendingRequestsMutex };
+		PendingRequests.insert({ MessageID, OnResponse });
+	}
+	Send();
+}
+
+bool Message::HandleResponse(const Message& Response)
+{
+	std::function<void(const Message&)> OnResponse;
+	{
+		std::unique_lock g{ PendingRequestsMutex };
+		auto Found = PendingRequests.find(Response.MessageID);
+		if (Found == PendingRequests.end())
+			return false;
+		OnResponse = Found->second;
+		PendingRequests.erase(Found);
+	}
+
+	if (OnResponse)
+		OnResponse(Response);
+	return true;
+}
+
 json Message::GetMessageJson()
 {
 	if (IsRequest)
@@ -142,6 +292,21 @@ ResponseMessage::ResponseMessage(const Message& From, json Result, std::optional
 	this->Error = Error;
 }
 
+void ResponseMessage::SendResult(const Message& Request, const std::function<void(JsonWriter& Result)>& WriteResult)
+{
+	trace::Span Span = trace::Span("Send");
+	std::string Buffer = BeginMessage();
+	JsonWriter Writer = JsonWriter(Buffer);
+	Writer.BeginObject();
+	Writer.Field("jsonrpc", "2.0");
+	Writer.Field("id", Request.MessageID);
+	Writer.Key("result");
+	WriteResult(Writer);
+	Writer.EndObject();
+	RecordStreamed(Buffer);
+	WriteMessage(Buffer);
+}
+
 json ResponseMessage::GetMessageJson()
 {
 	if (Error.has_value())
@@ -161,7 +326,7 @@ json ResponseMessage::GetMessageJson()
 json ResponseMessage::ResponseError::ToJson()
 {
 	return {
-		{ "code", int(1) },
+		{ "code", int(Code) },
 		{ "message", this->Message },
 		{ "data", Data }
 	};
@@ -2,6 +2,14 @@
 #include <nlohmann/json.hpp>
 #include <utility>
 #include <string>
+#include <functional>
+#include <string_view>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <istream>
+#include "DocumentChange.h"
+#include "JsonWriter.h"
 using namespace nlohmann;
 
 enum class LSPErrorCode
@@ -59,7 +67,7 @@ enum class LSPErrorCode
 	 *
 	 * @since 3.17.0
 	 */
-	integer = -32803,
+	RequestFailed = -32803,
 
 	/**
 	 * The server cancelled the request. This error code should
@@ -105,14 +113,48 @@ public:
 	Message();
 
 	static Message ReadFromStdOut();
+	// Reads the next message from the stream. Returns nothing once the stream has ended.
+	static std::optional<Message> ReadFrom(std::istream& In);
 
 	json MessageJson;
 	int32_t MessageID = -1;
 	bool IsRequest = false;
+	// True if this message is the client's response to a request sent by the server.
+	bool IsResponse = false;
 	std::string Method;
+	// The time this message was read from the client.
+	std::chrono::steady_clock::time_point ReceivedTime;
+	// Set instead of MessageJson for textDocument/didChange notifications read by ReadFrom.
+	std::shared_ptr<DocumentChange> Change;
+	// The daemon session the message was received from, see Session.h.
+	uint32_t Session = 0;
 
 	void Send();
 
+	/**
+	 * Sends a notification. The params are written by WriteParams directly into the output buffer,
+	 * so large messages don't need to be built as json first.
+	 */
+	static void SendNotification(std::string_view Method, const std::function<void(JsonWriter& Params)>& WriteParams);
+
+	/**
+	 * Sends this message as a request to the client.
+	 * OnResponse is called with the response message once the client answers.
+	 */
+	void SendRequest(std::function<void(const Message& Response)> OnResponse = nullptr);
+
+	/**
+	 * Calls the response callback of the server request the given response belongs to.
+	 * Returns false if no request with the response ID is pending.
+	 */
+	static bool HandleResponse(const Message& Response);
+
+	/**
+	 * Replaces the function sent messages are written with. By default they are written to stdout.
+	 * The function receives the complete message including the header. Calls to it are serialized.
+	 */
+	static void SetOutput(std::function<void(std::string_view Data)> NewOutput);
+
 protected:
 	virtual json GetMessageJson();
 
@@ -146,6 +188,9 @@ public:
 
 	ResponseMessage(const Message& From, json Result, std::optional<ResponseError> Error = std::optional<ResponseError>());
 
+	// Sends the response to the given request. The result is written by WriteResult directly into the output buffer.
+	static void SendResult(const Message& Request, const std::function<void(JsonWriter& Result)>& WriteResult);
+
 protected:
 	virtual json GetMessageJson() override;
 };
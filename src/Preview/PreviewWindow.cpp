@@ -1,7 +1,15 @@
 #include "PreviewWindow.h"
 #include "../Workspace.h"
+#include "../Analysis.h"
+#include "SidebarModel.h"
+#include "../Trace.h"
+#include "../Stats.h"
 #include <thread>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
 #include <iostream>
 #include <kui/KlemmUI.h>
 #include <kui/DynamicMarkup.h>
@@ -15,6 +23,8 @@ using namespace kui::markup;
 namespace preview
 {
 	Window* PreviewWindow = nullptr;
+	// Set from the language server thread when the preview is opened, cleared by the preview thread once it's closed.
+	std::atomic<bool> IsOpen = false;
 
 	UIBox* ElementBox = nullptr;
 	SidebarElement* Sidebar = nullptr;
@@ -22,27 +32,75 @@ namespace preview
 
 	DynamicMarkupContext* MarkupContext = nullptr;
 	kui::Font* Text = nullptr;
-	kui::MarkupStructure::ParseResult CurrentParsed;
+
+	struct PreviewState
+	{
+		std::shared_ptr<analysis::Snapshot> Analysis;
+		std::vector<std::string> OpenedFiles;
+	};
+
+	// Most recent state published by the language server thread.
+	std::atomic<std::shared_ptr<const PreviewState>> LatestState;
+	// State currently displayed by the preview. Only used by the preview thread.
+	std::shared_ptr<const PreviewState> DisplayedState;
+
 	bool ShouldUpdateParsed = false;
-	std::mutex ParseMutex;
-	std::mutex SidebarMutex;
 
-	std::string OpenedElement;
+	// Signalled by LoadParsed(), so an idle preview wakes up as soon as a new state is published.
+	std::mutex WakeMutex;
+	std::condition_variable WakeCondition;
+	bool WakeRequested = false;
+
+	// Time without any input after which the preview only updates a few times per second.
+	constexpr float IDLE_DELAY = 2.0f;
+	constexpr float IDLE_FRAME_TIME = 0.1f;
 
-	Timer ReparseTimer = Timer();
+	// Limits for the time to wait for more changes before rebuilding the preview.
+	constexpr float MIN_REPARSE_DELAY = 0.02f;
+	constexpr float MAX_REPARSE_DELAY = 0.5f;
+
+	std::string OpenedElement;
 
-	std::map<std::string, workspace::FileData> Files;
-	std::vector<std::string> OpenedFiles;
+	SidebarModel SidebarRows;
+	struct SidebarRowEntry
+	{
+		SidebarEntry* Entry = nullptr;
+		std::string Title;
+		bool Highlighted = false;
+	};
+
+	// Entries showing the rows in VisibleRows. Entries are reused when the rows change.
+	std::vector<SidebarRowEntry> SidebarEntries;
+	std::vector<size_t> VisibleRows;
+	SidebarEntry* SidebarHeader = nullptr;
+	SidebarEntry* ShowMoreEntry = nullptr;
+	std::string SidebarFilter;
+
+	// Only this many rows are shown at once. More can be shown with the 'Show more' entry.
+	constexpr size_t SIDEBAR_PAGE_SIZE = 100;
+	size_t SidebarRowLimit = SIDEBAR_PAGE_SIZE;
+	// Set by the 'Show more' entry. Its click handler can't rebuild the rows, since that deletes the entry itself.
+	bool SidebarNeedsMoreRows = false;
+
+	// The snapshot, element name and definition fingerprint the elements in ElementBox were created from.
+	std::shared_ptr<analysis::Snapshot> InstantiatedSnapshot;
+	std::string InstantiatedElement;
+	uint64_t InstantiatedFingerprint = 0;
 
 	void WindowLoop();
+	void WaitForWake(float Seconds);
+	void UpdateElementBoxSize();
 	void UpdateParsed();
 	void UpdateSidebar();
+	void UpdateSidebarRows();
+	void UpdateSidebarHighlight();
 }
 
 void preview::Init()
 {
-	if (PreviewWindow)
+	if (IsOpen)
 		return;
+	IsOpen = true;
 	auto WindowThread = std::thread(&WindowLoop);
 	WindowThread.detach();
 }
@@ -54,6 +112,8 @@ void preview::Destroy()
 
 void preview::WindowLoop()
 {
+	trace::SetThreadName("preview");
+
 	app::error::SetErrorCallback([](std::string Error, bool)
 		{
 			app::MessageBox(Error, "Error", app::MessageBoxType::Error);
@@ -78,6 +138,13 @@ void preview::WindowLoop()
 	Toolbar = new ToolbarElement();
 	Sidebar = new SidebarElement();
 
+	Sidebar->search->field->OnChanged = []()
+		{
+			SidebarFilter = Sidebar->search->field->GetText();
+			SidebarRowLimit = SIDEBAR_PAGE_SIZE;
+			UpdateSidebarRows();
+		};
+
 	Toolbar->btn->SetImage("res:Pin.png");
 	Toolbar->btn->SetText("On top");
 	Toolbar->btn->btn->OnClicked = [btn = Toolbar->btn, DefaultWindowFlags]()
@@ -92,31 +159,261 @@ void preview::WindowLoop()
 				: DefaultWindowFlags | Window::WindowFlag::AlwaysOnTop);
 		};
 
+	Vec2ui LastSize = 0;
+	Vec2f LastMousePosition = 0;
+	std::string LastInputText;
+	int LastTextIndex = 0;
+	Timer InputTimer;
+
+	// A published state that isn't displayed yet. It's displayed once no newer state has arrived for ReparseDelay seconds,
+	// or if it has been waiting for MAX_REPARSE_DELAY seconds, so the preview still updates during continuous editing.
+	std::shared_ptr<const PreviewState> PendingState;
+	Timer PendingTimer, FirstPendingTimer;
+	float ReparseDelay = MIN_REPARSE_DELAY;
+
 	while (PreviewWindow->UpdateWindow())
 	{
-		if (ShouldUpdateParsed && ReparseTimer.Get() > 0.1f)
+		Vec2ui Size = PreviewWindow->GetSize();
+		if (Size.X != LastSize.X || Size.Y != LastSize.Y)
+		{
+			LastSize = Size;
+			UpdateElementBoxSize();
+			InputTimer.Reset();
+		}
+
+		Vec2f MousePosition = PreviewWindow->Input.MousePosition;
+		if (MousePosition.X != LastMousePosition.X || MousePosition.Y != LastMousePosition.Y || PreviewWindow->Input.IsLMBDown)
+		{
+			LastMousePosition = MousePosition;
+			InputTimer.Reset();
+		}
+
+		// Typing into the search field, or moving its cursor, doesn't move the mouse.
+		const InputManager& Input = PreviewWindow->Input;
+		if (Input.PollForText && (Input.Text != LastInputText || Input.TextIndex != LastTextIndex))
+		{
+			LastInputText = Input.Text;
+			LastTextIndex = Input.TextIndex;
+			InputTimer.Reset();
+		}
+
+		std::shared_ptr Latest = LatestState.load();
+		if (Latest && Latest != DisplayedState && Latest != PendingState)
 		{
+			if (!PendingState)
+				FirstPendingTimer.Reset();
+			PendingState = Latest;
+			PendingTimer.Reset();
+		}
+
+		if (PendingState && (PendingTimer.Get() >= ReparseDelay || FirstPendingTimer.Get() >= MAX_REPARSE_DELAY))
+		{
+			DisplayedState = PendingState;
+			PendingState = nullptr;
+			ShouldUpdateParsed = true;
+		}
+
+		if (SidebarNeedsMoreRows)
+		{
+			SidebarNeedsMoreRows = false;
+			SidebarRowLimit += SIDEBAR_PAGE_SIZE;
+			UpdateSidebarRows();
+		}
+
+		if (ShouldUpdateParsed && DisplayedState)
+		{
+			Timer UpdateTimer;
 			UpdateParsed();
 			UpdateSidebar();
 			ShouldUpdateParsed = false;
-			ReparseTimer.Reset();
+
+			// Wait longer for further changes if rebuilding the preview is expensive.
+			ReparseDelay = std::clamp(UpdateTimer.Get() * 2, MIN_REPARSE_DELAY, MAX_REPARSE_DELAY);
+		}
+
+		bool Idle = InputTimer.Get() > IDLE_DELAY;
+		if (PendingState)
+		{
+			float Remaining = std::min(ReparseDelay - PendingTimer.Get(), MAX_REPARSE_DELAY - FirstPendingTimer.Get());
+			WaitForWake(std::min(Remaining, Idle ? IDLE_FRAME_TIME : 0.0f));
+		}
+		else if (Idle)
+		{
+			WaitForWake(IDLE_FRAME_TIME);
 		}
-		ElementBox->SetMinSize(SizeVec(2).GetScreen() - SizeVec(300_px, 36_px).GetScreen());
-		ElementBox->SetMaxSize(ElementBox->GetMinSize());
 	}
 
 	delete Text;
 	delete PreviewWindow;
 	PreviewWindow = nullptr;
+	delete MarkupContext;
+	MarkupContext = nullptr;
+	SidebarRows = SidebarModel();
+	SidebarEntries.clear();
+	VisibleRows.clear();
+	SidebarHeader = nullptr;
+	ShowMoreEntry = nullptr;
+	SidebarNeedsMoreRows = false;
+	InstantiatedSnapshot = nullptr;
+	InstantiatedElement.clear();
+	DisplayedState = nullptr;
+	LatestState.store(nullptr);
+	stats::SetMemoryUsage("preview.sidebar", 0);
+	stats::SetMemoryUsage("preview.retainedSnapshot", 0);
+	IsOpen = false;
 }
 
-void preview::UpdateParsed()
+static uint64_t HashText(uint64_t Hash, std::string_view Text)
+{
+	// FNV-1a
+	for (char c : Text)
+	{
+		Hash ^= uint8_t(c);
+		Hash *= 1099511628211ull;
+	}
+	// Separates consecutive strings, so "ab" + "c" and "a" + "bc" hash differently.
+	Hash ^= 0xff;
+	Hash *= 1099511628211ull;
+	return Hash;
+}
+
+// Returns the text of the given lines, including both the first and the last line.
+static std::string_view GetLines(std::string_view Content, size_t FirstLine, size_t LastLine)
+{
+	size_t Begin = 0;
+	for (size_t Line = 0; Line < FirstLine && Begin != std::string_view::npos; Line++)
+	{
+		Begin = Content.find('\n', Begin);
+		if (Begin != std::string_view::npos)
+			Begin++;
+	}
+	if (Begin == std::string_view::npos)
+		return {};
+
+	size_t End = Begin;
+	for (size_t Line = FirstLine; Line <= LastLine && End != std::string_view::npos; Line++)
+	{
+		End = Content.find('\n', End);
+		if (End != std::string_view::npos)
+			End++;
+	}
+	return Content.substr(Begin, End == std::string_view::npos ? std::string_view::npos : End - Begin);
+}
+
+// Hashes the parsed structure of an element. Used if the source text of the element's file isn't in memory.
+static uint64_t HashElement(uint64_t Hash, const kui::MarkupStructure::UIElement& From)
+{
+	Hash = HashText(HashText(Hash, From.TypeName.Text), From.ElementName.Text);
+	for (const auto& i : From.ElementProperties)
+	{
+		Hash = HashText(HashText(Hash, i.Name.Text), i.Value.Text);
+	}
+	for (const auto& i : From.Variables)
+	{
+		Hash = HashText(HashText(Hash, i.first), i.second.Value);
+	}
+	for (const auto& Child : From.Children)
+	{
+		Hash = HashElement(Hash, Child);
+	}
+	return HashText(Hash, "}");
+}
+
+static void AddUsedElements(const kui::MarkupStructure::UIElement& From, std::vector<std::string>& Used)
+{
+	using namespace kui::MarkupStructure;
+
+	if (From.Type == UIElement::ElementType::UserDefined
+		&& std::find(Used.begin(), Used.end(), From.TypeName.Text) == Used.end())
+	{
+		Used.push_back(From.TypeName.Text);
+	}
+
+	for (const UIElement& Child : From.Children)
+	{
+		AddUsedElements(Child, Used);
+	}
+}
+
+/**
+ * Hashes the source text of the given element and every user defined element it uses, directly or indirectly,
+ * and the values of all globals and constants.
+ *
+ * Only the text is hashed, not its position, so edits elsewhere in the same file don't change the fingerprint.
+ */
+static uint64_t GetElementFingerprint(const analysis::Snapshot& From, const std::string& Name)
 {
+	using namespace kui::MarkupStructure;
+
+	uint64_t Hash = 14695981039346656037ull;
+
+	for (const Global& i : From.Parsed.Globals)
+	{
+		Hash = HashText(HashText(Hash, i.Name.Text), i.Value);
+	}
+	for (const Constant& i : From.Parsed.Constants)
 	{
-		std::unique_lock g{ ParseMutex };
-		MarkupContext = new DynamicMarkupContext();
-		MarkupContext->Parsed = &CurrentParsed;
+		Hash = HashText(HashText(Hash, i.Name.Text), i.Value);
+	}
+
+	std::vector<std::string> Elements = { Name };
+	for (size_t i = 0; i < Elements.size(); i++)
+	{
+		Hash = HashText(Hash, Elements[i]);
+
+		for (const MarkupElement& Element : From.Parsed.Elements)
+		{
+			if (Element.FromToken.Text != Elements[i])
+				continue;
+
+			auto File = From.Files.find(Element.File);
+			if (File != From.Files.end())
+			{
+				size_t FirstLine = std::min(Element.FromToken.Line, Element.Root.StartLine);
+				Hash = HashText(Hash, GetLines(*File->second, FirstLine, Element.Root.EndLine));
+			}
+			else
+			{
+				Hash = HashElement(Hash, Element.Root);
+			}
+
+			AddUsedElements(Element.Root, Elements);
+			break;
+		}
 	}
+	return Hash;
+}
+
+void preview::WaitForWake(float Seconds)
+{
+	if (Seconds <= 0)
+		return;
+
+	std::unique_lock g{ WakeMutex };
+	WakeCondition.wait_for(g, std::chrono::duration<float>(Seconds), []() { return WakeRequested; });
+	WakeRequested = false;
+}
+
+void preview::UpdateElementBoxSize()
+{
+	ElementBox->SetMinSize(SizeVec(2).GetScreen() - SizeVec(300_px, 36_px).GetScreen());
+	ElementBox->SetMaxSize(ElementBox->GetMinSize());
+}
+
+void preview::UpdateParsed()
+{
+	trace::Span Span = trace::Span("UpdateParsed");
+	const std::shared_ptr<analysis::Snapshot>& Snapshot = DisplayedState->Analysis;
+	uint64_t Fingerprint = GetElementFingerprint(*Snapshot, OpenedElement);
+
+	// The displayed element and the elements it depends on didn't change, so the existing elements can be kept.
+	// InstantiatedSnapshot keeps the parse result they were created from alive.
+	if (InstantiatedSnapshot && InstantiatedElement == OpenedElement && InstantiatedFingerprint == Fingerprint)
+		return;
+
+	DynamicMarkupContext* PreviousContext = MarkupContext;
+	MarkupContext = new DynamicMarkupContext();
+	MarkupContext->Parsed = &Snapshot->Parsed;
 
 	// Do not throw error messages if an image doesn't exist.
 	kui::resource::ErrorOnFail = false;
@@ -124,55 +421,124 @@ void preview::UpdateParsed()
 	PreviewWindow->UI.SetTexturePath(workspace::CurrentWorkspacePath);
 
 	ElementBox->DeleteChildren();
+	delete PreviousContext;
 
 	auto DynBox = new UIDynMarkupBox(MarkupContext, OpenedElement);
 	ElementBox->AddChild(DynBox);
 	ElementBox->UpdateElement();
 	ElementBox->RedrawElement(true);
+
+	InstantiatedSnapshot = Snapshot;
+	InstantiatedElement = OpenedElement;
+	InstantiatedFingerprint = Fingerprint;
 }
 
 void preview::UpdateSidebar()
 {
-	std::unique_lock sg{ SidebarMutex };
+	trace::Span Span = trace::Span("UpdateSidebar");
+	if (!SidebarHeader)
+	{
+		SidebarHeader = new SidebarEntry();
+		SidebarHeader->SetPadding(4_px);
+		SidebarHeader->SetTitle("Opened");
+		Sidebar->tabBox->AddChild(SidebarHeader);
+	}
 
-	Sidebar->tabBox->DeleteChildren();
+	if (SidebarRows.Update(*DisplayedState->Analysis, DisplayedState->OpenedFiles))
+		UpdateSidebarRows();
+	else
+		UpdateSidebarHighlight();
+
+	stats::SetMemoryUsage("preview.sidebar", SidebarRows.GetMemoryUsage());
+	// Instantiated elements can keep an older snapshot alive while newer ones don't change the displayed element.
+	stats::SetMemoryUsage("preview.retainedSnapshot",
+		InstantiatedSnapshot && InstantiatedSnapshot != DisplayedState->Analysis ? InstantiatedSnapshot->GetMemoryUsage() : 0);
+}
 
-	auto OpenedHeader = new SidebarEntry();
-	OpenedHeader->SetPadding(4_px);
-	OpenedHeader->SetTitle("Opened");
-	Sidebar->tabBox->AddChild(OpenedHeader);
+void preview::UpdateSidebarRows()
+{
+	size_t TotalRows = 0;
+	VisibleRows = SidebarRows.Find(SidebarFilter, SidebarRowLimit, TotalRows);
 
-	for (auto& file : OpenedFiles)
+	// The 'Show more' entry has to be the last child, so it's added again after the row entries.
+	if (ShowMoreEntry)
 	{
-		for (auto& elem : MarkupContext->Parsed->Elements)
-		{
-			if (workspace::ConvertFilePath(elem.File) != file)
-				continue;
+		delete ShowMoreEntry;
+		ShowMoreEntry = nullptr;
+	}
 
-			auto Entry = new SidebarEntry();
-			Entry->SetPadding(32_px);
-			Entry->SetImage("res:Window.png");
-			Entry->SetTitle(elem.FromToken.Text);
-			Entry->SetHighlightOpacity(elem.FromToken.Text == OpenedElement ? 1.0f : 0.0f);
-			Entry->btn->OnClicked = [Name = elem.FromToken.Text]()
-				{
-					OpenedElement = Name;
-					ShouldUpdateParsed = true;
-				};
-			Sidebar->tabBox->AddChild(Entry);
-		}
+	while (SidebarEntries.size() > VisibleRows.size())
+	{
+		delete SidebarEntries.back().Entry;
+		SidebarEntries.pop_back();
 	}
+
+	while (SidebarEntries.size() < VisibleRows.size())
+	{
+		size_t Index = SidebarEntries.size();
+		auto Entry = new SidebarEntry();
+		Entry->SetPadding(32_px);
+		Entry->SetImage("res:Window.png");
+		Entry->btn->OnClicked = [Index]()
+			{
+				OpenedElement = SidebarRows.GetRow(VisibleRows[Index]).Name;
+				ShouldUpdateParsed = true;
+			};
+		Sidebar->tabBox->AddChild(Entry);
+		SidebarEntries.push_back(SidebarRowEntry{ .Entry = Entry });
+	}
+
+	for (size_t i = 0; i < VisibleRows.size(); i++)
+	{
+		const std::string& Name = SidebarRows.GetRow(VisibleRows[i]).Name;
+		if (SidebarEntries[i].Title == Name)
+			continue;
+		SidebarEntries[i].Entry->SetTitle(Name);
+		SidebarEntries[i].Title = Name;
+	}
+
+	if (TotalRows > VisibleRows.size())
+	{
+		ShowMoreEntry = new SidebarEntry();
+		ShowMoreEntry->SetPadding(32_px);
+		ShowMoreEntry->SetImage("res:Folder.png");
+		ShowMoreEntry->SetTitle("Show more (" + std::to_string(TotalRows - VisibleRows.size()) + " hidden)");
+		ShowMoreEntry->btn->OnClicked = []()
+			{
+				SidebarNeedsMoreRows = true;
+			};
+		Sidebar->tabBox->AddChild(ShowMoreEntry);
+	}
+
+	UpdateSidebarHighlight();
 }
 
-void preview::LoadParsed(kui::MarkupStructure::ParseResult* From)
+void preview::UpdateSidebarHighlight()
 {
-	std::unique_lock g{ ParseMutex };
-	CurrentParsed = *From;
-	ShouldUpdateParsed = true;
+	for (SidebarRowEntry& i : SidebarEntries)
+	{
+		bool Highlighted = i.Title == OpenedElement;
+		if (Highlighted == i.Highlighted)
+			continue;
+		i.Entry->SetHighlightOpacity(Highlighted ? 1.0f : 0.0f);
+		i.Highlighted = Highlighted;
+	}
+}
+
+void preview::LoadParsed(std::shared_ptr<analysis::Snapshot> From, std::vector<std::string> OpenedFiles)
+{
+	// Nothing needs to be handed over if the preview isn't open.
+	if (!IsOpen)
+		return;
+
+	LatestState.store(std::make_shared<const PreviewState>(PreviewState{
+		.Analysis = From,
+		.OpenedFiles = std::move(OpenedFiles),
+		}));
 
 	{
-		std::unique_lock sg{ SidebarMutex };
-		Files = workspace::Files;
-		OpenedFiles = workspace::OpenedFiles;
+		std::unique_lock g{ WakeMutex };
+		WakeRequested = true;
 	}
+	WakeCondition.notify_one();
 }
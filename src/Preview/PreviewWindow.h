@@ -1,9 +1,23 @@
 #pragma once
-#include <Markup/MarkupStructure.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace analysis
+{
+	struct Snapshot;
+}
 
 namespace preview
 {
 	void Init();
 	void Destroy();
-	void LoadParsed(kui::MarkupStructure::ParseResult* From);
-}
\ No newline at end of file
+
+	/**
+	 * Hands a new analysis result to the preview window.
+	 *
+	 * The snapshot is shared, not copied, so it must not be modified after it has been loaded.
+	 * The preview thread picks up the most recent snapshot without locking.
+	 */
+	void LoadParsed(std::shared_ptr<analysis::Snapshot> From, std::vector<std::string> OpenedFiles);
+}
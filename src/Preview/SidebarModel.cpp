@@ -0,0 +1,121 @@
+#include "SidebarModel.h"
+#include "../Analysis.h"
+#include "../Workspace.h"
+#include "../Util/StrUtil.h"
+#include <algorithm>
+#include <unordered_map>
+
+bool preview::SidebarModel::Update(const analysis::Snapshot& From, const std::vector<std::string>& OpenedFiles)
+{
+	// Elements of the same file share the file name, so each name only needs to be converted once.
+	std::unordered_map<std::string_view, size_t> FileOrder;
+	std::vector<std::vector<Row>> RowsByFile = std::vector<std::vector<Row>>(OpenedFiles.size());
+
+	for (const auto& Element : From.Parsed.Elements)
+	{
+		auto Found = FileOrder.find(Element.File);
+		if (Found == FileOrder.end())
+		{
+			std::string Path = workspace::ConvertFilePath(Element.File);
+			size_t Index = std::find(OpenedFiles.begin(), OpenedFiles.end(), Path) - OpenedFiles.begin();
+			Found = FileOrder.insert({ Element.File, Index }).first;
+		}
+
+		if (Found->second >= OpenedFiles.size())
+			continue;
+
+		RowsByFile[Found->second].push_back(Row{
+			.Name = Element.FromToken.Text,
+			.File = Element.File,
+			});
+	}
+
+	std::vector<Row> NewRows;
+	for (auto& FileRows : RowsByFile)
+	{
+		NewRows.insert(NewRows.end(), FileRows.begin(), FileRows.end());
+	}
+
+	if (NewRows == Rows)
+		return false;
+
+	Rows = std::move(NewRows);
+	NameIndex.clear();
+	NameIndex.reserve(Rows.size());
+	for (size_t i = 0; i < Rows.size(); i++)
+	{
+		NameIndex.push_back({ StrUtil::Lower(Rows[i].Name), i });
+	}
+	std::sort(NameIndex.begin(), NameIndex.end());
+	return true;
+}
+
+std::vector<size_t> preview::SidebarModel::Find(std::string_view Query, size_t Limit, size_t& TotalMatches) const
+{
+	std::vector<size_t> Found;
+
+	if (Query.empty())
+	{
+		TotalMatches = Rows.size();
+		for (size_t i = 0; i < Rows.size() && i < Limit; i++)
+		{
+			Found.push_back(i);
+		}
+		return Found;
+	}
+
+	std::string LowerQuery = StrUtil::Lower(std::string(Query));
+	TotalMatches = 0;
+
+	// Names starting with the query are next to each other in the sorted index.
+	auto PrefixBegin = std::lower_bound(NameIndex.begin(), NameIndex.end(), LowerQuery,
+		[](const std::pair<std::string, size_t>& Entry, const std::string& Value) { return Entry.first < Value; });
+	auto PrefixEnd = PrefixBegin;
+	while (PrefixEnd != NameIndex.end() && PrefixEnd->first.starts_with(LowerQuery))
+	{
+		if (Found.size() < Limit)
+			Found.push_back(PrefixEnd->second);
+		TotalMatches++;
+		PrefixEnd++;
+	}
+
+	for (auto i = NameIndex.begin(); i != NameIndex.end(); i++)
+	{
+		if (i == PrefixBegin)
+		{
+			i = PrefixEnd;
+			if (i == NameIndex.end())
+				break;
+		}
+		if (i->first.find(LowerQuery) == std::string::npos)
+			continue;
+		if (Found.size() < Limit)
+			Found.push_back(i->second);
+		TotalMatches++;
+	}
+	return Found;
+}
+
+const preview::SidebarModel::Row& preview::SidebarModel::GetRow(size_t Index) const
+{
+	return Rows[Index];
+}
+
+size_t preview::SidebarModel::GetRowCount() const
+{
+	return Rows.size();
+}
+
+size_t preview::SidebarModel::GetMemoryUsage() const
+{
+	size_t Size = Rows.capacity() * sizeof(Row) + NameIndex.capacity() * sizeof(NameIndex[0]);
+	for (const Row& i : Rows)
+	{
+		Size += i.Name.capacity() + i.File.capacity();
+	}
+	for (const auto& i : NameIndex)
+	{
+		Size += i.first.capacity();
+	}
+	return Size;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace analysis
+{
+	struct Snapshot;
+}
+
+namespace preview
+{
+	/**
+	 * The list of elements shown in the preview sidebar.
+	 *
+	 * The rows are only replaced if a new snapshot actually changes them,
+	 * and searching uses a sorted index of the element names.
+	 */
+	class SidebarModel
+	{
+	public:
+		struct Row
+		{
+			std::string Name;
+			std::string File;
+
+			bool operator==(const Row& Other) const = default;
+		};
+
+		/**
+		 * Updates the rows to the elements declared in the opened files.
+		 * Returns true if the rows changed.
+		 */
+		bool Update(const analysis::Snapshot& From, const std::vector<std::string>& OpenedFiles);
+
+		/**
+		 * Returns the indices of at most Limit rows with a name containing the query, ignoring case.
+		 * Rows with a name starting with the query come first.
+		 * TotalMatches is set to the number of matching rows, including the ones over the limit.
+		 */
+		std::vector<size_t> Find(std::string_view Query, size_t Limit, size_t& TotalMatches) const;
+
+		const Row& GetRow(size_t Index) const;
+		size_t GetRowCount() const;
+		// Returns the approximate number of bytes used by the rows and the name index.
+		size_t GetMemoryUsage() const;
+
+	private:
+		std::vector<Row> Rows;
+		// Lowercase element names and the index of their row, sorted by name.
+		std::vector<std::pair<std::string, size_t>> NameIndex;
+	};
+}
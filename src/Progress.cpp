@@ -0,0 +1,79 @@
+#include "Progress.h"
+#include "Message.h"
+#include "Session.h"
+
+WorkDoneProgress::WorkDoneProgress(std::string Token, std::string Title)
+{
+	this->Token = Token;
+	this->Title = Title;
+}
+
+std::shared_ptr<WorkDoneProgress> WorkDoneProgress::Create(std::string Token, std::string Title)
+{
+	auto Progress = std::make_shared<WorkDoneProgress>(Token, Title);
+	Progress->Session = session::GetCurrent();
+
+	session::Scope Session = session::Scope(Progress->Session);
+	Message CreateRequest = Message("window/workDoneProgress/create", { { "token", Token } });
+	CreateRequest.SendRequest([Progress](const Message& Response) {
+		std::unique_lock g{ Progress->ProgressMutex };
+
+		// The client refused the token, so no progress can be reported with it.
+		if (Response.MessageJson.is_object() && Response.MessageJson.contains("code"))
+			return;
+
+		Progress->Begun = true;
+		Progress->SendProgress("begin");
+		if (Progress->Ended)
+			Progress->SendProgress("end");
+		});
+	return Progress;
+}
+
+void WorkDoneProgress::Report(size_t Done, size_t Total)
+{
+	std::unique_lock g{ ProgressMutex };
+	this->Done = Done;
+	this->Total = Total;
+	if (Begun && !Ended)
+		SendProgress("report");
+}
+
+void WorkDoneProgress::End(std::string Message)
+{
+	std::unique_lock g{ ProgressMutex };
+	if (Ended)
+		return;
+	Ended = true;
+	EndMessage = Message;
+	if (Begun)
+		SendProgress("end");
+}
+
+void WorkDoneProgress::SendProgress(std::string Kind)
+{
+	json Value = { { "kind", Kind } };
+
+	if (Kind == "end")
+	{
+		Value["message"] = EndMessage;
+	}
+	else
+	{
+		if (Kind == "begin")
+			Value["title"] = Title;
+		if (Total)
+		{
+			Value["percentage"] = Done * 100 / Total;
+			Value["message"] = std::to_string(Done) + "/" + std::to_string(Total) + " files";
+		}
+	}
+
+	// Reports are made by background tasks, which would send them to every session.
+	session::Scope Route = session::Scope(Session);
+	Message ProgressMessage = Message("$/progress", {
+		{ "token", Token },
+		{ "value", Value }
+		}, true);
+	ProgressMessage.Send();
+}
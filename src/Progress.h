@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <mutex>
+#include <memory>
+
+/**
+ * Server initiated work done progress.
+ *
+ * The progress token is created with a `window/workDoneProgress/create` request.
+ * Reports made before the client acknowledged the token are merged into the `begin` notification.
+ * In daemon mode, progress is only sent to the session that created the token.
+ */
+class WorkDoneProgress
+{
+public:
+	WorkDoneProgress(std::string Token, std::string Title);
+
+	static std::shared_ptr<WorkDoneProgress> Create(std::string Token, std::string Title);
+
+	void Report(size_t Done, size_t Total);
+	void End(std::string Message);
+
+private:
+	void SendProgress(std::string Kind);
+
+	std::mutex ProgressMutex;
+	std::string Token;
+	std::string Title;
+	// The daemon session the progress is reported to, see Session.h.
+	uint32_t Session = 0;
+	std::string EndMessage;
+	bool Begun = false;
+	bool Ended = false;
+	size_t Done = 0, Total = 0;
+};
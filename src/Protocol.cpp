@@ -1,4 +1,5 @@
 #include "Protocol.h"
+#include "Analysis.h"
 #include "Workspace.h"
 #include "Util/StrUtil.h"
 #include <iostream>
@@ -7,40 +8,113 @@
 #include <unordered_set>
 #include <Markup/MarkupVerify.h>
 #include "Preview/PreviewWindow.h"
-#include <kui/Timer.h>
+#include "Progress.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Scheduler.h"
+#include "SymbolSearch.h"
+#include "Session.h"
 #include <thread>
+#include <mutex>
+#include <set>
+#include <cctype>
 using namespace kui::MarkupStructure;
+using analysis::VariableUsage;
 
 namespace protocol
 {
 	bool AllowMarkdownInHover = false;
 	bool ReceivedShutdownRequest = false;
 	bool HasVsCppLocalVariable = true;
+	bool SupportsWorkDoneProgress = false;
+	bool SupportsPrepareRename = false;
+
+	/**
+	 * The analysis of one session. Each session analyzes its own opened documents together with the files on disk,
+	 * so it only sees its own edits. Evicted files on disk are summarized once for all sessions.
+	 */
+	struct SessionAnalysis
+	{
+		// The most recent analysis result. Replacing it frees everything allocated for the previous one.
+		std::shared_ptr<analysis::Snapshot> Current = std::make_shared<analysis::Snapshot>();
+		// Requests on documents that changed since the current snapshot was created. They are handled again once the next snapshot is committed.
+		std::vector<Message> DeferredRequests;
+		bool AnalysisQueued = false;
+		// Set if a semantic tokens request was answered with ContentModified. The client is asked to refresh them after the next analysis.
+		bool SemanticTokensOutdated = false;
+	};
 
-	struct VariableUsage
+	// Only accessed on the scheduler thread.
+	static std::map<session::SessionId, SessionAnalysis> Analyses;
+
+	// Returns the analysis of the session the calling task runs for.
+	static SessionAnalysis& GetAnalysis()
 	{
-		enum UsageType
-		{
-			Global,
-			Const,
-			Var,
-		};
+		return Analyses[session::GetCurrent()];
+	}
+
+	// Returns the latest snapshot of the current session.
+	static analysis::Snapshot& GetSnapshot()
+	{
+		return *GetAnalysis().Current;
+	}
 
-		UsageType Type = Global;
-		kui::stringParse::StringToken Token;
-		std::string File;
+	/**
+	 * The number of document notifications read but not handled yet, by session and document URI.
+	 * Incremented by the reader threads, decremented once the scheduler handles the notification.
+	 */
+	static std::map<std::pair<session::SessionId, std::string>, size_t> UnhandledDocumentChanges;
+	static std::mutex UnhandledDocumentChangesMutex;
+
+	// The session that opened the preview window. The preview shows its documents.
+	static session::SessionId PreviewSession = session::STDIO;
+	// The snapshot the symbol search index was last updated with.
+	static std::weak_ptr<analysis::Snapshot> SearchedSnapshot;
+
+	// The sessions whose client supports workspace/semanticTokens/refresh requests.
+	static std::set<session::SessionId> SemanticTokensRefreshSessions;
+	// The sessions whose client supports registering file watchers for workspace/didChangeWatchedFiles.
+	static std::set<session::SessionId> FileWatcherSessions;
+
+	// Shows the current session's latest snapshot in the preview, if the preview belongs to the session.
+	static void UpdatePreview()
+	{
+		if (session::GetCurrent() == PreviewSession)
+			preview::LoadParsed(GetAnalysis().Current, workspace::GetOverlay().OpenedFiles);
+	}
 
-		union
-		{
-			kui::MarkupStructure::Global* FromGlobal;
-			kui::MarkupStructure::Constant* FromConstant;
-			kui::MarkupStructure::MarkupElement* VariableElement;
-		};
-	};
+	// Indexes the declarations of the snapshot for workspace symbol queries, unless they are indexed already.
+	static void UpdateSymbolSearch(const std::shared_ptr<analysis::Snapshot>& From)
+	{
+		if (SearchedSnapshot.lock() == From)
+			return;
+		search::Update(*From);
+		SearchedSnapshot = From;
+	}
+
+	// Returns the line index for converting columns of the given file, or nullptr if columns don't need to be converted.
+	static const workspace::LineIndex* GetColumnConverter(std::string_view File)
+	{
+		using namespace workspace;
+
+		if (ClientEncoding == PositionEncoding::Utf8)
+			return nullptr;
 
-	std::map<std::string, std::vector<VariableUsage>> VariableUsages;
-	static kui::MarkupStructure::ParseResult LastParseResult;
-	std::vector<DiagnosticError> LastDiagnostics;
+		FileData* Found = FindFile(File);
+		if (!Found || !HasLineIndex(*Found))
+			return nullptr;
+		return &GetLineIndex(*Found);
+	}
+
+	static size_t ToClientColumn(const workspace::LineIndex* Lines, size_t Line, size_t ByteColumn)
+	{
+		return Lines ? Lines->ToClientColumn(Line, ByteColumn) : ByteColumn;
+	}
+
+	static size_t ToByteColumn(const workspace::LineIndex* Lines, size_t Line, size_t Column)
+	{
+		return Lines ? Lines->ToByteColumn(Line, Column) : Column;
+	}
 }
 
 namespace protocol::tokens
@@ -57,7 +131,7 @@ namespace protocol::tokens
 
 	struct Token
 	{
-		stringParse::StringToken Token;
+		analysis::TokenPosition Token;
 		int Type = 0;
 		int Modifier = 0;
 	};
@@ -68,9 +142,19 @@ namespace protocol::tokens
 
 	constexpr int MOD_READONLY = 1;
 
-	static json ConvertTokensToJson(std::vector<Token> Tokens)
+	static std::vector<uint32_t> EncodeTokens(std::pmr::vector<Token>& Tokens, const workspace::LineIndex* Lines)
 	{
-		json Out = json::array();
+		std::vector<uint32_t> Out;
+		Out.reserve(Tokens.size() * 5);
+
+		if (Lines)
+		{
+			for (Token& i : Tokens)
+			{
+				i.Token.BeginChar = Lines->ToClientColumn(i.Token.Line, i.Token.BeginChar);
+				i.Token.EndChar = Lines->ToClientColumn(i.Token.Line, i.Token.EndChar);
+			}
+		}
 
 		std::sort(Tokens.begin(), Tokens.end(), [](const Token& a, const Token& b) {
 			if (a.Token.Line == b.Token.Line)
@@ -86,11 +170,11 @@ namespace protocol::tokens
 			if (i.Token.Line != CurrentLine)
 				Character = 0;
 
-			Out.push_back(i.Token.Line - CurrentLine);
-			Out.push_back(i.Token.BeginChar - Character);
-			Out.push_back(i.Token.EndChar - i.Token.BeginChar);
-			Out.push_back(i.Type);
-			Out.push_back(i.Modifier);
+			Out.push_back(uint32_t(i.Token.Line - CurrentLine));
+			Out.push_back(uint32_t(i.Token.BeginChar - Character));
+			Out.push_back(uint32_t(i.Token.EndChar - i.Token.BeginChar));
+			Out.push_back(uint32_t(i.Type));
+			Out.push_back(uint32_t(i.Modifier));
 			CurrentLine = i.Token.Line;
 			Character = i.Token.BeginChar;
 		}
@@ -98,7 +182,7 @@ namespace protocol::tokens
 		return Out;
 	}
 
-	static void ScanElementForTokens(kui::MarkupStructure::UIElement& Element, std::vector<protocol::tokens::Token>& FileTokens)
+	static void ScanElementForTokens(kui::MarkupStructure::UIElement& Element, std::pmr::vector<protocol::tokens::Token>& FileTokens)
 	{
 		using namespace protocol;
 
@@ -126,7 +210,7 @@ namespace protocol::tokens
 		}
 	}
 
-	static json GetDocumentTokens(std::string FileName)
+	std::vector<uint32_t> GetDocumentTokens(std::string FileName)
 	{
 #if _WIN32
 		for (auto& i : FileName)
@@ -137,8 +221,8 @@ namespace protocol::tokens
 #endif
 
 		using namespace workspace;
-		std::vector<tokens::Token> FileTokens;
-		for (auto& i : LastParseResult.Globals)
+		std::pmr::vector<tokens::Token> FileTokens{ &GetSnapshot().Arena };
+		for (auto& i : GetSnapshot().Parsed.Globals)
 		{
 			if (i.File == FileName)
 				FileTokens.push_back(tokens::Token{
@@ -147,7 +231,7 @@ namespace protocol::tokens
 				.Modifier = 0 });
 		}
 
-		for (auto& i : LastParseResult.Constants)
+		for (auto& i : GetSnapshot().Parsed.Constants)
 		{
 			if (i.File == FileName)
 				FileTokens.push_back(tokens::Token{
@@ -156,13 +240,13 @@ namespace protocol::tokens
 				.Modifier = 0 });
 		}
 
-		for (auto& i : LastParseResult.Elements)
+		for (auto& i : GetSnapshot().Parsed.Elements)
 		{
 			if (i.File == FileName)
 				ScanElementForTokens(i.Root, FileTokens);
 		}
 
-		for (auto& i : VariableUsages)
+		for (auto& i : GetSnapshot().VariableUsages)
 		{
 			for (auto& Usage : i.second)
 			{
@@ -174,7 +258,7 @@ namespace protocol::tokens
 			}
 		}
 
-		return ConvertTokensToJson(FileTokens);
+		return EncodeTokens(FileTokens, GetColumnConverter(FileName));
 	}
 }
 
@@ -245,39 +329,35 @@ static std::string GetElementHoverMessage(kui::MarkupStructure::UIElement From,
 	return StrUtil::Format("element %s : %s\nNative (C++) element.", Name.c_str(), DerivedFrom.c_str());
 }
 
-static void ScanForVariableUsages(kui::MarkupStructure::UIElement& Target, kui::MarkupStructure::MarkupElement& Root)
+static void ScanForVariableUsages(analysis::Snapshot& Into, kui::MarkupStructure::UIElement& Target, kui::MarkupStructure::MarkupElement& Root, std::string_view File)
 {
 	using namespace protocol;
 	using namespace kui;
 
-	auto AddVariableUsage = [](const std::string& Name, const VariableUsage& Usage) {
-
-		if (VariableUsages.contains(Name))
-			VariableUsages[Name].push_back(Usage);
-		else
-			VariableUsages.insert({ Name, { Usage } });
+	auto AddVariableUsage = [&Into](const std::string& Name, const VariableUsage& Usage) {
+		Into.VariableUsages[StrUtil::Intern(Name)].push_back(Usage);
 		};
 
 	for (auto& i : Target.ElementProperties)
 	{
-		MarkupStructure::Global* g = LastParseResult.GetGlobal(i.Value);
+		MarkupStructure::Global* g = Into.Parsed.GetGlobal(i.Value);
 		if (g)
 		{
 			AddVariableUsage(g->Name.Text, VariableUsage{
 				.Type = VariableUsage::Global,
 				.Token = i.Value,
-				.File = Root.File,
+				.File = File,
 				.FromGlobal = g
 				});
 			continue;
 		}
-		MarkupStructure::Constant* c = LastParseResult.GetConstant(i.Value);
+		MarkupStructure::Constant* c = Into.Parsed.GetConstant(i.Value);
 		if (c)
 		{
 			AddVariableUsage(c->Name.Text, VariableUsage{
 				.Type = VariableUsage::Const,
 				.Token = i.Value,
-				.File = Root.File,
+				.File = File,
 				.FromConstant = c
 				});
 			continue;
@@ -291,7 +371,7 @@ static void ScanForVariableUsages(kui::MarkupStructure::UIElement& Target, kui::
 			AddVariableUsage(var.first, VariableUsage{
 				.Type = VariableUsage::Var,
 				.Token = i.Value,
-				.File = Root.File,
+				.File = File,
 				.VariableElement = &Root
 				});
 			break;
@@ -300,12 +380,44 @@ static void ScanForVariableUsages(kui::MarkupStructure::UIElement& Target, kui::
 
 	for (MarkupStructure::UIElement& Child : Target.Children)
 	{
-		ScanForVariableUsages(Child, Root);
+		ScanForVariableUsages(Into, Child, Root, File);
+	}
+}
+
+std::vector<protocol::FileDiagnostics> protocol::GroupDiagnostics(const std::vector<DiagnosticError>& Errors, std::string_view OnlyFile)
+{
+	std::unordered_map<std::string_view, std::vector<const DiagnosticError*>> ByFile;
+	for (const DiagnosticError& i : Errors)
+	{
+		if (OnlyFile.empty() || i.File == OnlyFile)
+			ByFile[i.File].push_back(&i);
+	}
+
+	std::vector<FileDiagnostics> Out;
+	for (auto [Name, File] : workspace::GetVisibleFiles())
+	{
+		if (!OnlyFile.empty() && Name != OnlyFile)
+			continue;
+
+		FileDiagnostics& Grouped = Out.emplace_back();
+		Grouped.File = Name;
+		auto Found = ByFile.find(Name);
+		if (Found == ByFile.end())
+			continue;
+
+		Grouped.Errors = std::move(Found->second);
+		std::stable_sort(Grouped.Errors.begin(), Grouped.Errors.end(), [](const DiagnosticError* a, const DiagnosticError* b) {
+			return std::tie(a->Line, a->Begin) < std::tie(b->Line, b->Begin);
+			});
+		if (workspace::ClientEncoding != workspace::PositionEncoding::Utf8 && workspace::HasLineIndex(*File))
+			Grouped.Lines = &workspace::GetLineIndex(*File);
 	}
+	return Out;
 }
 
-void protocol::PublishDiagnostics(std::vector<protocol::DiagnosticError> Error, Message* RespondTo)
+void protocol::PublishDiagnostics(const std::vector<protocol::DiagnosticError>& Error, Message* RespondTo, const analysis::CancellationToken& Token)
 {
+	trace::Span Span = trace::Span("PublishDiagnostics");
 	std::string TargetFile;
 
 	if (RespondTo)
@@ -313,104 +425,382 @@ void protocol::PublishDiagnostics(std::vector<protocol::DiagnosticError> Error,
 		TargetFile = RespondTo->MessageJson["textDocument"];
 	}
 
-	for (auto& File : workspace::Files)
+	for (const FileDiagnostics& File : GroupDiagnostics(Error, TargetFile))
 	{
-		if (!TargetFile.empty() && File.first != TargetFile)
+		// The analysis of the newer version publishes its own diagnostics.
+		if (Token.IsCancelled())
+			return;
+
+		auto WriteDiagnostics = [&](JsonWriter& Out) {
+			Out.BeginArray();
+			for (const DiagnosticError* i : File.Errors)
+			{
+				Out.BeginObject();
+				Out.Field("message", i->Message);
+				Out.Field("severity", i->Severity);
+				Out.Field("code", i->Type == DiagnosticError::Verify ? "kuiVerify" : "kuiParse");
+				Out.Key("range");
+				Out.BeginObject();
+				Out.Key("start");
+				Out.BeginObject();
+				Out.Field("line", i->Line);
+				Out.Field("character", ToClientColumn(File.Lines, i->Line, i->Begin));
+				Out.EndObject();
+				Out.Key("end");
+				Out.BeginObject();
+				Out.Field("line", i->Line);
+				Out.Field("character", ToClientColumn(File.Lines, i->Line, i->End));
+				Out.EndObject();
+				Out.EndObject();
+				Out.EndObject();
+			}
+			Out.EndArray();
+			};
+
+		if (RespondTo)
 		{
-			continue;
+			ResponseMessage::SendResult(*RespondTo, [&](JsonWriter& Result) {
+				Result.BeginObject();
+				Result.Field("kind", "full");
+				Result.Key("items");
+				WriteDiagnostics(Result);
+				Result.Key("diagnostics");
+				WriteDiagnostics(Result);
+				Result.EndObject();
+				});
+		}
+		else
+		{
+			Message::SendNotification("textDocument/publishDiagnostics", [&](JsonWriter& Params) {
+				Params.BeginObject();
+				Params.Field("uri", File.File);
+				Params.Key("diagnostics");
+				WriteDiagnostics(Params);
+				Params.EndObject();
+				});
 		}
+	}
+}
 
-		json DiagnosticsJson = json::array();
+void protocol::ScanFile(std::string Content, std::string Uri)
+{
+	trace::Span Span = trace::Span("ScanFile");
+	using namespace workspace;
 
-		for (auto& i : Error)
-		{
-			if (i.File != File.first)
-				continue;
+	FileData& File = GetOverlay().Documents[Uri];
+	if (File.OpenDocument)
+		File.OpenDocument->SetText(MakeContent(std::move(Content)));
+	else
+		File.OpenDocument = std::make_unique<Document>(MakeContent(std::move(Content)));
+	File.Content = File.OpenDocument->GetContent();
+	File.Evicted = false;
+	File.Summary = nullptr;
+	if (File.Name.empty())
+		File.Name = ConvertFilePath(Uri);
+
+	ScheduleAnalysis();
+}
 
-			DiagnosticsJson.push_back(json::object({
-				{ "message", i.Message },
-				{ "severity", i.Severity },
-				{ "code", i.Type == DiagnosticError::Verify ? "kuiVerify" : "kuiParse" },
-				{ "range", { { "start", {
-					{ "line", i.Line },
-				{ "character", i.Begin },
-				} },
-				{ "end", {
-					{ "line", i.Line },
-				{ "character", i.End },
-				} } } } }));
-		}
+static workspace::Document::Position GetDocumentPosition(const DocumentChange::Position& From)
+{
+	return workspace::Document::Position{
+		.Line = From.Line,
+		.Character = From.Character,
+	};
+}
 
-		if (RespondTo)
+void protocol::ChangeFile(DocumentChange Change)
+{
+	trace::Span Span = trace::Span("ChangeFile");
+	using namespace workspace;
+
+	FileData& File = GetOverlay().Documents[Change.Uri];
+	if (!File.OpenDocument)
+		File.OpenDocument = std::make_unique<Document>(File.Content);
+	if (File.Name.empty())
+		File.Name = ConvertFilePath(Change.Uri);
+
+	for (DocumentChange::Change& Edit : Change.Changes)
+	{
+		if (Edit.HasRange)
 		{
-			ResponseMessage NewMessage = ResponseMessage(*RespondTo, {
-				{ "kind", "full" },
-				{ "items", DiagnosticsJson },
-				{ "diagnostics", DiagnosticsJson }
-				});
-			NewMessage.Send();
+			Document::Position Start = GetDocumentPosition(Edit.Start);
+			Document::Position End = GetDocumentPosition(Edit.End);
+			if (ClientEncoding != PositionEncoding::Utf8)
+			{
+				Start.Character = LineIndex::Utf16ToByteColumn(File.OpenDocument->GetLine(Start.Line), Start.Character);
+				End.Character = LineIndex::Utf16ToByteColumn(File.OpenDocument->GetLine(End.Line), End.Character);
+			}
+			File.OpenDocument->Replace(Start, End, Edit.Text);
 		}
 		else
 		{
-			Message NewMessage = Message("textDocument/publishDiagnostics", {
-				{ "uri", File.first },
-				{ "diagnostics", DiagnosticsJson }
-				}, true);
-			NewMessage.Send();
+			File.OpenDocument->SetText(MakeContent(std::move(Edit.Text)));
 		}
 	}
+
+	File.Content = File.OpenDocument->GetContent();
+	ScheduleAnalysis();
+}
+
+void protocol::ScheduleAnalysis()
+{
+	SessionAnalysis& State = GetAnalysis();
+	if (State.AnalysisQueued)
+		return;
+	State.AnalysisQueued = true;
+
+	scheduler::Post(scheduler::Priority::Background, [Session = session::GetCurrent()]() {
+		session::Scope Scope = session::Scope(Session);
+		// The session was closed before its analysis ran.
+		auto Found = Analyses.find(Session);
+		if (Found == Analyses.end())
+			return;
+		// Changes made while the analysis runs queue the next one.
+		Found->second.AnalysisQueued = false;
+		// Not every notification that cancels an analysis queues a new one, closing a document doesn't for example.
+		// The documents are analyzed again, so deferred requests and diagnostics don't wait for the next edit.
+		if (!UpdateAnalysis(analysis::CancellationToken::ForCurrentGeneration()))
+			ScheduleAnalysis();
+		});
 }
 
-void protocol::ScanFile(const std::string& Content, std::string Uri)
+// Queues an analysis for every session, after the files on disk changed.
+static void ScheduleAnalysisOfAllSessions()
+{
+	for (auto& [Session, State] : protocol::Analyses)
+	{
+		session::Scope Scope = session::Scope(Session);
+		protocol::ScheduleAnalysis();
+	}
+}
+
+// Sets the parser's error callback, the previous one is restored when the scope is destroyed.
+class ParseErrorScope
+{
+public:
+	ParseErrorScope(decltype(kui::parseError::ErrorCallback) Callback)
+		: Previous(std::exchange(kui::parseError::ErrorCallback, std::move(Callback)))
+	{
+	}
+	~ParseErrorScope()
+	{
+		kui::parseError::ErrorCallback = std::move(Previous);
+	}
+	ParseErrorScope(const ParseErrorScope&) = delete;
+
+private:
+	decltype(kui::parseError::ErrorCallback) Previous;
+};
+
+// Parses an evicted file on its own. Analyses reuse the result until the file changes on disk.
+static std::shared_ptr<const analysis::FileSummary> SummarizeFile(const std::string& Name, workspace::ContentBuffer Content)
+{
+	trace::Span Span = trace::Span("SummarizeFile");
+	auto Summary = std::make_shared<analysis::FileSummary>();
+
+	ParseErrorScope Errors = ParseErrorScope([&Summary](std::string ErrorText, std::string File, size_t ErrorLine, size_t Begin, size_t End) {
+		Summary->Diagnostics.push_back(protocol::DiagnosticError
+			{
+				.Message = ErrorText,
+				.File = StrUtil::Intern(File),
+				.Type = protocol::DiagnosticError::Parse,
+				.Line = ErrorLine,
+				.Begin = Begin,
+				.End = End,
+			});
+		});
+
+	std::vector<kui::MarkupParse::FileEntry> Entries;
+	Entries.push_back(kui::MarkupParse::FileEntry{
+		.Content = *Content,
+		.Name = Name,
+		});
+	kui::MarkupStructure::ParseResult Parsed = kui::MarkupParse::ParseFiles(std::move(Entries));
+	Summary->Elements = std::move(Parsed.Elements);
+	Summary->Constants = std::move(Parsed.Constants);
+	Summary->Globals = std::move(Parsed.Globals);
+	return Summary;
+}
+
+bool protocol::UpdateAnalysis(const analysis::CancellationToken& Token)
 {
 	using namespace workspace;
 
-	kui::Timer t;
+	stats::Phase Total = stats::Phase("analysis");
 
 	std::vector<kui::MarkupParse::FileEntry> Entries;
 
-	Files[Uri].Content = Content;
+	auto Result = std::make_shared<analysis::Snapshot>();
+	// Closing the session while its files are analyzed drops its analysis, the result isn't committed then.
+	session::SessionId Session = session::GetCurrent();
+	Analyses.try_emplace(Session);
 
-	for (auto& i : Files)
+	// The parser and verifier can't be interrupted, so cancellation is checked between them, files and elements.
+	// A cancelled analysis keeps the previous snapshot. Analyses queued by ScheduleAnalysis() are queued again if they are cancelled.
+	auto Cancel = []() {
+		stats::RecordPhase("cancelled", stats::Clock::duration());
+		return false;
+		};
+
+	std::vector<std::shared_ptr<const analysis::FileSummary>> Summaries;
+
+	// The session's opened documents replace the files on disk they were opened from.
+	std::vector<std::pair<std::string_view, FileData*>> Visible = GetVisibleFiles();
+	Entries.reserve(Visible.size());
+	for (auto& [Name, File] : Visible)
 	{
+		if (Token.IsCancelled())
+			return Cancel();
+
+		// Evicted files are only read again if the client reported a change on disk. Their parse result is reused otherwise.
+		if (File->Evicted)
+		{
+			if (NeedsSummary(*File))
+				File->Summary = SummarizeFile(std::string(Name), ReloadEvicted(*File));
+			Summaries.push_back(File->Summary);
+			continue;
+		}
+		if (!File->Content)
+			continue;
+		// The parser owns its input, so this is the only copy of the file contents made for a scan.
 		Entries.push_back(kui::MarkupParse::FileEntry{
-			.Content = i.second.Content,
-			.Name = i.first,
+			.Content = *File->Content,
+			.Name = std::string(Name),
 			});
+		Result->Files.insert({ std::string(Name), File->Content });
 	}
 
-	LastDiagnostics.clear();
-
 	bool Verifying = false;
-	kui::parseError::ErrorCallback = [&Verifying](std::string ErrorText, std::string File, size_t ErrorLine, size_t Begin, size_t End) {
-		LastDiagnostics.push_back(DiagnosticError
+	ParseErrorScope Errors = ParseErrorScope([&Verifying, &Result](std::string ErrorText, std::string File, size_t ErrorLine, size_t Begin, size_t End) {
+		Result->Diagnostics.push_back(DiagnosticError
 			{
 				.Message = ErrorText,
-				.File = File,
+				.File = StrUtil::Intern(File),
 				.Type = Verifying ? DiagnosticError::Verify : DiagnosticError::Parse,
 				.Line = ErrorLine,
 				.Begin = Begin,
 				.End = End,
 			});
-		};
-	LastParseResult = kui::MarkupParse::ParseFiles(Entries);
+		});
+	{
+		stats::Phase Scope = stats::Phase("parse");
+		Result->Parsed = kui::MarkupParse::ParseFiles(std::move(Entries));
+	}
+
+	// Requests that arrived while parsing are answered using the previous snapshot. Requests on changed documents wait for this one.
+	scheduler::RunForeground();
+	if (Token.IsCancelled())
+		return Cancel();
+
+	{
+		/*
+		 * The snapshot owns its parse result, which verifying modifies and the preview reads while the next analysis runs.
+		 * The summaries stay unverified for the next analysis, so they are copied, but only by analyses that weren't cancelled while parsing.
+		 */
+		stats::Phase Scope = stats::Phase("summaries");
+		auto& Parsed = Result->Parsed;
+		size_t ElementCount = Parsed.Elements.size();
+		for (const auto& Summary : Summaries)
+			ElementCount += Summary->Elements.size();
+		Parsed.Elements.reserve(ElementCount);
+
+		for (const auto& Summary : Summaries)
+		{
+			Parsed.Elements.insert(Parsed.Elements.end(), Summary->Elements.begin(), Summary->Elements.end());
+			Parsed.Constants.insert(Parsed.Constants.end(), Summary->Constants.begin(), Summary->Constants.end());
+			Parsed.Globals.insert(Parsed.Globals.end(), Summary->Globals.begin(), Summary->Globals.end());
+			Result->Diagnostics.insert(Result->Diagnostics.end(), Summary->Diagnostics.begin(), Summary->Diagnostics.end());
+		}
+	}
+
 	Verifying = true;
-	kui::markupVerify::Verify(LastParseResult);
-	preview::LoadParsed(&LastParseResult);
+	{
+		stats::Phase Scope = stats::Phase("verify");
+		kui::markupVerify::Verify(Result->Parsed);
+	}
+
+	scheduler::RunForeground();
+	if (Token.IsCancelled())
+		return Cancel();
+
+	{
+		stats::Phase Scope = stats::Phase("usages");
+		for (auto& i : Result->Parsed.Elements)
+		{
+			if (Token.IsCancelled())
+				return Cancel();
+			ScanForVariableUsages(*Result, i.Root, i, StrUtil::Intern(i.File));
+		}
+	}
+
+	{
+		stats::Phase Scope = stats::Phase("outline");
+		Result->BuildOutlines();
+	}
+
+	{
+		stats::Phase Scope = stats::Phase("symbols");
+		Result->BuildSymbolIndex();
+	}
+
+	if (!Analyses.contains(Session))
+		return true;
+
+	// Retires the previous snapshot.
+	SessionAnalysis& State = GetAnalysis();
+	State.Current = Result;
+
+	// Positions in deferred requests refer to the versions of the documents that were just analyzed, or newer ones.
+	for (Message& Deferred : std::exchange(State.DeferredRequests, {}))
+	{
+		scheduler::Post(scheduler::Priority::Interactive, [Deferred]() {
+			session::Scope Session = session::Scope(Deferred.Session);
+			HandleClientMessage(Deferred);
+			});
+	}
 
-	VariableUsages.clear();
-	for (auto& i : LastParseResult.Elements)
 	{
-		ScanForVariableUsages(i.Root, i);
+		stats::Phase Scope = stats::Phase("symbolSearch");
+		UpdateSymbolSearch(Result);
 	}
 
-	PublishDiagnostics(LastDiagnostics);
+	scheduler::Post(scheduler::Priority::Publishing, [Published = Result, Session, Token]() {
+		// A newer analysis publishes its own diagnostics.
+		auto Found = Analyses.find(Session);
+		if (Found == Analyses.end() || Published != Found->second.Current)
+			return;
+		session::Scope Route = session::Scope(Session);
+		stats::Phase Scope = stats::Phase("diagnostics");
+		PublishDiagnostics(Published->Diagnostics, nullptr, Token);
+		});
+
+	{
+		// Tokens are only kept for opened documents. The client only requests them for those,
+		// other files get them computed on request.
+		stats::Phase Scope = stats::Phase("tokens");
+		// Not cancellable: the snapshot is already committed, and requests compare the files with it, not with their tokens.
+		// Tokens skipped here would be served for the new snapshot without being computed from it.
+		for (auto& [Name, File] : GetOverlay().Documents)
+		{
+			File.SemanticTokens = tokens::GetDocumentTokens(Name);
+		}
+	}
 
-	for (auto& i : LastParseResult.FileLines)
+	if (State.SemanticTokensOutdated && SemanticTokensRefreshSessions.contains(Session) && !Token.IsCancelled())
 	{
-		Files[i.first].SemanticTokens = tokens::GetDocumentTokens(i.first);
+		State.SemanticTokensOutdated = false;
+		Message("workspace/semanticTokens/refresh", json()).SendRequest();
 	}
-	std::cerr << t.Get() << std::endl;
+
+	// The snapshot is complete and won't be modified anymore, so it can be shared with the preview.
+	UpdatePreview();
+
+	EnforceMemoryBudget();
+	ReportMemoryUsage();
+	stats::SetMemoryUsage("snapshot", Result->GetMemoryUsage());
+	stats::SetMemoryUsage("indexes.symbolSearch", search::GetMemoryUsage());
+	return true;
 }
 
 static kui::MarkupStructure::UIElement* GetClosestElement(std::vector<kui::MarkupStructure::UIElement>& From, size_t Line, size_t Character)
@@ -434,7 +824,7 @@ static kui::MarkupStructure::UIElement* GetClosestElement(std::vector<kui::Marku
 
 static std::optional<std::pair<UIElement, MarkupElement*>> GetElementAt(std::string File, size_t Line, size_t Character)
 {
-	for (auto& i : protocol::LastParseResult.Elements)
+	for (auto& i : protocol::GetSnapshot().Parsed.Elements)
 	{
 		if (i.File != File)
 		{
@@ -534,12 +924,12 @@ static std::string GetTooltipFromElement(MarkupElement& Root, UIElement& FromEle
 	return "";
 }
 
-static std::string GetHoverMessage(std::string File, size_t Char, size_t Line)
+std::string protocol::GetHoverMessage(std::string File, size_t Char, size_t Line)
 {
 	using namespace protocol;
 	using namespace workspace;
 
-	for (auto& i : LastParseResult.Elements)
+	for (auto& i : GetSnapshot().Parsed.Elements)
 	{
 		if (!CompareFiles(ConvertFilePath(i.File), ConvertFilePath(File)))
 			continue;
@@ -549,26 +939,26 @@ static std::string GetHoverMessage(std::string File, size_t Char, size_t Line)
 		if (!HoverMessage.empty())
 			return HoverMessage;
 	}
-	for (auto& Variable : VariableUsages)
+	for (auto& Variable : GetSnapshot().VariableUsages)
 	{
 		for (VariableUsage& Usage : Variable.second)
 		{
-			if (!CompareFiles(ConvertFilePath(Usage.File), ConvertFilePath(File)))
+			if (!CompareFiles(ConvertFilePath(std::string(Usage.File)), ConvertFilePath(File)))
 				continue;
-			if (Usage.Token.BeginChar <= Char && Usage.Token.EndChar > Char && Line == Usage.Token.Line)
+			if (Usage.Token.Contains(Line, Char))
 			{
 				if (Usage.Type == VariableUsage::Global)
 					return GetGlobalHoverMessage(Usage.FromGlobal);
 				if (Usage.Type == VariableUsage::Const)
 					return GetConstHoverMessage(Usage.FromConstant);
 				if (Usage.Type == VariableUsage::Var)
-					return GetVariableHoverMessage(Variable.first, Usage.VariableElement);
-				return Usage.Token.Text;
+					return GetVariableHoverMessage(std::string(Variable.first), Usage.VariableElement);
+				return std::string(Variable.first);
 			}
 		}
 	}
 
-	for (auto& Global : LastParseResult.Globals)
+	for (auto& Global : GetSnapshot().Parsed.Globals)
 	{
 		if (!CompareFiles(ConvertFilePath(Global.File), ConvertFilePath(File)))
 			continue;
@@ -579,7 +969,7 @@ static std::string GetHoverMessage(std::string File, size_t Char, size_t Line)
 		}
 	}
 
-	for (auto& Const : LastParseResult.Constants)
+	for (auto& Const : GetSnapshot().Parsed.Constants)
 	{
 		if (!CompareFiles(ConvertFilePath(Const.File), ConvertFilePath(File)))
 			continue;
@@ -593,51 +983,46 @@ static std::string GetHoverMessage(std::string File, size_t Char, size_t Line)
 	return "";
 }
 
-static json GetTokenCompletions(std::string File, kui::stringParse::StringToken Token)
+static void WriteTokenCompletions(std::string File, kui::stringParse::StringToken Token, JsonWriter& Out)
 {
 	using namespace kui::MarkupStructure;
 
-	json CompletionArray = json::array();
-
 	std::optional Elem = GetElementAt(File, Token.Line, Token.BeginChar);
 	std::unordered_set<std::string> AutoCompleteValues;
 
-	auto AddKeyword = [&CompletionArray](std::string Name, std::string Detail) {
-		CompletionArray.push_back({ { "label", Name },
-			{ "detail", Detail },
-			{ "kind", 14 } });
+	auto AddItem = [&Out](std::string_view Name, std::string_view Detail, int Kind) {
+		Out.BeginObject();
+		Out.Field("label", Name);
+		Out.Field("detail", Detail);
+		Out.Field("kind", Kind);
+		Out.EndObject();
 		};
 
-	auto AddGlobal = [&CompletionArray](std::string Name, std::string Detail) {
-		CompletionArray.push_back({ { "label", Name },
-			{ "detail", Detail },
-			{ "kind", 6 } });
+	auto AddKeyword = [&AddItem](std::string_view Name, std::string_view Detail) {
+		AddItem(Name, Detail, 14);
 		};
 
-	auto AddVariable = [&CompletionArray](std::string Name, std::string Detail) {
-		CompletionArray.push_back({ { "label", Name },
-			{ "detail", Detail },
-			{ "kind", 10 } });
+	auto AddGlobal = [&AddItem](std::string_view Name, std::string_view Detail) {
+		AddItem(Name, Detail, 6);
 		};
 
-	auto AddConst = [&CompletionArray](std::string Name, std::string Detail) {
-		CompletionArray.push_back({ { "label", Name },
-			{ "detail", Detail },
-			{ "kind", 21 } });
+	auto AddVariable = [&AddItem](std::string_view Name, std::string_view Detail) {
+		AddItem(Name, Detail, 10);
 		};
 
-	auto AddElement = [&CompletionArray](std::string Name, std::string Detail) {
-		CompletionArray.push_back({ { "label", Name },
-			{ "detail", Detail },
-			{ "kind", 7 } });
+	auto AddConst = [&AddItem](std::string_view Name, std::string_view Detail) {
+		AddItem(Name, Detail, 21);
 		};
 
-	auto AddValue = [&CompletionArray](std::string Name, std::string Detail) {
-		CompletionArray.push_back({ { "label", Name },
-			{ "detail", Detail },
-			{ "kind", 12 } });
+	auto AddElement = [&AddItem](std::string_view Name, std::string_view Detail) {
+		AddItem(Name, Detail, 7);
 		};
 
+	auto AddValue = [&AddItem](std::string_view Name, std::string_view Detail) {
+		AddItem(Name, Detail, 12);
+		};
+
+	Out.BeginArray();
 	if (Elem.has_value())
 	{
 		AddKeyword("child", "Child element keyword");
@@ -664,12 +1049,12 @@ static json GetTokenCompletions(std::string File, kui::stringParse::StringToken
 
 			auto Info = GetPropertyInfo(i);
 
-			CompletionArray.push_back({
-				{ "label", i.Name },
-				{ "detail", Info.first },
-				{ "documentation", Info.second },
-				{ "kind", 6 }
-				});
+			Out.BeginObject();
+			Out.Field("label", i.Name);
+			Out.Field("detail", Info.first);
+			Out.Field("documentation", Info.second);
+			Out.Field("kind", 6);
+			Out.EndObject();
 		}
 
 		for (auto& i : Elem->second->Root.Variables)
@@ -677,15 +1062,15 @@ static json GetTokenCompletions(std::string File, kui::stringParse::StringToken
 			AddVariable(i.first, GetVariableHoverMessage(i.first, Elem->second));
 		}
 
-		for (auto& i : protocol::LastParseResult.Constants)
+		for (auto& i : protocol::GetSnapshot().Parsed.Constants)
 		{
-			AddConst(i.Name, GetConstHoverMessage(&i));
+			AddConst(i.Name.Text, GetConstHoverMessage(&i));
 		}
-		for (auto& i : protocol::LastParseResult.Globals)
+		for (auto& i : protocol::GetSnapshot().Parsed.Globals)
 		{
-			AddGlobal(i.Name, GetGlobalHoverMessage(&i));
+			AddGlobal(i.Name.Text, GetGlobalHoverMessage(&i));
 		}
-		for (auto& i : protocol::LastParseResult.Elements)
+		for (auto& i : protocol::GetSnapshot().Parsed.Elements)
 		{
 			AddElement(i.FromToken.Text, GetElementHoverMessage(i.Root, i.File));
 		}
@@ -696,39 +1081,587 @@ static json GetTokenCompletions(std::string File, kui::stringParse::StringToken
 		AddKeyword("const", "Compile-time constant");
 		AddKeyword("global", "Global variable modifiable at runtime");
 	}
-	return CompletionArray;
+	Out.EndArray();
+}
+
+static const analysis::FileOutline* GetOutline(std::string_view File)
+{
+	auto Found = protocol::GetSnapshot().Outlines.find(File);
+	if (Found == protocol::GetSnapshot().Outlines.end())
+		return nullptr;
+	return &Found->second;
+}
+
+static void WritePosition(JsonWriter& Out, const workspace::LineIndex* Lines, size_t Line, size_t Character)
+{
+	Out.BeginObject();
+	Out.Field("line", Line);
+	Out.Field("character", protocol::ToClientColumn(Lines, Line, Character));
+	Out.EndObject();
+}
+
+static void WriteRange(JsonWriter& Out, const workspace::LineIndex* Lines, size_t StartLine, size_t StartChar, size_t EndLine, size_t EndChar)
+{
+	Out.BeginObject();
+	Out.Key("start");
+	WritePosition(Out, Lines, StartLine, StartChar);
+	Out.Key("end");
+	WritePosition(Out, Lines, EndLine, EndChar);
+	Out.EndObject();
+}
+
+static void WriteNodeRange(JsonWriter& Out, const workspace::LineIndex* Lines, const analysis::OutlineNode& Node)
+{
+	WriteRange(Out, Lines, Node.StartLine, Node.StartChar, Node.EndLine, Node.EndChar);
+}
+
+static void WriteSelectionRange(JsonWriter& Out, const workspace::LineIndex* Lines, const analysis::TokenPosition& Token)
+{
+	WriteRange(Out, Lines, Token.Line, Token.BeginChar, Token.Line, Token.EndChar);
+}
+
+// Writes the document symbol of the node at Index, including its children. Returns the index of the next sibling.
+static uint32_t WriteDocumentSymbol(const analysis::FileOutline& Nodes, uint32_t Index, const workspace::LineIndex* Lines, JsonWriter& Out)
+{
+	using analysis::OutlineNode;
+
+	// Values of the LSP SymbolKind enum.
+	constexpr int KIND_CLASS = 5;
+	constexpr int KIND_VARIABLE = 13;
+	constexpr int KIND_CONSTANT = 14;
+	constexpr int KIND_OBJECT = 19;
+
+	const OutlineNode& Node = Nodes[Index];
+	int Kind = KIND_OBJECT;
+	switch (Node.Kind)
+	{
+	case OutlineNode::Element:
+		Kind = KIND_CLASS;
+		break;
+	case OutlineNode::Global:
+		Kind = KIND_VARIABLE;
+		break;
+	case OutlineNode::Constant:
+		Kind = KIND_CONSTANT;
+		break;
+	default:
+		break;
+	}
+
+	Out.BeginObject();
+	// Clients reject symbols without a name.
+	Out.Field("name", Node.Name.empty() ? Node.Detail : Node.Name);
+	Out.Field("detail", Node.Detail);
+	Out.Field("kind", Kind);
+	Out.Key("range");
+	WriteNodeRange(Out, Lines, Node);
+	Out.Key("selectionRange");
+	WriteSelectionRange(Out, Lines, Node.Selection);
+	if (Node.SubtreeEnd > Index + 1)
+	{
+		Out.Key("children");
+		Out.BeginArray();
+		for (uint32_t Child = Index + 1; Child < Node.SubtreeEnd;)
+		{
+			Child = WriteDocumentSymbol(Nodes, Child, Lines, Out);
+		}
+		Out.EndArray();
+	}
+	Out.EndObject();
+	return Node.SubtreeEnd;
+}
+
+// Writes the selection range at the given position, from the innermost node containing it to the outermost.
+static void WriteSelectionRangeAt(const analysis::FileOutline* Nodes, size_t Line, size_t Character, const workspace::LineIndex* Lines, JsonWriter& Out)
+{
+	using analysis::OutlineNode;
+
+	uint32_t Innermost = OutlineNode::NO_PARENT;
+	if (Nodes)
+	{
+		uint32_t Index = 0, End = uint32_t(Nodes->size());
+		while (Index < End)
+		{
+			const OutlineNode& Node = (*Nodes)[Index];
+			if (!Node.Contains(Line, Character))
+			{
+				Index = Node.SubtreeEnd;
+				continue;
+			}
+			Innermost = Index;
+			End = Node.SubtreeEnd;
+			Index++;
+		}
+	}
+
+	// Positions outside of any declaration only select themselves.
+	if (Innermost == OutlineNode::NO_PARENT)
+	{
+		Out.BeginObject();
+		Out.Key("range");
+		WriteRange(Out, Lines, Line, Character, Line, Character);
+		Out.EndObject();
+		return;
+	}
+
+	size_t Depth = 0;
+	bool InName = (*Nodes)[Innermost].Selection.Contains(Line, Character);
+	if (InName)
+	{
+		Out.BeginObject();
+		Out.Key("range");
+		WriteSelectionRange(Out, Lines, (*Nodes)[Innermost].Selection);
+		Out.Key("parent");
+	}
+	for (uint32_t Index = Innermost; Index != OutlineNode::NO_PARENT; Index = (*Nodes)[Index].Parent)
+	{
+		Out.BeginObject();
+		Out.Key("range");
+		WriteNodeRange(Out, Lines, (*Nodes)[Index]);
+		if ((*Nodes)[Index].Parent != OutlineNode::NO_PARENT)
+			Out.Key("parent");
+		Depth++;
+	}
+	for (size_t i = 0; i < Depth; i++)
+	{
+		Out.EndObject();
+	}
+	if (InName)
+		Out.EndObject();
+}
+
+void protocol::WriteCompletions(std::string File, size_t Line, size_t Character, JsonWriter& Out)
+{
+	WriteTokenCompletions(File, kui::stringParse::StringToken("", Character, Character + 1, Line), Out);
+}
+
+void protocol::WriteDocumentFoldingRanges(std::string File, JsonWriter& Out)
+{
+	using analysis::OutlineNode;
+
+	const workspace::LineIndex* Lines = GetColumnConverter(File);
+	const analysis::FileOutline* Outline = GetOutline(File);
+	Out.BeginArray();
+	if (Outline)
+	{
+		for (const OutlineNode& Node : *Outline)
+		{
+			if (Node.Kind != OutlineNode::Element && Node.Kind != OutlineNode::Child)
+				continue;
+			Out.BeginObject();
+			Out.Field("startLine", Node.FoldLine);
+			Out.Field("startCharacter", ToClientColumn(Lines, Node.FoldLine, Node.FoldChar));
+			Out.Field("endLine", Node.EndLine);
+			Out.Field("endCharacter", ToClientColumn(Lines, Node.EndLine, Node.EndChar));
+			Out.EndObject();
+		}
+	}
+	Out.EndArray();
+}
+
+void protocol::WriteDocumentSymbols(std::string File, JsonWriter& Out)
+{
+	const workspace::LineIndex* Lines = GetColumnConverter(File);
+	const analysis::FileOutline* Outline = GetOutline(File);
+	Out.BeginArray();
+	if (Outline)
+	{
+		for (uint32_t Index = 0; Index < Outline->size();)
+		{
+			Index = WriteDocumentSymbol(*Outline, Index, Lines, Out);
+		}
+	}
+	Out.EndArray();
+}
+
+static void WriteLocation(JsonWriter& Out, const analysis::SymbolLocation& Location)
+{
+	const workspace::LineIndex* Lines = protocol::GetColumnConverter(Location.File);
+	Out.BeginObject();
+	Out.Field("uri", workspace::GetFileUri(Location.File));
+	Out.Key("range");
+	WriteSelectionRange(Out, Lines, Location.Token);
+	Out.EndObject();
+}
+
+void protocol::WriteDefinition(std::string File, size_t Line, size_t Character, JsonWriter& Out)
+{
+	const analysis::Symbol* Found = GetSnapshot().GetSymbolAt(File, Line, Character);
+	if (Found)
+		WriteLocation(Out, Found->Definition);
+	else
+		Out.Null();
+}
+
+void protocol::WriteReferences(std::string File, size_t Line, size_t Character, bool IncludeDeclaration, JsonWriter& Out)
+{
+	const analysis::Symbol* Found = GetSnapshot().GetSymbolAt(File, Line, Character);
+	Out.BeginArray();
+	if (Found && IncludeDeclaration)
+		WriteLocation(Out, Found->Definition);
+	if (Found)
+	{
+		for (const analysis::SymbolLocation& Reference : Found->References)
+		{
+			WriteLocation(Out, Reference);
+		}
+	}
+	Out.EndArray();
+}
+
+void protocol::WriteDocumentHighlights(std::string File, size_t Line, size_t Character, JsonWriter& Out)
+{
+	// Values of the LSP DocumentHighlightKind enum.
+	constexpr int KIND_READ = 2;
+	constexpr int KIND_WRITE = 3;
+
+	const workspace::LineIndex* Lines = GetColumnConverter(File);
+	const analysis::Symbol* Found = GetSnapshot().GetSymbolAt(File, Line, Character);
+	Out.BeginArray();
+	if (Found)
+	{
+		auto WriteHighlight = [&](const analysis::TokenPosition& Token, int Kind) {
+			Out.BeginObject();
+			Out.Key("range");
+			WriteSelectionRange(Out, Lines, Token);
+			Out.Field("kind", Kind);
+			Out.EndObject();
+			};
+
+		if (Found->Definition.File == File)
+			WriteHighlight(Found->Definition.Token, KIND_WRITE);
+		auto [Begin, End] = Found->GetReferencesIn(File);
+		for (auto* Reference = Begin; Reference != End; Reference++)
+		{
+			WriteHighlight(Reference->Token, KIND_READ);
+		}
+	}
+	Out.EndArray();
+}
+
+const std::vector<protocol::DiagnosticError>& protocol::GetDiagnostics()
+{
+	return GetSnapshot().Diagnostics;
+}
+
+void protocol::WriteWorkspaceSymbols(std::string_view Query, JsonWriter& Out)
+{
+	// Values of the LSP SymbolKind enum.
+	constexpr int KIND_CLASS = 5;
+	constexpr int KIND_VARIABLE = 13;
+	constexpr int KIND_CONSTANT = 14;
+	// Clients filter and sort the results again, so only the best matches are sent.
+	constexpr size_t MAX_RESULTS = 250;
+
+	Out.BeginArray();
+	for (const search::SymbolMatch& Match : search::Find(Query, MAX_RESULTS))
+	{
+		int Kind = KIND_CLASS;
+		if (Match.Kind == analysis::Symbol::Global)
+			Kind = KIND_VARIABLE;
+		else if (Match.Kind == analysis::Symbol::Constant)
+			Kind = KIND_CONSTANT;
+
+		Out.BeginObject();
+		Out.Field("name", Match.Name);
+		Out.Field("kind", Kind);
+		Out.Key("location");
+		WriteLocation(Out, Match.Location);
+		Out.Field("containerName", workspace::GetDisplayName(std::string(Match.Location.File)));
+		Out.EndObject();
+	}
+	Out.EndArray();
 }
 
-static json GetFoldingRanges(kui::MarkupStructure::UIElement& From)
+void protocol::WritePrepareRename(std::string File, size_t Line, size_t Character, JsonWriter& Out)
 {
-	json RangesArray = json::array();
-	RangesArray.push_back({ { "startLine", From.TypeName.Line },
-		{ "startCharacter", From.TypeName.EndChar },
-		{ "endLine", From.EndLine },
-		{ "endCharacter", From.EndChar + 1 } });
+	const analysis::Symbol* Found = GetSnapshot().GetSymbolAt(File, Line, Character);
+	if (!Found)
+	{
+		Out.Null();
+		return;
+	}
 
-	for (auto& Child : From.Children)
+	// The symbol can be referenced by a different token than the one at the position, but all of them have the same text.
+	const analysis::TokenPosition* At = &Found->Definition.Token;
+	if (Found->Definition.File != File || !At->Contains(Line, Character))
 	{
-		json ChildRanges = GetFoldingRanges(Child);
-		for (json Range : ChildRanges)
+		auto [Begin, End] = Found->GetReferencesIn(File);
+		for (auto* Reference = Begin; Reference != End; Reference++)
+		{
+			if (Reference->Token.Contains(Line, Character))
+				At = &Reference->Token;
+		}
+	}
+
+	Out.BeginObject();
+	Out.Key("range");
+	WriteSelectionRange(Out, GetColumnConverter(File), *At);
+	Out.Field("placeholder", Found->Name);
+	Out.EndObject();
+}
+
+void protocol::WriteRenameEdit(const analysis::Symbol& Target, std::string_view NewName, JsonWriter& Out)
+{
+	// References are sorted by file, the definition is written with the references in its file.
+	auto WriteEdit = [&](const workspace::LineIndex* Lines, const analysis::TokenPosition& Token) {
+		Out.BeginObject();
+		Out.Key("range");
+		WriteSelectionRange(Out, Lines, Token);
+		Out.Field("newText", NewName);
+		Out.EndObject();
+		};
+
+	auto WriteFile = [&](std::string_view File) {
+		const workspace::LineIndex* Lines = GetColumnConverter(File);
+		Out.Key(workspace::GetFileUri(File));
+		Out.BeginArray();
+		if (Target.Definition.File == File)
+			WriteEdit(Lines, Target.Definition.Token);
+		auto [Begin, End] = Target.GetReferencesIn(File);
+		for (auto* Reference = Begin; Reference != End; Reference++)
 		{
-			RangesArray.push_back(Range);
+			WriteEdit(Lines, Reference->Token);
 		}
+		Out.EndArray();
+		};
+
+	Out.BeginObject();
+	Out.Key("changes");
+	Out.BeginObject();
+	bool DefinitionWritten = false;
+	for (size_t i = 0; i < Target.References.size(); i++)
+	{
+		std::string_view File = Target.References[i].File;
+		if (i > 0 && Target.References[i - 1].File == File)
+			continue;
+		WriteFile(File);
+		DefinitionWritten |= File == Target.Definition.File;
+	}
+	if (!DefinitionWritten)
+		WriteFile(Target.Definition.File);
+	Out.EndObject();
+	Out.EndObject();
+}
+
+void protocol::WriteSelectionRanges(std::string File, const json& Positions, JsonWriter& Out)
+{
+	const workspace::LineIndex* Lines = GetColumnConverter(File);
+	const analysis::FileOutline* Outline = GetOutline(File);
+	Out.BeginArray();
+	for (const json& Position : Positions)
+	{
+		size_t Line = Position.at("line");
+		size_t Character = ToByteColumn(Lines, Line, Position.at("character"));
+		WriteSelectionRangeAt(Outline, Line, Character, Lines, Out);
+	}
+	Out.EndArray();
+}
+
+static void StartIndexing()
+{
+	using namespace protocol;
+
+	std::shared_ptr<WorkDoneProgress> Progress;
+	if (SupportsWorkDoneProgress)
+		Progress = WorkDoneProgress::Create("kui/indexing", "Indexing KlemmUI files");
+
+	workspace::UpdateFilesAsync([Progress](size_t Loaded, size_t Total) {
+		if (Progress)
+			Progress->Report(Loaded, Total);
+		},
+		[Progress]() {
+			if (Progress)
+				Progress->End("Indexed " + std::to_string(workspace::Files.size()) + " files");
+
+			// Requests received during indexing were answered using the files loaded at that point.
+			ScheduleAnalysisOfAllSessions();
+		});
+}
+
+void protocol::OnSessionClosed(uint32_t Session)
+{
+	SemanticTokensRefreshSessions.erase(Session);
+	FileWatcherSessions.erase(Session);
+	// Other sessions never saw the session's documents, so they don't need to be analyzed again.
+	workspace::Overlays.erase(Session);
+	Analyses.erase(Session);
+}
+
+static bool IsDocumentNotification(std::string_view Method)
+{
+	return Method == "textDocument/didChange" || Method == "textDocument/didOpen" || Method == "textDocument/didClose";
+}
+
+static std::string GetDocumentUri(const Message& msg)
+{
+	if (msg.Change)
+		return msg.Change->Uri;
+	return msg.MessageJson.value("/textDocument/uri"_json_pointer, std::string());
+}
+
+void protocol::NotifyMessageRead(const Message& msg)
+{
+	if (!IsDocumentNotification(msg.Method))
+		return;
+	analysis::DocumentGeneration++;
+	std::unique_lock g{ UnhandledDocumentChangesMutex };
+	UnhandledDocumentChanges[{ msg.Session, GetDocumentUri(msg) }]++;
+}
+
+// Called before handling a document notification. Notifications handled without being passed to NotifyMessageRead() are ignored.
+static void OnDocumentNotificationHandled(const Message& msg)
+{
+	using namespace protocol;
+
+	std::unique_lock g{ UnhandledDocumentChangesMutex };
+	auto Found = UnhandledDocumentChanges.find({ msg.Session, GetDocumentUri(msg) });
+	if (Found != UnhandledDocumentChanges.end() && --Found->second == 0)
+		UnhandledDocumentChanges.erase(Found);
+}
+
+// Returns true if the session's client sent notifications changing the document that are still queued.
+static bool HasUnhandledChanges(session::SessionId Session, std::string Uri)
+{
+	using namespace protocol;
+
+	std::unique_lock g{ UnhandledDocumentChangesMutex };
+	return UnhandledDocumentChanges.contains({ Session, std::move(Uri) });
+}
+
+// Returns true if the file changed since the current snapshot was created, so results from the snapshot would be outdated.
+static bool IsSnapshotOutdated(std::string_view File)
+{
+	using namespace protocol;
+
+	workspace::FileData* Document = workspace::FindFile(File);
+	const analysis::Snapshot& Analyzed = GetSnapshot();
+	auto Found = Analyzed.Files.find(File);
+	if (!Document || Found == Analyzed.Files.end())
+		return false;
+	return Document->Content != Found->second;
+}
+
+// Returns true if any file containing the symbol changed since the current snapshot was created.
+static bool IsSymbolOutdated(const analysis::Symbol& Target)
+{
+	if (IsSnapshotOutdated(Target.Definition.File))
+		return true;
+	for (const analysis::SymbolLocation& Reference : Target.References)
+	{
+		if (IsSnapshotOutdated(Reference.File))
+			return true;
 	}
+	return false;
+}
 
-	return RangesArray;
+// Requests with positions or results in a document, answered from the current snapshot.
+static bool IsDocumentQuery(std::string_view Method)
+{
+	return Method == "textDocument/hover"
+		|| Method == "textDocument/completion"
+		|| Method == "textDocument/foldingRange"
+		|| Method == "textDocument/definition"
+		|| Method == "textDocument/references"
+		|| Method == "textDocument/documentHighlight"
+		|| Method == "textDocument/prepareRename"
+		|| Method == "textDocument/rename"
+		|| Method == "textDocument/documentSymbol"
+		|| Method == "textDocument/selectionRange";
+}
+
+// Names of elements, globals, constants and vars. Anything else would change how the markup is parsed.
+static bool IsValidName(std::string_view Name)
+{
+	if (Name.empty() || std::isdigit((unsigned char)Name[0]))
+		return false;
+	for (char c : Name)
+	{
+		if (!std::isalnum((unsigned char)c) && c != '_')
+			return false;
+	}
+	for (std::string_view Keyword : { "element", "child", "var", "global", "const", "true", "false" })
+	{
+		if (Name == Keyword)
+			return false;
+	}
+	return true;
+}
+
+// Returns true if another declaration would be found instead of, or as well as, the symbol under the new name.
+static bool IsNameTaken(const analysis::Snapshot& In, const analysis::Symbol& Target, std::string_view Name)
+{
+	using analysis::Symbol;
+	using namespace kui::MarkupStructure;
+
+	// Built in element types.
+	if (Target.Kind == Symbol::Element && GetStringFromType(GetTypeFromString(std::string(Name))) == Name)
+		return true;
+
+	for (const Symbol& Other : In.Symbols)
+	{
+		if (Other.Name != Name || &Other == &Target)
+			continue;
+		// Elements and values are looked up separately.
+		if ((Target.Kind == Symbol::Element) != (Other.Kind == Symbol::Element))
+			continue;
+		// Vars of different elements don't collide. Globals and constants are found before the vars of any element.
+		if (Target.Kind == Symbol::Var && Other.Kind == Symbol::Var && Other.Owner != Target.Owner)
+			continue;
+		return true;
+	}
+	return false;
+}
+
+scheduler::Priority protocol::GetMessagePriority(const Message& msg)
+{
+	using scheduler::Priority;
+
+	if (msg.IsResponse || !msg.IsRequest)
+		return Priority::Sync;
+	if (msg.Method == "textDocument/diagnostic")
+		return Priority::Publishing;
+	return Priority::Interactive;
 }
 
 void protocol::HandleClientMessage(Message msg)
 {
 	using namespace workspace;
 
+	if (msg.IsResponse)
+	{
+		if (!Message::HandleResponse(msg))
+			std::cerr << "unexpected response to request: " << msg.MessageID << std::endl;
+		return;
+	}
+
 	if (!msg.IsRequest)
 	{
 		HandleClientNotification(msg);
 		return;
 	}
 
+	// Interactive requests run before queued notifications. If the client changed the document before sending the request,
+	// the request is queued again behind the changes, so its positions refer to the same version of the document.
+	if ((IsDocumentQuery(msg.Method) || msg.Method == "textDocument/semanticTokens/full")
+		&& HasUnhandledChanges(msg.Session, msg.MessageJson.value("/textDocument/uri"_json_pointer, std::string())))
+	{
+		scheduler::Post(scheduler::Priority::Sync, [msg]() {
+			session::Scope Session = session::Scope(msg.Session);
+			HandleClientMessage(msg);
+			});
+		return;
+	}
+
+	// The client sent edits the current snapshot doesn't include yet, so its positions wouldn't match the request's.
+	// The analysis of the edits is already queued, the request is answered once it's committed.
+	if (IsDocumentQuery(msg.Method)
+		&& IsSnapshotOutdated(msg.MessageJson.value("/textDocument/uri"_json_pointer, std::string())))
+	{
+		GetAnalysis().DeferredRequests.push_back(std::move(msg));
+		return;
+	}
+
 	if (msg.Method == "initialize")
 	{
 		std::cerr << msg.MessageJson.dump(2) << std::endl;
@@ -746,10 +1679,53 @@ void protocol::HandleClientMessage(Message msg)
 			HasVsCppLocalVariable = std::find(TokenTypes.begin(), TokenTypes.end(), "cppLocalVariable") != TokenTypes.end();
 		}
 
-		if (msg.MessageJson.contains("rootUri"))
+		// Prefer UTF-8 positions, since they don't need to be converted.
+		json::json_pointer PositionEncodings = "/capabilities/general/positionEncodings"_json_pointer;
+		ClientEncoding = PositionEncoding::Utf16;
+		// Sessions of a daemon share the encoding, so the one every client supports is used.
+		if (msg.MessageJson.contains(PositionEncodings) && !session::IsDaemon())
 		{
-			CurrentWorkspacePath = ConvertFilePath(msg.MessageJson["rootUri"]);
-			UpdateFiles();
+			const json& Encodings = msg.MessageJson.at(PositionEncodings);
+			if (std::find(Encodings.begin(), Encodings.end(), "utf-8") != Encodings.end())
+				ClientEncoding = PositionEncoding::Utf8;
+		}
+
+		json::json_pointer WorkDoneProgress = "/capabilities/window/workDoneProgress"_json_pointer;
+		SupportsWorkDoneProgress = msg.MessageJson.contains(WorkDoneProgress) && msg.MessageJson.at(WorkDoneProgress) == true;
+
+		json::json_pointer SemanticTokensRefresh = "/capabilities/workspace/semanticTokens/refreshSupport"_json_pointer;
+		if (msg.MessageJson.contains(SemanticTokensRefresh) && msg.MessageJson.at(SemanticTokensRefresh) == true)
+			SemanticTokensRefreshSessions.insert(msg.Session);
+		else
+			SemanticTokensRefreshSessions.erase(msg.Session);
+
+		json::json_pointer WatchedFilesRegistration = "/capabilities/workspace/didChangeWatchedFiles/dynamicRegistration"_json_pointer;
+		if (msg.MessageJson.contains(WatchedFilesRegistration) && msg.MessageJson.at(WatchedFilesRegistration) == true)
+			FileWatcherSessions.insert(msg.Session);
+		else
+			FileWatcherSessions.erase(msg.Session);
+
+		json::json_pointer PrepareRename = "/capabilities/textDocument/rename/prepareSupport"_json_pointer;
+		SupportsPrepareRename = msg.MessageJson.contains(PrepareRename) && msg.MessageJson.at(PrepareRename) == true;
+
+		bool HasWorkspace = msg.MessageJson.contains("rootUri") && msg.MessageJson.at("rootUri").is_string();
+		bool StartsIndexing = HasWorkspace;
+		if (HasWorkspace)
+		{
+			std::string RootPath = ConvertFilePath(msg.MessageJson["rootUri"]);
+			// A daemon serves a single workspace. Later sessions join the one that is already indexed.
+			if (session::IsDaemon() && !CurrentWorkspacePath.empty())
+			{
+				if (RootPath != CurrentWorkspacePath)
+				{
+					ResponseMessage Response = ResponseMessage(msg, json(), ResponseMessage::ResponseError(LSPErrorCode::RequestFailed,
+						"The daemon serves the workspace " + CurrentWorkspacePath + "."));
+					Response.Send();
+					return;
+				}
+				StartsIndexing = false;
+			}
+			CurrentWorkspacePath = RootPath;
 		}
 
 		// TODO: Read the content of the initialize method instead of just assuming basic capabilities.
@@ -758,7 +1734,8 @@ void protocol::HandleClientMessage(Message msg)
 				{ "hoverProvider", true },
 			{ "textDocumentSync", {
 				{ "openClose", true },
-			{ "change", 1 }
+			// Incremental
+			{ "change", 2 }
 			} },
 			{ "diagnosticProvider", {
 				{ "interFileDiagnostics", true },
@@ -771,25 +1748,37 @@ void protocol::HandleClientMessage(Message msg)
 			}
 				} } },
 			{ "foldingRangeProvider", true },
+			{ "documentSymbolProvider", true },
+			{ "definitionProvider", true },
+			{ "referencesProvider", true },
+			{ "documentHighlightProvider", true },
+			{ "workspaceSymbolProvider", true },
+			// Rename options may only be sent to clients supporting prepareRename.
+			{ "renameProvider", SupportsPrepareRename ? json{ { "prepareProvider", true } } : json(true) },
+			{ "selectionRangeProvider", true },
 			{ "semanticTokensProvider", {
 				{ "full", true },
 			{ "legend", tokens::GetTokenLegends() }
 			} },
-			{ "completionProvider", json::object() }
-			// TODO: Properly handle the position encoding.
-			//	{ "positionEncoding", "utf-8" }
+			{ "completionProvider", json::object() },
+			{ "positionEncoding", ClientEncoding == PositionEncoding::Utf8 ? "utf-8" : "utf-16" }
 			} } });
 
 		std::cerr << Response.MessageJson.dump(2) << std::endl;
 
 		Response.Send();
+
+		// Index the workspace after responding, so large workspaces don't delay the initialization.
+		if (StartsIndexing)
+			StartIndexing();
 	}
 	else if (msg.Method == "textDocument/hover")
 	{
-		std::string Message = GetHoverMessage(
-			msg.MessageJson.at("textDocument").at("uri"),
-			msg.MessageJson.at("position").at("character"),
-			msg.MessageJson.at("position").at("line"));
+		std::string Document = msg.MessageJson.at("textDocument").at("uri");
+		size_t Line = msg.MessageJson.at("position").at("line");
+		size_t Character = ToByteColumn(GetColumnConverter(Document), Line, msg.MessageJson.at("position").at("character"));
+
+		std::string Message = GetHoverMessage(Document, Character, Line);
 		ResponseMessage Response = ResponseMessage(msg, {
 			{ "contents", Message.empty() ? json(json::value_t::null) : json(Message) }
 			});
@@ -799,35 +1788,103 @@ void protocol::HandleClientMessage(Message msg)
 	{
 		std::string Document = msg.MessageJson.at("textDocument").at("uri");
 
-		size_t Character = msg.MessageJson.at("position").at("character");
 		size_t Line = msg.MessageJson.at("position").at("line");
+		size_t Character = ToByteColumn(GetColumnConverter(Document), Line, msg.MessageJson.at("position").at("character"));
 
-		std::optional Token = kui::stringParse::GetTokenAt(LastParseResult.FileLines[Document],
-			Character, Line);
-
-		ResponseMessage Response = ResponseMessage(msg, GetTokenCompletions(Document,
-			kui::stringParse::StringToken("", Character, Character + 1, Line)));
-		Response.Send();
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WriteCompletions(Document, Line, Character, Result);
+			});
 	}
 	else if (msg.Method == "textDocument/foldingRange")
 	{
 		std::string Document = msg.MessageJson.at("textDocument").at("uri");
 
-		json ResponseArray = json::array();
-		for (auto& i : LastParseResult.Elements)
-		{
-			if (!workspace::CompareFiles(ConvertFilePath(Document), ConvertFilePath(i.File)))
-				continue;
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WriteDocumentFoldingRanges(Document, Result);
+			});
+	}
+	else if (msg.Method == "textDocument/definition"
+		|| msg.Method == "textDocument/references"
+		|| msg.Method == "textDocument/documentHighlight")
+	{
+		std::string Document = msg.MessageJson.at("textDocument").at("uri");
+		size_t Line = msg.MessageJson.at("position").at("line");
+		size_t Character = ToByteColumn(GetColumnConverter(Document), Line, msg.MessageJson.at("position").at("character"));
+
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			if (msg.Method == "textDocument/definition")
+				WriteDefinition(Document, Line, Character, Result);
+			else if (msg.Method == "textDocument/references")
+				WriteReferences(Document, Line, Character, msg.MessageJson.value("/context/includeDeclaration"_json_pointer, true), Result);
+			else
+				WriteDocumentHighlights(Document, Line, Character, Result);
+			});
+	}
+	else if (msg.Method == "workspace/symbol")
+	{
+		std::string Query = msg.MessageJson.value("query", "");
 
-			json Array = GetFoldingRanges(i.Root);
+		// The index holds the declarations of the last analyzed session.
+		UpdateSymbolSearch(GetAnalysis().Current);
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WriteWorkspaceSymbols(Query, Result);
+			});
+	}
+	else if (msg.Method == "textDocument/prepareRename")
+	{
+		std::string Document = msg.MessageJson.at("textDocument").at("uri");
+		size_t Line = msg.MessageJson.at("position").at("line");
+		size_t Character = ToByteColumn(GetColumnConverter(Document), Line, msg.MessageJson.at("position").at("character"));
 
-			for (json& Range : Array)
-			{
-				ResponseArray.push_back(Range);
-			}
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WritePrepareRename(Document, Line, Character, Result);
+			});
+	}
+	else if (msg.Method == "textDocument/rename")
+	{
+		using Error = ResponseMessage::ResponseError;
+
+		std::string Document = msg.MessageJson.at("textDocument").at("uri");
+		size_t Line = msg.MessageJson.at("position").at("line");
+		size_t Character = ToByteColumn(GetColumnConverter(Document), Line, msg.MessageJson.at("position").at("character"));
+		std::string NewName = msg.MessageJson.at("newName");
+
+		const analysis::Symbol* Found = GetSnapshot().GetSymbolAt(Document, Line, Character);
+		std::optional<Error> Failed;
+		if (!Found)
+			Failed = Error(LSPErrorCode::RequestFailed, "There is no element, global, constant or var to rename at this position.");
+		else if (!IsValidName(NewName))
+			Failed = Error(LSPErrorCode::InvalidParams, "'" + NewName + "' is not a valid name.");
+		else if (IsNameTaken(GetSnapshot(), *Found, NewName))
+			Failed = Error(LSPErrorCode::InvalidParams, "'" + NewName + "' is already declared.");
+		else if (IsSymbolOutdated(*Found))
+			Failed = Error(LSPErrorCode::ContentModified, "The files are being analyzed.");
+
+		if (Failed)
+		{
+			ResponseMessage Response = ResponseMessage(msg, json(), Failed);
+			Response.Send();
+			return;
 		}
-		ResponseMessage Response = ResponseMessage(msg, ResponseArray);
-		Response.Send();
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WriteRenameEdit(*Found, NewName, Result);
+			});
+	}
+	else if (msg.Method == "textDocument/documentSymbol")
+	{
+		std::string Document = msg.MessageJson.at("textDocument").at("uri");
+
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WriteDocumentSymbols(Document, Result);
+			});
+	}
+	else if (msg.Method == "textDocument/selectionRange")
+	{
+		std::string Document = msg.MessageJson.at("textDocument").at("uri");
+
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			WriteSelectionRanges(Document, msg.MessageJson.at("positions"), Result);
+			});
 	}
 	else if (msg.Method == "textDocument/codeAction")
 	{
@@ -844,32 +1901,73 @@ void protocol::HandleClientMessage(Message msg)
 	else if (msg.Method == "workspace/executeCommand")
 	{
 		preview::Init();
+		PreviewSession = msg.Session;
+		UpdatePreview();
 		ResponseMessage Response = ResponseMessage(msg, {});
 		Response.Send();
 	}
 	else if (msg.Method == "textDocument/semanticTokens/full")
 	{
-		json File = msg.MessageJson.at("/textDocument/uri"_json_pointer);
+		std::string File = msg.MessageJson.at("/textDocument/uri"_json_pointer);
 
-		if (!Files.contains(File.get<std::string>()))
+		FileData* Found = FindFile(File);
+		if (!Found)
 		{
 			ResponseMessage Response = ResponseMessage(msg, json(), ResponseMessage::ResponseError(LSPErrorCode::InvalidParams, "File not found: " + File));
 			Response.Send();
 			return;
 		}
-		ResponseMessage Response = ResponseMessage(msg, { { "data", Files[File].SemanticTokens } });
-		Response.Send();
+		if (IsSnapshotOutdated(File))
+		{
+			GetAnalysis().SemanticTokensOutdated = true;
+			ResponseMessage Response = ResponseMessage(msg, json(), ResponseMessage::ResponseError(LSPErrorCode::ContentModified, "The file is being analyzed."));
+			Response.Send();
+			return;
+		}
+		std::vector<uint32_t> Computed;
+		if (!Found->OpenDocument)
+			Computed = tokens::GetDocumentTokens(File);
+		const std::vector<uint32_t>& Data = Found->OpenDocument ? Found->SemanticTokens : Computed;
+
+		ResponseMessage::SendResult(msg, [&](JsonWriter& Result) {
+			Result.BeginObject();
+			Result.Key("data");
+			Result.BeginArray();
+			for (uint32_t i : Data)
+				Result.UInt(i);
+			Result.EndArray();
+			Result.EndObject();
+			});
 	}
 	else if (msg.Method == "textDocument/diagnostic")
 	{
-		PublishDiagnostics(LastDiagnostics);
+		PublishDiagnostics(GetSnapshot().Diagnostics);
 	}
 	else if (msg.Method == "shutdown")
 	{
 		ResponseMessage Response = ResponseMessage(msg, json());
 		Response.Send();
 		ReceivedShutdownRequest = true;
-		preview::Destroy();
+		// Other sessions of the daemon keep running.
+		if (!session::IsDaemon())
+			preview::Destroy();
+	}
+	else if (msg.Method == "$/kui/stats")
+	{
+		ResponseMessage Response = ResponseMessage(msg, stats::GetStatsJson());
+		Response.Send();
+	}
+	else if (msg.Method == "$/kui/writeTrace")
+	{
+		if (!trace::Write())
+		{
+			ResponseMessage Response = ResponseMessage(msg, json(), ResponseMessage::ResponseError(LSPErrorCode::RequestFailed,
+				trace::IsEnabled() ? "Failed to write trace file." : "Tracing is not enabled. Start the server with --trace=<file>."));
+			Response.Send();
+			return;
+		}
+		ResponseMessage Response = ResponseMessage(msg, { { "file", trace::GetOutputFile() } });
+		Response.Send();
 	}
 	else if (msg.Method.size() && msg.Method[0] != '$')
 	{
@@ -884,15 +1982,49 @@ void protocol::HandleClientMessage(Message msg)
 
 void protocol::HandleClientNotification(Message msg)
 {
+	if (IsDocumentNotification(msg.Method))
+		OnDocumentNotificationHandled(msg);
+
 	if (msg.Method == "exit")
 	{
+		if (session::IsDaemon())
+		{
+			session::Close(msg.Session);
+			return;
+		}
+		trace::Write();
 		if (!ReceivedShutdownRequest)
 			exit(1);
 		exit(0);
 	}
 	else if (msg.Method == "initialized")
 	{
-		return;
+		// Summaries of evicted files are only created again when the client reports a change on disk.
+		if (FileWatcherSessions.contains(msg.Session))
+		{
+			Message("client/registerCapability", {
+				{ "registrations", { {
+					{ "id", "kui-files" },
+					{ "method", "workspace/didChangeWatchedFiles" },
+					{ "registerOptions", { { "watchers", { { { "globPattern", "**/*.kui" } } } } } },
+				} } },
+				}).SendRequest();
+		}
+		// Sessions joining a daemon get their first snapshot of the workspace that is already indexed.
+		if (!workspace::IsIndexing && !workspace::Files.empty())
+			ScheduleAnalysis();
+	}
+	else if (msg.Method == "workspace/didChangeWatchedFiles")
+	{
+		bool FilesChanged = false;
+		for (const json& Change : msg.MessageJson.at("changes"))
+		{
+			if (workspace::OnUriChangedOnDisk(Change.at("uri"), workspace::DiskChange(Change.at("type").get<int>())))
+				FilesChanged = true;
+		}
+		// The files on disk are shared, so every session sees the change.
+		if (FilesChanged)
+			ScheduleAnalysisOfAllSessions();
 	}
 	else if (msg.Method == "textDocument/didOpen")
 	{
@@ -902,18 +2034,22 @@ void protocol::HandleClientNotification(Message msg)
 		std::string Text = TextDocument.at("text");
 
 		OnUriOpened(Uri);
-		UpdateFiles();
+		// While indexing, the indexing thread picks up any new files.
+		if (!IsIndexing)
+			UpdateFiles();
 
-		ScanFile(Text, Uri);
+		ScanFile(std::move(Text), Uri);
 	}
 	else if (msg.Method == "textDocument/didChange")
 	{
-		ScanFile(msg.MessageJson.at("contentChanges").at(0).at("text"), msg.MessageJson.at("textDocument").at("uri"));
+		// Messages read by Message::ReadFrom are already decoded, others only have the json params.
+		DocumentChange Change = msg.Change ? std::move(*msg.Change) : DocumentChange::FromJson(msg.MessageJson);
+		ChangeFile(std::move(Change));
 	}
 	else if (msg.Method == "textDocument/didClose")
 	{
 		workspace::OnUriClosed(msg.MessageJson.at("textDocument").at("uri"));
-		preview::LoadParsed(&LastParseResult);
+		UpdatePreview();
 	}
 	else if (msg.Method == "NotificationReceived")
 	{
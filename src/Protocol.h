@@ -1,13 +1,27 @@
 #pragma once
 #include "Message.h"
+#include "Scheduler.h"
+#include "Cancellation.h"
 #include <vector>
+#include <string_view>
+
+namespace analysis
+{
+	struct Symbol;
+}
+
+namespace workspace
+{
+	class LineIndex;
+}
 
 namespace protocol
 {
 	struct DiagnosticError
 	{
 		std::string Message;
-		std::string File;
+		// Interned file name.
+		std::string_view File;
 		enum ErrorType
 		{
 			Parse,
@@ -19,9 +33,76 @@ namespace protocol
 	};
 
 
+	// The diagnostics reported in one file of the workspace.
+	struct FileDiagnostics
+	{
+		// Key of the file in workspace::Files, or of a document in the session's overlay.
+		std::string_view File;
+		// Converts the file's columns into the client's position encoding, nullptr if they don't need to be converted.
+		const workspace::LineIndex* Lines = nullptr;
+		// Sorted by position.
+		std::vector<const DiagnosticError*> Errors;
+	};
+
+	/**
+	 * Groups the diagnostics by the workspace file they were reported in, for publishing them and for the check mode.
+	 * Files without diagnostics are included with an empty list. If OnlyFile isn't empty, only that file is included.
+	 */
+	std::vector<FileDiagnostics> GroupDiagnostics(const std::vector<DiagnosticError>& Errors, std::string_view OnlyFile = {});
+
 	void Init();
-	void PublishDiagnostics(std::vector<DiagnosticError> Error, Message* RespondTo = nullptr);
-	void ScanFile(const std::string& Content, std::string Uri);
+	void PublishDiagnostics(const std::vector<DiagnosticError>& Error, Message* RespondTo = nullptr, const analysis::CancellationToken& Token = {});
+	void ScanFile(std::string Content, std::string Uri);
+	// Applies the changes of a textDocument/didChange notification and rescans the workspace.
+	void ChangeFile(DocumentChange Change);
+	/**
+	 * Queues an analysis of the current session's documents and the files on disk.
+	 * Requests made before the queued analysis starts are coalesced into it. It's queued again if it's cancelled.
+	 */
+	void ScheduleAnalysis();
+	/**
+	 * Parses and verifies the files the current session sees and queues publishing the results to it.
+	 * Returns false if the analysis was cancelled, the previous results are kept in that case.
+	 */
+	bool UpdateAnalysis(const analysis::CancellationToken& Token = {});
+	// Called by the reader thread for each message before it's queued. Document changes cancel running analyses.
+	void NotifyMessageRead(const Message& msg);
+	// Returns the scheduler priority class a message from the client is handled with.
+	scheduler::Priority GetMessagePriority(const Message& msg);
 	void HandleClientMessage(Message msg);
 	void HandleClientNotification(Message msg);
+	// Drops the documents and the analysis of a daemon session when it disconnected.
+	void OnSessionClosed(uint32_t Session);
+
+	// Returns the diagnostics of the current session's latest analysis.
+	const std::vector<DiagnosticError>& GetDiagnostics();
+
+	// Queries on the latest analysis result. Lines and characters are byte based.
+	std::string GetHoverMessage(std::string File, size_t Char, size_t Line);
+	// Writes the completion items at the given position as an array.
+	void WriteCompletions(std::string File, size_t Line, size_t Character, JsonWriter& Out);
+	// Writes the folding ranges of the file as an array.
+	void WriteDocumentFoldingRanges(std::string File, JsonWriter& Out);
+	// Writes the hierarchical document symbols of the file as an array.
+	void WriteDocumentSymbols(std::string File, JsonWriter& Out);
+	// Writes the location of the definition of the symbol at the given position, or null.
+	void WriteDefinition(std::string File, size_t Line, size_t Character, JsonWriter& Out);
+	// Writes the locations of all references to the symbol at the given position as an array.
+	void WriteReferences(std::string File, size_t Line, size_t Character, bool IncludeDeclaration, JsonWriter& Out);
+	// Writes the definition and references of the symbol at the given position in the same file as an array.
+	void WriteDocumentHighlights(std::string File, size_t Line, size_t Character, JsonWriter& Out);
+	// Writes the best matches for the query among all elements, globals and constants as an array.
+	void WriteWorkspaceSymbols(std::string_view Query, JsonWriter& Out);
+	// Writes the range and name of the symbol at the given position, or null if nothing can be renamed there.
+	void WritePrepareRename(std::string File, size_t Line, size_t Character, JsonWriter& Out);
+	// Writes a WorkspaceEdit replacing the definition and all references of the symbol with NewName.
+	void WriteRenameEdit(const analysis::Symbol& Target, std::string_view NewName, JsonWriter& Out);
+	// Writes a selection range for each of the given LSP positions as an array.
+	void WriteSelectionRanges(std::string File, const json& Positions, JsonWriter& Out);
+}
+
+namespace protocol::tokens
+{
+	// Returns the semantic tokens of the given file, in the encoded textDocument/semanticTokens format.
+	std::vector<uint32_t> GetDocumentTokens(std::string FileName);
 }
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "Record.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+namespace record
+{
+	static std::atomic<bool> Enabled = false;
+	static std::mutex RecordMutex;
+	static std::ofstream Output;
+	static std::chrono::steady_clock::time_point StartTime;
+
+	static void WriteEntry(const char* Direction, const char* Key, const nlohmann::json& Content)
+	{
+		if (!Enabled)
+			return;
+
+		std::unique_lock g{ RecordMutex };
+		double Time = std::chrono::duration<double>(std::chrono::steady_clock::now() - StartTime).count();
+		// Flushed after every line so a recording is usable even if the server crashes.
+		// Raw entries are often messages that weren't valid UTF-8, invalid bytes are written as U+FFFD.
+		Output << nlohmann::json{
+			{ "time", Time },
+			{ "direction", Direction },
+			{ Key, Content },
+		}.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace) << '\n' << std::flush;
+	}
+}
+
+bool record::Start(std::string OutputFile)
+{
+	std::unique_lock g{ RecordMutex };
+	Output.open(OutputFile, std::ios::binary | std::ios::trunc);
+	if (!Output)
+		return false;
+	StartTime = std::chrono::steady_clock::now();
+	Enabled = true;
+	return true;
+}
+
+bool record::IsEnabled()
+{
+	return Enabled;
+}
+
+void record::RecordIncoming(const nlohmann::json& Message)
+{
+	WriteEntry("in", "message", Message);
+}
+
+void record::RecordIncomingRaw(const std::string& Content)
+{
+	WriteEntry("in", "raw", Content);
+}
+
+void record::RecordOutgoing(const nlohmann::json& Message)
+{
+	WriteEntry("out", "message", Message);
+}
+
+void record::RecordOutgoingRaw(const std::string& Content)
+{
+	WriteEntry("out", "raw", Content);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <nlohmann/json.hpp>
+#include <string>
+
+/**
+ * Session recording.
+ *
+ * Every message exchanged with the client is appended to the recording file as one JSON object per line:
+ * { "time": <seconds since the recording started>, "direction": "in" | "out", "message": <message> }
+ *
+ * Recordings can be replayed against the server with the KlemmUIReplay tool.
+ */
+namespace record
+{
+	// Starts recording to the given file. Returns false if the file can't be opened.
+	bool Start(std::string OutputFile);
+	bool IsEnabled();
+
+	void RecordIncoming(const nlohmann::json& Message);
+	// For messages that couldn't be parsed as json.
+	void RecordIncomingRaw(const std::string& Content);
+	void RecordOutgoing(const nlohmann::json& Message);
+	// For streamed messages that couldn't be parsed again. Replays don't compare them.
+	void RecordOutgoingRaw(const std::string& Content);
+}
@@ -0,0 +1,103 @@
+#include "Scheduler.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace scheduler
+{
+	static std::mutex QueueMutex;
+	static std::condition_variable QueueChanged;
+
+	static std::deque<std::function<void()>> Interactive;
+	static std::deque<std::function<void()>> Sync;
+	static std::deque<std::function<void()>> Publishing;
+	static std::deque<std::function<void()>> Background;
+
+	// Returns the next task by priority, or nothing if all queues are empty. Only foreground tasks are returned if OnlyForeground is true.
+	static std::optional<std::function<void()>> PopTask(bool OnlyForeground = false)
+	{
+		for (auto* Queue : { &Interactive, &Sync, &Publishing, &Background })
+		{
+			if (OnlyForeground && Queue == &Publishing)
+				break;
+			if (Queue->empty())
+				continue;
+			std::function<void()> Task = std::move(Queue->front());
+			Queue->pop_front();
+			return Task;
+		}
+		return std::nullopt;
+	}
+}
+
+void scheduler::Post(Priority Class, std::function<void()> Task)
+{
+	{
+		std::unique_lock g{ QueueMutex };
+		switch (Class)
+		{
+		case Priority::Interactive:
+			Interactive.push_back(std::move(Task));
+			break;
+		case Priority::Sync:
+			Sync.push_back(std::move(Task));
+			break;
+		case Priority::Publishing:
+			Publishing.push_back(std::move(Task));
+			break;
+		case Priority::Background:
+			Background.push_back(std::move(Task));
+			break;
+		}
+	}
+	QueueChanged.notify_one();
+}
+
+void scheduler::Run()
+{
+	while (true)
+	{
+		std::function<void()> Task;
+		{
+			std::unique_lock g{ QueueMutex };
+			QueueChanged.wait(g, []() {
+				return !Interactive.empty() || !Sync.empty() || !Publishing.empty() || !Background.empty();
+				});
+			Task = *PopTask();
+		}
+		Task();
+	}
+}
+
+void scheduler::RunPending()
+{
+	while (true)
+	{
+		std::optional<std::function<void()>> Task;
+		{
+			std::unique_lock g{ QueueMutex };
+			Task = PopTask();
+		}
+		if (!Task)
+			return;
+		(*Task)();
+	}
+}
+
+bool scheduler::RunForeground()
+{
+	bool RanTask = false;
+	while (true)
+	{
+		std::optional<std::function<void()>> Task;
+		{
+			std::unique_lock g{ QueueMutex };
+			Task = PopTask(true);
+		}
+		if (!Task)
+			return RanTask;
+		(*Task)();
+		RanTask = true;
+	}
+}
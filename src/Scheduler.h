@@ -0,0 +1,43 @@
+#pragma once
+#include <functional>
+
+/**
+ * Runs the server's work on a single thread, ordered by priority.
+ *
+ * Each priority has its own queue, tasks of the same priority run in the order they were posted.
+ * Interactive requests run before queued document synchronization, so they don't wait for every queued edit.
+ * Requests on a document with edits that are still queued are handled again after them, see protocol::HandleClientMessage().
+ * Interactive and sync tasks are foreground work, which always runs before queued publishing and background work.
+ * Long background tasks call RunForeground() between their stages, so requests arriving while they run don't have to wait for them to finish.
+ *
+ * Tasks may only access the workspace and the analysis results from the scheduler thread.
+ */
+namespace scheduler
+{
+	enum class Priority
+	{
+		// Requests the user is waiting on, like hover or completion.
+		Interactive,
+		// Document changes and other notifications that change the server's state.
+		Sync,
+		// Sending results to the client, like diagnostics.
+		Publishing,
+		// Analysis and indexing.
+		Background,
+	};
+
+	// Queues a task. Can be called from any thread.
+	void Post(Priority Class, std::function<void()> Task);
+
+	// Runs tasks on the calling thread, waiting for new ones if the queue is empty. Never returns.
+	void Run();
+
+	// Runs queued tasks on the calling thread until the queue is empty.
+	void RunPending();
+
+	/**
+	 * Runs the queued interactive and sync tasks on the calling thread, interactive tasks first.
+	 * Called by background tasks at points where they can be interrupted. Returns true if any task was run.
+	 */
+	bool RunForeground();
+}
@@ -0,0 +1,456 @@
+#include "Session.h"
+#include "Scheduler.h"
+#include "Trace.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <WinSock2.h>
+#include <afunix.h>
+#include <fcntl.h>
+#include <io.h>
+using SocketHandle = SOCKET;
+constexpr SocketHandle INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+#else
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using SocketHandle = int;
+constexpr SocketHandle INVALID_SOCKET_HANDLE = -1;
+#endif
+
+#ifdef MSG_NOSIGNAL
+// Writing to a connection the client closed returns an error instead of raising SIGPIPE.
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+namespace session
+{
+	// Bytes queued for a session that stopped reading its messages. The session is closed once they exceed this.
+	constexpr size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+	/**
+	 * A connection of the daemon.
+	 *
+	 * Messages are queued and sent by the connection's own writer thread,
+	 * so a client that stops reading doesn't block the scheduler or the other sessions.
+	 */
+	struct Connection
+	{
+		SocketHandle Socket = INVALID_SOCKET_HANDLE;
+		std::thread Writer;
+
+		std::mutex QueueMutex;
+		std::condition_variable QueueChanged;
+		std::deque<std::string> Queue;
+		size_t QueuedBytes = 0;
+		// The connection is closed once the queued messages are sent.
+		bool Closing = false;
+		// The connection is closed, queued messages are dropped.
+		bool Closed = false;
+	};
+
+	static std::atomic<bool> DaemonRunning = false;
+	static thread_local SessionId CurrentSession = STDIO;
+
+	// Open connections of the daemon. Only accessed while holding SessionsMutex.
+	static std::map<SessionId, std::shared_ptr<Connection>> Sessions;
+	static std::mutex SessionsMutex;
+
+	static bool InitSockets()
+	{
+#ifdef _WIN32
+		static bool Initialized = false;
+		if (!Initialized)
+		{
+			WSADATA Data;
+			Initialized = WSAStartup(MAKEWORD(2, 2), &Data) == 0;
+		}
+		return Initialized;
+#else
+		return true;
+#endif
+	}
+
+	static void CloseSocket(SocketHandle Socket)
+	{
+#ifdef _WIN32
+		closesocket(Socket);
+#else
+		close(Socket);
+#endif
+	}
+
+	// Stops both directions of the connection, which wakes up a thread blocked reading from it.
+	static void ShutdownSocket(SocketHandle Socket)
+	{
+#ifdef _WIN32
+		shutdown(Socket, SD_BOTH);
+#else
+		shutdown(Socket, SHUT_RDWR);
+#endif
+	}
+
+	// Tells the other side that nothing more will be sent. Receiving still works.
+	static void ShutdownSending(SocketHandle Socket)
+	{
+#ifdef _WIN32
+		shutdown(Socket, SD_SEND);
+#else
+		shutdown(Socket, SHUT_WR);
+#endif
+	}
+
+	static void IgnoreBrokenPipes()
+	{
+#ifndef _WIN32
+		// For platforms without MSG_NOSIGNAL. A client disconnecting must not end the process.
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	}
+
+	static bool GetAddress(const std::string& SocketPath, sockaddr_un& Out)
+	{
+		Out = {};
+		Out.sun_family = AF_UNIX;
+		if (SocketPath.size() >= sizeof(Out.sun_path))
+		{
+			std::cerr << "socket path is too long: " << SocketPath << std::endl;
+			return false;
+		}
+		SocketPath.copy(Out.sun_path, SocketPath.size());
+		return true;
+	}
+
+	static SocketHandle ConnectSocket(const std::string& SocketPath)
+	{
+		sockaddr_un Address;
+		if (!InitSockets() || !GetAddress(SocketPath, Address))
+			return INVALID_SOCKET_HANDLE;
+
+		SocketHandle Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (Socket == INVALID_SOCKET_HANDLE)
+			return INVALID_SOCKET_HANDLE;
+		if (connect(Socket, (sockaddr*)&Address, sizeof(Address)) != 0)
+		{
+			CloseSocket(Socket);
+			return INVALID_SOCKET_HANDLE;
+		}
+		return Socket;
+	}
+
+	static bool SendAll(SocketHandle Socket, std::string_view Data)
+	{
+		while (!Data.empty())
+		{
+			auto Sent = send(Socket, Data.data(), int(Data.size()), SEND_FLAGS);
+			if (Sent <= 0)
+				return false;
+			Data.remove_prefix(size_t(Sent));
+		}
+		return true;
+	}
+
+	// Reads a session's messages with the same code as stdio.
+	class SocketBuffer : public std::streambuf
+	{
+	public:
+		SocketBuffer(SocketHandle Socket)
+			: Socket(Socket)
+		{
+		}
+
+	protected:
+		int_type underflow() override
+		{
+			auto Received = recv(Socket, Buffer, sizeof(Buffer), 0);
+			if (Received <= 0)
+				return traits_type::eof();
+			setg(Buffer, Buffer, Buffer + Received);
+			return traits_type::to_int_type(Buffer[0]);
+		}
+
+	private:
+		SocketHandle Socket;
+		char Buffer[4096];
+	};
+
+	// Drops the queued messages and wakes up the session's reader and writer threads. QueueMutex must be held.
+	static void CloseConnection(Connection& Session)
+	{
+		if (Session.Closed)
+			return;
+		Session.Closed = true;
+		Session.Queue.clear();
+		Session.QueuedBytes = 0;
+		Session.QueueChanged.notify_all();
+		ShutdownSocket(Session.Socket);
+	}
+
+	static void Enqueue(SessionId Id, Connection& Session, std::string_view Data)
+	{
+		std::unique_lock g{ Session.QueueMutex };
+		if (Session.Closed || Session.Closing)
+			return;
+		if (Session.QueuedBytes + Data.size() > MAX_QUEUED_BYTES)
+		{
+			std::cerr << "session " << Id << " stopped reading messages, closing it" << std::endl;
+			CloseConnection(Session);
+			return;
+		}
+		Session.Queue.push_back(std::string(Data));
+		Session.QueuedBytes += Data.size();
+		Session.QueueChanged.notify_one();
+	}
+
+	static void WriteSession(std::shared_ptr<Connection> Session)
+	{
+		trace::SetThreadName("session writer");
+
+		std::unique_lock g{ Session->QueueMutex };
+		while (true)
+		{
+			Session->QueueChanged.wait(g, [&Session]() {
+				return Session->Closed || Session->Closing || !Session->Queue.empty();
+				});
+			if (Session->Closed)
+				return;
+			if (Session->Queue.empty())
+			{
+				// Closing and everything was sent.
+				CloseConnection(*Session);
+				return;
+			}
+
+			std::string Data = std::move(Session->Queue.front());
+			Session->Queue.pop_front();
+			Session->QueuedBytes -= Data.size();
+
+			g.unlock();
+			bool Sent = SendAll(Session->Socket, Data);
+			g.lock();
+			if (!Sent)
+			{
+				CloseConnection(*Session);
+				return;
+			}
+		}
+	}
+
+	// Output of Message::Send() in daemon mode. Only queues the message, so it never blocks on a client.
+	static void WriteToSessions(std::string_view Data)
+	{
+		std::unique_lock g{ SessionsMutex };
+		if (CurrentSession != STDIO)
+		{
+			auto Found = Sessions.find(CurrentSession);
+			if (Found != Sessions.end())
+				Enqueue(Found->first, *Found->second, Data);
+			return;
+		}
+		for (auto& [Id, Session] : Sessions)
+		{
+			Enqueue(Id, *Session, Data);
+		}
+	}
+
+	static void ReadSession(SessionId Id, std::shared_ptr<Connection> Session, std::function<void(Message)> OnMessage, std::function<void(SessionId)> OnClosed)
+	{
+		trace::SetThreadName("session");
+
+		SocketBuffer Buffer = SocketBuffer(Session->Socket);
+		std::istream In = std::istream(&Buffer);
+		while (true)
+		{
+			std::optional<Message> Read = Message::ReadFrom(In);
+			if (!Read)
+				break;
+			Read->Session = Id;
+			OnMessage(std::move(*Read));
+		}
+
+		// Messages the client sent before ending the session are still handled and answered.
+		scheduler::Post(scheduler::Priority::Sync, [OnClosed, Id]() {
+			OnClosed(Id);
+			Close(Id);
+			});
+		Session->Writer.join();
+
+		{
+			std::unique_lock g{ SessionsMutex };
+			Sessions.erase(Id);
+		}
+		CloseSocket(Session->Socket);
+	}
+
+	// Sends fail instead of blocking forever if the client stops reading.
+	static void SetSendTimeout(SocketHandle Socket)
+	{
+#ifdef _WIN32
+		DWORD Timeout = 30 * 1000;
+#else
+		timeval Timeout{};
+		Timeout.tv_sec = 30;
+#endif
+		setsockopt(Socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&Timeout, sizeof(Timeout));
+	}
+}
+
+bool session::StartDaemon(std::string SocketPath, std::function<void(Message)> OnMessage, std::function<void(SessionId)> OnClosed)
+{
+	// A socket file without a listening daemon was left behind by a daemon that didn't exit cleanly.
+	SocketHandle Existing = ConnectSocket(SocketPath);
+	if (Existing != INVALID_SOCKET_HANDLE)
+	{
+		CloseSocket(Existing);
+		std::cerr << "a daemon is already listening on " << SocketPath << std::endl;
+		return false;
+	}
+	std::error_code Error;
+	std::filesystem::remove(SocketPath, Error);
+
+	sockaddr_un Address;
+	if (!InitSockets() || !GetAddress(SocketPath, Address))
+		return false;
+
+	SocketHandle Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (Listener == INVALID_SOCKET_HANDLE
+		|| bind(Listener, (sockaddr*)&Address, sizeof(Address)) != 0
+		|| listen(Listener, SOMAXCONN) != 0)
+	{
+		std::cerr << "failed to listen on " << SocketPath << std::endl;
+		if (Listener != INVALID_SOCKET_HANDLE)
+			CloseSocket(Listener);
+		return false;
+	}
+
+	IgnoreBrokenPipes();
+	DaemonRunning = true;
+	Message::SetOutput(WriteToSessions);
+
+	std::thread([Listener, OnMessage, OnClosed]() {
+		trace::SetThreadName("daemon");
+		SessionId NextId = STDIO + 1;
+		bool Failing = false;
+		while (true)
+		{
+			SocketHandle Client = accept(Listener, nullptr, nullptr);
+			if (Client == INVALID_SOCKET_HANDLE)
+			{
+				// Errors like running out of file descriptors persist until sessions are closed.
+				if (!Failing)
+					std::cerr << "failed to accept a session, retrying" << std::endl;
+				Failing = true;
+				std::this_thread::sleep_for(std::chrono::milliseconds(250));
+				continue;
+			}
+			Failing = false;
+
+			SessionId Id = NextId++;
+			SetSendTimeout(Client);
+			auto Session = std::make_shared<Connection>();
+			Session->Socket = Client;
+			Session->Writer = std::thread(WriteSession, Session);
+			{
+				std::unique_lock g{ SessionsMutex };
+				Sessions.insert({ Id, Session });
+			}
+			std::thread(ReadSession, Id, Session, OnMessage, OnClosed).detach();
+		}
+		}).detach();
+	return true;
+}
+
+bool session::IsDaemon()
+{
+	return DaemonRunning;
+}
+
+bool session::Connect(std::string SocketPath)
+{
+	SocketHandle Socket = ConnectSocket(SocketPath);
+	if (Socket == INVALID_SOCKET_HANDLE)
+		return false;
+
+#ifdef _WIN32
+	int _ = _setmode(_fileno(stdin), O_BINARY);
+	_ = _setmode(_fileno(stdout), O_BINARY);
+#endif
+	IgnoreBrokenPipes();
+
+	// The client's messages are forwarded as they are, the daemon takes care of framing them.
+	std::thread([Socket]() {
+		char Buffer[4096];
+		while (true)
+		{
+#ifdef _WIN32
+			int Read = _read(0, Buffer, sizeof(Buffer));
+#else
+			auto Read = read(0, Buffer, sizeof(Buffer));
+#endif
+			if (Read <= 0)
+				break;
+			if (!SendAll(Socket, std::string_view(Buffer, size_t(Read))))
+				break;
+		}
+		// The daemon ends the session once it sent its remaining messages, which ends the loop below.
+		ShutdownSending(Socket);
+		}).detach();
+
+	char Buffer[4096];
+	while (true)
+	{
+		auto Received = recv(Socket, Buffer, sizeof(Buffer), 0);
+		if (Received <= 0)
+			break;
+		fwrite(Buffer, 1, size_t(Received), stdout);
+		fflush(stdout);
+	}
+	CloseSocket(Socket);
+	return true;
+}
+
+void session::Close(SessionId Id)
+{
+	std::unique_lock g{ SessionsMutex };
+	auto Found = Sessions.find(Id);
+	if (Found == Sessions.end())
+		return;
+
+	// The writer closes the connection once the queued messages are sent.
+	// The session's reader thread then removes it.
+	Connection& Session = *Found->second;
+	std::unique_lock q{ Session.QueueMutex };
+	Session.Closing = true;
+	Session.QueueChanged.notify_one();
+}
+
+session::SessionId session::GetCurrent()
+{
+	return CurrentSession;
+}
+
+session::Scope::Scope(SessionId Id)
+{
+	Previous = CurrentSession;
+	CurrentSession = Id;
+}
+
+session::Scope::~Scope()
+{
+	CurrentSession = Previous;
+}
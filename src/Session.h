@@ -0,0 +1,53 @@
+#pragma once
+#include "Message.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/**
+ * Daemon mode: one server process shared by several clients.
+ *
+ * The daemon listens on a Unix domain socket. Every connection is an LSP session. Messages from all sessions are
+ * handled by the same scheduler, so the sessions share the files on disk.
+ * Each session's opened documents are layered over them and analyzed in a snapshot of its own.
+ * Responses are sent to the session the request came from, all other messages are sent to every session.
+ *
+ * Editors start the server with --connect=<socket>, which forwards stdio to the daemon.
+ */
+namespace session
+{
+	using SessionId = uint32_t;
+	// The client connected over stdio. Daemon sessions start at 1.
+	constexpr SessionId STDIO = 0;
+
+	/**
+	 * Starts accepting sessions on the socket. Returns false if the socket can't be opened or a daemon is already listening on it.
+	 * OnMessage is called on the session's reader thread with each message. OnClosed is queued on the scheduler once a session has ended.
+	 */
+	bool StartDaemon(std::string SocketPath, std::function<void(Message)> OnMessage, std::function<void(SessionId)> OnClosed);
+	bool IsDaemon();
+
+	/**
+	 * Forwards stdin and stdout to the daemon listening on the socket until the daemon closes the connection.
+	 * Returns false if no daemon is listening on the socket.
+	 */
+	bool Connect(std::string SocketPath);
+
+	// Ends the session once the messages queued for it are sent.
+	void Close(SessionId Id);
+
+	// The session messages sent by the current thread are routed to. STDIO sends them to all sessions.
+	SessionId GetCurrent();
+
+	// Sets the current session of this thread, the previous one is restored when the scope is destroyed.
+	class Scope
+	{
+	public:
+		Scope(SessionId Id);
+		~Scope();
+		Scope(const Scope&) = delete;
+
+	private:
+		SessionId Previous = STDIO;
+	};
+}
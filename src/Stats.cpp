@@ -0,0 +1,238 @@
+#include "Stats.h"
+#include "Util/StrUtil.h"
+#include <algorithm>
+#include <bit>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <iostream>
+
+namespace stats
+{
+	struct MessageStats
+	{
+		Histogram Duration;
+		Histogram QueueWait;
+		allocations::Counters Allocations;
+	};
+
+	struct PhaseStats
+	{
+		Histogram Duration;
+		allocations::Counters Allocations;
+	};
+
+	static std::mutex StatsMutex;
+	static std::map<std::string, MessageStats, std::less<>> Messages;
+	static std::map<std::string, PhaseStats, std::less<>> Phases;
+	static std::map<std::string, uint64_t, std::less<>> MemoryUsage;
+	static Clock::time_point StartTime = Clock::now();
+
+	static uint64_t ToMicroseconds(Clock::duration Duration)
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Duration).count());
+	}
+
+	static double ToMilliseconds(uint64_t Microseconds)
+	{
+		return double(Microseconds) / 1000.0;
+	}
+
+	static nlohmann::json GetAllocationsJson(const allocations::Counters& From, uint64_t Calls)
+	{
+		return {
+			{ "count", From.Count },
+			{ "bytes", From.Bytes },
+			{ "countPerCall", Calls ? double(From.Count) / double(Calls) : 0.0 },
+			{ "bytesPerCall", Calls ? double(From.Bytes) / double(Calls) : 0.0 },
+		};
+	}
+}
+
+size_t stats::Histogram::GetBucket(uint64_t Value)
+{
+	constexpr uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	if (Value < SUB_BUCKETS)
+		return size_t(Value);
+
+	int HighestBit = std::bit_width(Value) - 1;
+	uint64_t SubBucket = (Value >> (HighestBit - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return size_t((HighestBit - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + SubBucket);
+}
+
+uint64_t stats::Histogram::GetBucketUpperBound(size_t Bucket)
+{
+	constexpr uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	if (Bucket < SUB_BUCKETS)
+		return Bucket;
+
+	int HighestBit = int(Bucket / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+	uint64_t SubBucket = Bucket % SUB_BUCKETS;
+	uint64_t Lower = (uint64_t(1) << HighestBit) | (SubBucket << (HighestBit - SUB_BUCKET_BITS));
+	return Lower + (uint64_t(1) << (HighestBit - SUB_BUCKET_BITS)) - 1;
+}
+
+void stats::Histogram::Add(uint64_t Microseconds)
+{
+	Buckets[GetBucket(Microseconds)]++;
+	Count++;
+	Sum += Microseconds;
+	Max = std::max(Max, Microseconds);
+}
+
+uint64_t stats::Histogram::GetPercentile(double Percentile) const
+{
+	if (Count == 0)
+		return 0;
+
+	uint64_t Target = uint64_t(double(Count) * Percentile / 100.0 + 0.5);
+	Target = std::clamp<uint64_t>(Target, 1, Count);
+
+	uint64_t Seen = 0;
+	for (size_t i = 0; i < Buckets.size(); i++)
+	{
+		Seen += Buckets[i];
+		if (Seen >= Target)
+			return std::min(GetBucketUpperBound(i), Max);
+	}
+	return Max;
+}
+
+nlohmann::json stats::Histogram::ToJson() const
+{
+	return {
+		{ "count", Count },
+		{ "meanMs", Count ? ToMilliseconds(Sum) / double(Count) : 0.0 },
+		{ "p50Ms", ToMilliseconds(GetPercentile(50)) },
+		{ "p95Ms", ToMilliseconds(GetPercentile(95)) },
+		{ "p99Ms", ToMilliseconds(GetPercentile(99)) },
+		{ "maxMs", ToMilliseconds(Max) },
+	};
+}
+
+void stats::RecordMessage(const std::string& Method, Clock::duration QueueWait, Clock::duration Duration, allocations::Counters Allocated)
+{
+	std::unique_lock g{ StatsMutex };
+	MessageStats& Stats = Messages[Method];
+	Stats.QueueWait.Add(ToMicroseconds(QueueWait));
+	Stats.Duration.Add(ToMicroseconds(Duration));
+	Stats.Allocations += Allocated;
+}
+
+void stats::RecordPhase(const char* Phase, Clock::duration Duration, allocations::Counters Allocated)
+{
+	std::unique_lock g{ StatsMutex };
+	auto Found = Phases.find(std::string_view(Phase));
+	if (Found == Phases.end())
+		Found = Phases.insert({ Phase, PhaseStats() }).first;
+	Found->second.Duration.Add(ToMicroseconds(Duration));
+	Found->second.Allocations += Allocated;
+}
+
+void stats::SetMemoryUsage(const std::string& Component, uint64_t Bytes)
+{
+	std::unique_lock g{ StatsMutex };
+	MemoryUsage[Component] = Bytes;
+}
+
+stats::Phase::Phase(const char* Name)
+	: Span(Name)
+{
+	this->Name = Name;
+	Start = Clock::now();
+	StartAllocations = allocations::GetThreadCounters();
+}
+
+stats::Phase::~Phase()
+{
+	RecordPhase(Name, Clock::now() - Start, allocations::GetThreadCounters() - StartAllocations);
+}
+
+nlohmann::json stats::GetStatsJson()
+{
+	std::unique_lock g{ StatsMutex };
+
+	nlohmann::json MessagesJson = nlohmann::json::object();
+	for (auto& [Method, Stats] : Messages)
+	{
+		nlohmann::json MethodJson = Stats.Duration.ToJson();
+		MethodJson["queueWait"] = Stats.QueueWait.ToJson();
+		if (allocations::Enabled)
+			MethodJson["allocations"] = GetAllocationsJson(Stats.Allocations, Stats.Duration.Count);
+		MessagesJson[Method] = MethodJson;
+	}
+
+	nlohmann::json PhasesJson = nlohmann::json::object();
+	for (auto& [Name, Stats] : Phases)
+	{
+		nlohmann::json PhaseJson = Stats.Duration.ToJson();
+		if (allocations::Enabled)
+			PhaseJson["allocations"] = GetAllocationsJson(Stats.Allocations, Stats.Duration.Count);
+		PhasesJson[Name] = PhaseJson;
+	}
+
+	nlohmann::json MemoryJson = nlohmann::json::object();
+	uint64_t TotalMemory = 0;
+	for (auto& [Component, Bytes] : MemoryUsage)
+	{
+		MemoryJson[Component] = Bytes;
+		TotalMemory += Bytes;
+	}
+	MemoryJson["total"] = TotalMemory;
+
+	return {
+		{ "uptimeSeconds", std::chrono::duration<double>(Clock::now() - StartTime).count() },
+		{ "messages", MessagesJson },
+		{ "phases", PhasesJson },
+		{ "memoryBytes", MemoryJson },
+	};
+}
+
+std::string stats::GetStatsText()
+{
+	std::unique_lock g{ StatsMutex };
+
+	auto FormatLine = [](const std::string& Name, const Histogram& From, const allocations::Counters* Allocated) {
+		std::string Line = StrUtil::Format("%-40s %8i %10.2f %10.2f %10.2f %10.2f",
+			Name.c_str(),
+			int(From.Count),
+			ToMilliseconds(From.GetPercentile(50)),
+			ToMilliseconds(From.GetPercentile(95)),
+			ToMilliseconds(From.GetPercentile(99)),
+			ToMilliseconds(From.Max));
+		if (allocations::Enabled && Allocated && From.Count)
+			Line.append(StrUtil::Format(" %12.1f", double(Allocated->Count) / double(From.Count)));
+		return Line + "\n";
+		};
+
+	std::string Out = StrUtil::Format("%-40s %8s %10s %10s %10s %10s", "message / phase", "count", "p50 ms", "p95 ms", "p99 ms", "max ms");
+	if (allocations::Enabled)
+		Out.append(StrUtil::Format(" %12s", "allocs/call"));
+	Out.append("\n");
+	for (auto& [Method, Stats] : Messages)
+	{
+		Out.append(FormatLine(Method, Stats.Duration, &Stats.Allocations));
+		Out.append(FormatLine("  (queue wait)", Stats.QueueWait, nullptr));
+	}
+	for (auto& [Name, Stats] : Phases)
+	{
+		Out.append(FormatLine("phase: " + Name, Stats.Duration, &Stats.Allocations));
+	}
+	for (auto& [Component, Bytes] : MemoryUsage)
+	{
+		Out.append(StrUtil::Format("%-40s %10.1f KiB\n", ("memory: " + Component).c_str(), double(Bytes) / 1024.0));
+	}
+	return Out;
+}
+
+void stats::StartPeriodicDump(float IntervalSeconds)
+{
+	auto DumpThread = std::thread([IntervalSeconds]() {
+		while (true)
+		{
+			std::this_thread::sleep_for(std::chrono::duration<float>(IntervalSeconds));
+			std::cerr << GetStatsText() << std::flush;
+		}
+		});
+	DumpThread.detach();
+}
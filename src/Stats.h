@@ -0,0 +1,77 @@
+#pragma once
+#include "Trace.h"
+#include "Allocations.h"
+#include <nlohmann/json.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Request and analysis timing statistics.
+ *
+ * Timings are recorded into log-linear histograms, so recording is cheap and percentiles
+ * can be reported without storing every sample.
+ */
+namespace stats
+{
+	using Clock = std::chrono::steady_clock;
+
+	class Histogram
+	{
+	public:
+		void Add(uint64_t Microseconds);
+		// Returns an upper bound for the given percentile (0 - 100) of all added values, in microseconds.
+		uint64_t GetPercentile(double Percentile) const;
+
+		nlohmann::json ToJson() const;
+
+		uint64_t Count = 0;
+		uint64_t Sum = 0;
+		uint64_t Max = 0;
+
+	private:
+		// Each power of two is split into 2^SUB_BUCKET_BITS buckets.
+		static constexpr int SUB_BUCKET_BITS = 3;
+		static size_t GetBucket(uint64_t Value);
+		static uint64_t GetBucketUpperBound(size_t Bucket);
+
+		std::array<uint32_t, 64 << SUB_BUCKET_BITS> Buckets = {};
+	};
+
+	/**
+	 * Records the time spent handling a message from the client.
+	 * QueueWait is the time between reading the message and starting to handle it.
+	 * Allocated is the number of heap allocations made while handling it, if allocations are counted.
+	 */
+	void RecordMessage(const std::string& Method, Clock::duration QueueWait, Clock::duration Duration, allocations::Counters Allocated = {});
+	void RecordPhase(const char* Phase, Clock::duration Duration, allocations::Counters Allocated = {});
+
+	/**
+	 * Sets the number of bytes currently used by a component, for example "documents.content".
+	 * Components are updated by their owners whenever they change.
+	 */
+	void SetMemoryUsage(const std::string& Component, uint64_t Bytes);
+
+	// Measures the time until the end of the scope as one analysis phase. The phase is also recorded as a trace span.
+	class Phase
+	{
+	public:
+		Phase(const char* Name);
+		~Phase();
+
+		Phase(const Phase&) = delete;
+
+	private:
+		const char* Name;
+		Clock::time_point Start;
+		allocations::Counters StartAllocations;
+		trace::Span Span;
+	};
+
+	nlohmann::json GetStatsJson();
+	std::string GetStatsText();
+
+	// Starts a thread that writes the statistics to stderr in the given interval.
+	void StartPeriodicDump(float IntervalSeconds);
+}
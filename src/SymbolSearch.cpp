@@ -0,0 +1,311 @@
+#include "SymbolSearch.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cctype>
+#include <unordered_map>
+
+using analysis::Symbol;
+using analysis::SymbolLocation;
+
+namespace search
+{
+	struct Entry
+	{
+		Symbol::SymbolKind Kind = Symbol::Element;
+		std::string_view Name;
+		SymbolLocation Location;
+		// Removed entries stay in the postings until the index is compacted.
+		bool Removed = false;
+	};
+
+	struct FileEntries
+	{
+		// Detects whether the declarations of the file changed since it was indexed.
+		size_t Fingerprint = 0;
+		std::vector<uint32_t> Entries;
+	};
+
+	static std::vector<Entry> Entries;
+	static std::vector<uint32_t> FreeEntries;
+	static size_t RemovedInPostings = 0;
+	// Key: Interned name of the file.
+	static std::unordered_map<std::string_view, FileEntries> Files;
+	// Key: A lowercase trigram, see GetTrigrams(). Value: Indices into Entries, in insertion order.
+	static std::unordered_map<uint32_t, std::vector<uint32_t>> Postings;
+
+	static char Lower(char c)
+	{
+		return char(std::tolower((unsigned char)c));
+	}
+
+	static uint32_t AddToTrigram(uint32_t Trigram, char c)
+	{
+		return ((Trigram << 8) | uint8_t(Lower(c))) & 0xffffff;
+	}
+
+	/**
+	 * Returns the sorted lowercase trigrams of the text.
+	 * The text is padded with two zero bytes at its start, so the first two trigrams only match the start of a name.
+	 * This lets one and two character queries use the index too.
+	 */
+	static std::vector<uint32_t> GetTrigrams(std::string_view Text)
+	{
+		std::vector<uint32_t> Out;
+		uint32_t Trigram = 0;
+		for (char c : Text)
+		{
+			Trigram = AddToTrigram(Trigram, c);
+			Out.push_back(Trigram);
+		}
+		std::sort(Out.begin(), Out.end());
+		Out.erase(std::unique(Out.begin(), Out.end()), Out.end());
+		return Out;
+	}
+
+	static size_t GetFingerprint(const std::vector<const Symbol*>& Declarations)
+	{
+		size_t Hash = Declarations.size();
+		auto Combine = [&Hash](size_t Value) {
+			Hash ^= Value + 0x9e3779b97f4a7c15 + (Hash << 6) + (Hash >> 2);
+			};
+		for (const Symbol* i : Declarations)
+		{
+			// Names are interned, so equal names have equal pointers.
+			Combine(std::hash<const void*>()(i->Name.data()));
+			Combine(i->Kind);
+			Combine(i->Definition.Token.Line);
+			Combine(i->Definition.Token.BeginChar);
+		}
+		return Hash;
+	}
+
+	static void RemoveFile(FileEntries& File)
+	{
+		for (uint32_t i : File.Entries)
+		{
+			Entries[i].Removed = true;
+			FreeEntries.push_back(i);
+			RemovedInPostings++;
+		}
+		File.Entries.clear();
+	}
+
+	// Drops removed entries from the postings once they make up half of them.
+	static void CompactIfNeeded()
+	{
+		if (RemovedInPostings * 2 < Entries.size())
+			return;
+
+		for (auto It = Postings.begin(); It != Postings.end();)
+		{
+			std::erase_if(It->second, [](uint32_t i) { return Entries[i].Removed; });
+			if (It->second.empty())
+				It = Postings.erase(It);
+			else
+				It++;
+		}
+		RemovedInPostings = 0;
+	}
+
+	static uint32_t AddEntry(const Symbol& From)
+	{
+		uint32_t Index;
+		if (!FreeEntries.empty() && RemovedInPostings == 0)
+		{
+			// Removed entries are only reused once they're not referenced by any posting.
+			Index = FreeEntries.back();
+			FreeEntries.pop_back();
+		}
+		else
+		{
+			Index = uint32_t(Entries.size());
+			Entries.emplace_back();
+		}
+
+		Entries[Index] = Entry{
+			.Kind = From.Kind,
+			.Name = From.Name,
+			.Location = From.Definition,
+		};
+		for (uint32_t Trigram : GetTrigrams(From.Name))
+		{
+			Postings[Trigram].push_back(Index);
+		}
+		return Index;
+	}
+
+	// Scores how well the name matches the lowercase query. Returns 0 if it doesn't match.
+	static float GetScore(std::string_view Name, std::string_view Query, size_t SharedTrigrams, size_t QueryTrigrams)
+	{
+		std::string LowerName;
+		LowerName.reserve(Name.size());
+		for (char c : Name)
+			LowerName.push_back(Lower(c));
+
+		// Shorter names are preferred among equal matches.
+		float LengthPenalty = float(Name.size()) / 1000.0f;
+
+		if (LowerName == Query)
+			return 4.0f - LengthPenalty;
+		size_t Found = LowerName.find(Query);
+		if (Found == 0)
+			return 3.0f - LengthPenalty;
+		if (Found != std::string::npos)
+			return 2.5f - float(Found) / 100.0f - LengthPenalty;
+
+		// The query's characters appear in order, like "gbc" for "GlobalButtonColor".
+		size_t Position = 0, Gaps = 0;
+		for (char c : Query)
+		{
+			size_t Next = LowerName.find(c, Position);
+			if (Next == std::string::npos)
+			{
+				Position = std::string::npos;
+				break;
+			}
+			Gaps += Next - Position;
+			Position = Next + 1;
+		}
+		if (Position != std::string::npos)
+			return 2.0f - std::min(float(Gaps) / 100.0f, 0.5f) - LengthPenalty;
+
+		// Tolerates typos if most of the query's trigrams are part of the name.
+		if (QueryTrigrams > 0 && SharedTrigrams * 2 >= QueryTrigrams)
+			return float(SharedTrigrams) / float(QueryTrigrams) - LengthPenalty;
+		return 0;
+	}
+}
+
+void search::Update(const analysis::Snapshot& From)
+{
+	trace::Span Span = trace::Span("UpdateSymbolSearch");
+
+	std::unordered_map<std::string_view, std::vector<const Symbol*>> Declarations;
+	for (const Symbol& i : From.Symbols)
+	{
+		// Vars are only visible inside their element.
+		if (i.Kind != Symbol::Var)
+			Declarations[i.Definition.File].push_back(&i);
+	}
+
+	for (auto It = Files.begin(); It != Files.end();)
+	{
+		if (Declarations.contains(It->first))
+		{
+			It++;
+			continue;
+		}
+		RemoveFile(It->second);
+		It = Files.erase(It);
+	}
+
+	for (auto& [File, FileDeclarations] : Declarations)
+	{
+		size_t Fingerprint = GetFingerprint(FileDeclarations);
+		FileEntries& Indexed = Files[File];
+		if (!Indexed.Entries.empty() && Indexed.Fingerprint == Fingerprint)
+			continue;
+
+		RemoveFile(Indexed);
+		CompactIfNeeded();
+		Indexed.Fingerprint = Fingerprint;
+		for (const Symbol* i : FileDeclarations)
+		{
+			Indexed.Entries.push_back(AddEntry(*i));
+		}
+	}
+	CompactIfNeeded();
+}
+
+std::vector<search::SymbolMatch> search::Find(std::string_view Query, size_t Limit)
+{
+	std::string LowerQuery;
+	for (char c : Query)
+	{
+		if (!std::isspace((unsigned char)c))
+			LowerQuery.push_back(Lower(c));
+	}
+
+	std::vector<SymbolMatch> Out;
+	auto AddMatch = [&Out](const Entry& From, float Score) {
+		Out.push_back(SymbolMatch{
+			.Kind = From.Kind,
+			.Name = From.Name,
+			.Location = From.Location,
+			.Score = Score,
+			});
+		};
+
+	if (LowerQuery.empty())
+	{
+		for (const Entry& i : Entries)
+		{
+			if (Out.size() >= Limit)
+				break;
+			if (!i.Removed)
+				AddMatch(i, 0);
+		}
+		return Out;
+	}
+
+	std::vector<uint32_t> QueryTrigrams = GetTrigrams(LowerQuery);
+	// Short queries only have padded trigrams. The last one is the most selective, it matches names starting with the query.
+	if (LowerQuery.size() < 3)
+	{
+		uint32_t Prefix = 0;
+		for (char c : LowerQuery)
+			Prefix = AddToTrigram(Prefix, c);
+		QueryTrigrams = { Prefix };
+	}
+
+	// Counts the query trigrams each candidate shares.
+	std::unordered_map<uint32_t, uint32_t> Candidates;
+	for (uint32_t Trigram : QueryTrigrams)
+	{
+		auto Found = Postings.find(Trigram);
+		if (Found == Postings.end())
+			continue;
+		for (uint32_t i : Found->second)
+		{
+			if (!Entries[i].Removed)
+				Candidates[i]++;
+		}
+	}
+
+	for (auto& [Index, Shared] : Candidates)
+	{
+		float Score = GetScore(Entries[Index].Name, LowerQuery, Shared, QueryTrigrams.size());
+		if (Score > 0)
+			AddMatch(Entries[Index], Score);
+	}
+
+	auto Better = [](const SymbolMatch& a, const SymbolMatch& b) {
+		if (a.Score != b.Score)
+			return a.Score > b.Score;
+		return a.Name < b.Name;
+		};
+	if (Out.size() > Limit)
+	{
+		std::partial_sort(Out.begin(), Out.begin() + Limit, Out.end(), Better);
+		Out.resize(Limit);
+	}
+	else
+	{
+		std::sort(Out.begin(), Out.end(), Better);
+	}
+	return Out;
+}
+
+size_t search::GetMemoryUsage()
+{
+	size_t Size = Entries.capacity() * sizeof(Entry) + FreeEntries.capacity() * sizeof(uint32_t);
+	for (auto& [Trigram, Posting] : Postings)
+	{
+		Size += sizeof(Trigram) + sizeof(Posting) + Posting.capacity() * sizeof(uint32_t);
+	}
+	for (auto& [Name, File] : Files)
+	{
+		Size += sizeof(Name) + sizeof(File) + File.Entries.capacity() * sizeof(uint32_t);
+	}
+	return Size;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "Analysis.h"
+#include <string_view>
+#include <vector>
+
+/**
+ * Fuzzy search over the names of all elements, globals and constants in the workspace.
+ *
+ * Names are indexed by their lowercase trigrams. Queries only score the names sharing trigrams with the query,
+ * so a query doesn't scan every declaration in the workspace.
+ * The index is kept across analyses and only the files whose declarations changed are reindexed.
+ *
+ * Only accessed from the scheduler thread.
+ */
+namespace search
+{
+	struct SymbolMatch
+	{
+		analysis::Symbol::SymbolKind Kind = analysis::Symbol::Element;
+		// Interned name of the symbol.
+		std::string_view Name;
+		analysis::SymbolLocation Location;
+		// Higher is better.
+		float Score = 0;
+	};
+
+	// Updates the index with the declarations of the given snapshot.
+	void Update(const analysis::Snapshot& From);
+
+	// Returns up to Limit matches for the query, best match first. An empty query matches every symbol.
+	std::vector<SymbolMatch> Find(std::string_view Query, size_t Limit);
+
+	// Returns the approximate number of bytes used by the index.
+	size_t GetMemoryUsage();
+}
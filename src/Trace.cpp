@@ -0,0 +1,160 @@
+#include "Trace.h"
+#include <nlohmann/json.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace
+{
+	struct Event
+	{
+		const char* Name = nullptr;
+		uint64_t Start = 0;
+		uint64_t Duration = 0;
+	};
+
+	// Written only by its own thread. The lock is only contended while Write() copies the events.
+	struct ThreadBuffer
+	{
+		static constexpr size_t SIZE = 1 << 15;
+
+		std::mutex Mutex;
+		std::array<Event, SIZE> Events;
+		uint64_t WriteIndex = 0;
+		std::atomic<const char*> Name = nullptr;
+		uint32_t ThreadID = 0;
+	};
+
+	static std::atomic<bool> Enabled = false;
+	static std::string OutputFile;
+	static const auto StartTime = std::chrono::steady_clock::now();
+
+	static std::mutex BuffersMutex;
+	static std::vector<std::shared_ptr<ThreadBuffer>> Buffers;
+
+	static uint64_t GetTime()
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - StartTime).count());
+	}
+
+	static ThreadBuffer& GetThreadBuffer()
+	{
+		thread_local std::shared_ptr<ThreadBuffer> Buffer;
+		if (!Buffer)
+		{
+			Buffer = std::make_shared<ThreadBuffer>();
+			std::unique_lock g{ BuffersMutex };
+			Buffer->ThreadID = uint32_t(Buffers.size() + 1);
+			Buffers.push_back(Buffer);
+		}
+		return *Buffer;
+	}
+}
+
+void trace::Start(std::string OutputFile)
+{
+	trace::OutputFile = OutputFile;
+	Enabled = true;
+}
+
+bool trace::IsEnabled()
+{
+	return Enabled;
+}
+
+void trace::SetThreadName(const char* Name)
+{
+	if (Enabled)
+		GetThreadBuffer().Name = Name;
+}
+
+const std::string& trace::GetOutputFile()
+{
+	return OutputFile;
+}
+
+trace::Span::Span(const char* Name)
+{
+	if (!Enabled)
+		return;
+	this->Name = Name;
+	Start = GetTime();
+}
+
+trace::Span::~Span()
+{
+	if (!Name)
+		return;
+
+	Event Recorded = Event{
+		.Name = Name,
+		.Start = Start,
+		.Duration = GetTime() - Start,
+	};
+	ThreadBuffer& Buffer = GetThreadBuffer();
+	std::unique_lock g{ Buffer.Mutex };
+	Buffer.Events[Buffer.WriteIndex++ % ThreadBuffer::SIZE] = Recorded;
+}
+
+bool trace::Write()
+{
+	if (!Enabled)
+		return false;
+
+	std::vector<std::shared_ptr<ThreadBuffer>> AllBuffers;
+	{
+		std::unique_lock g{ BuffersMutex };
+		AllBuffers = Buffers;
+	}
+
+	nlohmann::json TraceEvents = nlohmann::json::array();
+
+	for (auto& Buffer : AllBuffers)
+	{
+		if (Buffer->Name)
+		{
+			TraceEvents.push_back({
+				{ "name", "thread_name" },
+				{ "ph", "M" },
+				{ "pid", 1 },
+				{ "tid", Buffer->ThreadID },
+				{ "args", { { "name", Buffer->Name.load() } } },
+				});
+		}
+
+		// Copied first, so the thread only waits for the copy and not for the json to be built.
+		std::vector<Event> Copied;
+		{
+			std::unique_lock g{ Buffer->Mutex };
+			uint64_t End = Buffer->WriteIndex;
+			uint64_t Begin = End > ThreadBuffer::SIZE ? End - ThreadBuffer::SIZE : 0;
+			Copied.reserve(End - Begin);
+			for (uint64_t i = Begin; i < End; i++)
+			{
+				Copied.push_back(Buffer->Events[i % ThreadBuffer::SIZE]);
+			}
+		}
+
+		for (const Event& e : Copied)
+		{
+			TraceEvents.push_back({
+				{ "name", e.Name },
+				{ "ph", "X" },
+				{ "ts", e.Start },
+				{ "dur", e.Duration },
+				{ "pid", 1 },
+				{ "tid", Buffer->ThreadID },
+				});
+		}
+	}
+
+	std::ofstream Out = std::ofstream(OutputFile, std::ios::binary);
+	if (!Out)
+		return false;
+	Out << nlohmann::json{ { "traceEvents", TraceEvents }, { "displayTimeUnit", "ms" } }.dump();
+	return Out.good();
+}
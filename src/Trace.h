@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/**
+ * Timeline tracing in the Chrome trace event format.
+ *
+ * Spans are recorded into a fixed size ring buffer per thread, so only the most recent events of each thread are kept.
+ * Each buffer has its own lock, which is only contended while the trace is written.
+ * The resulting file can be opened in chrome://tracing or ui.perfetto.dev.
+ */
+namespace trace
+{
+	// Enables tracing. The trace is written to the given file by Write().
+	void Start(std::string OutputFile);
+	bool IsEnabled();
+
+	// Sets the name shown for the calling thread in the trace.
+	void SetThreadName(const char* Name);
+
+	/**
+	 * Writes all recorded events to the output file.
+	 * Returns false if tracing is disabled or the file couldn't be written.
+	 */
+	bool Write();
+
+	const std::string& GetOutputFile();
+
+	/**
+	 * Records the time until the end of the scope as a span.
+	 * Name must stay valid until the trace is written, so it should be a literal or an interned string.
+	 */
+	class Span
+	{
+	public:
+		Span(const char* Name);
+		~Span();
+
+		Span(const Span&) = delete;
+
+	private:
+		const char* Name = nullptr;
+		uint64_t Start = 0;
+	};
+}
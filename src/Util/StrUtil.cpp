@@ -1,6 +1,8 @@
 #include "StrUtil.h"
 #include <cstdarg>
 #include <algorithm>
+#include <unordered_set>
+#include <mutex>
 
 std::string StrUtil::Trim(std::string From)
 {
@@ -23,7 +25,8 @@ std::string StrUtil::Format(std::string FormatString, ...)
 		Buffer = new char[Size]();
 		va_list va;
 		va_start(va, FormatString);
-		NewSize = vsnprintf(Buffer, Size, FormatString.c_str(), va);
+		// vsnprintf returns the length without the null terminator.
+		NewSize = vsnprintf(Buffer, Size, FormatString.c_str(), va) + 1;
 		va_end(va);
 
 	} while (NewSize > Size);
@@ -45,3 +48,41 @@ std::string StrUtil::Lower(std::string From)
 		[](unsigned char c) { return std::tolower(c); });
 	return From;
 }
+
+namespace
+{
+	struct StringHash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view From) const
+		{
+			return std::hash<std::string_view>()(From);
+		}
+	};
+
+	// Elements of an unordered_set are never moved, so views of them remain valid.
+	std::unordered_set<std::string, StringHash, std::equal_to<>> InternedStrings;
+	std::mutex InternMutex;
+}
+
+std::string_view StrUtil::Intern(std::string_view From)
+{
+	std::unique_lock g{ InternMutex };
+	auto Found = InternedStrings.find(From);
+	if (Found == InternedStrings.end())
+	{
+		Found = InternedStrings.emplace(From).first;
+	}
+	return *Found;
+}
+
+size_t StrUtil::GetInternedMemoryUsage()
+{
+	std::unique_lock g{ InternMutex };
+	size_t Size = InternedStrings.bucket_count() * sizeof(void*);
+	for (const std::string& i : InternedStrings)
+	{
+		Size += sizeof(std::string) + sizeof(void*) + i.capacity();
+	}
+	return Size;
+}
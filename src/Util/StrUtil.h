@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <string_view>
 
 namespace StrUtil
 {
@@ -10,4 +11,13 @@ namespace StrUtil
 	bool CaseInsensitiveCompare(std::string a, std::string b);
 
 	std::string Lower(std::string From);
+
+	/**
+	 * Returns a view of a pooled copy of the given string.
+	 * Equal strings return the same view, which stays valid for the lifetime of the process.
+	 * Meant for identifiers and file names, which repeat across analysis passes.
+	 */
+	std::string_view Intern(std::string_view From);
+	// Returns the approximate number of bytes used by interned strings.
+	size_t GetInternedMemoryUsage();
 }
\ No newline at end of file
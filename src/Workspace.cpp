@@ -1,13 +1,21 @@
 #include "Workspace.h"
+#include "Session.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "Scheduler.h"
+#include "Util/StrUtil.h"
+#include <algorithm>
 #include <filesystem>
-#include <sstream>
 #include <fstream>
 #include <iostream>
+#include <thread>
 namespace filesystem = std::filesystem;
 
 std::string workspace::CurrentWorkspacePath;
-std::map<std::string, workspace::FileData> workspace::Files;
-std::vector<std::string> workspace::OpenedFiles;
+std::map<std::string, workspace::FileData, std::less<>> workspace::Files;
+std::map<uint32_t, workspace::Overlay> workspace::Overlays;
+std::atomic<bool> workspace::IsIndexing = false;
+size_t workspace::ClosedFileBudget = 0;
 
 std::vector<std::string> workspace::GetAllUIFiles()
 {
@@ -23,8 +31,8 @@ std::vector<std::string> workspace::GetAllUIFiles()
 		{
 			if (i.is_regular_file() && i.path().extension() == ".kui")
 			{
-#if _WIN32
 				auto str = i.path().string();
+#if _WIN32
 				for (auto& i : str)
 				{
 					if (i == '\\')
@@ -43,48 +51,224 @@ std::vector<std::string> workspace::GetAllUIFiles()
 	return Found;
 }
 
-void workspace::UpdateFiles()
+static workspace::ContentBuffer ReadFile(const std::string& Path)
 {
-	auto NewFiles = GetAllUIFiles();
+	std::ifstream Stream = std::ifstream(Path, std::ios::binary | std::ios::ate);
+	std::string Content;
+	if (Stream.is_open())
+	{
+		Content.resize(size_t(Stream.tellg()));
+		Stream.seekg(0);
+		Stream.read(Content.data(), Content.size());
+		Content.resize(size_t(Stream.gcount()));
+	}
+	return workspace::MakeContent(std::move(Content));
+}
 
-	for (auto& i : NewFiles)
+// Adds a file on disk. Sessions that have it opened keep seeing their document instead.
+static void AddFile(workspace::FileData&& File)
+{
+	using namespace workspace;
+
+	for (auto& [Session, Overlay] : Overlays)
 	{
-		bool Found = false;
-		for (auto& ExistingFile : Files)
+		for (auto& Opened : Overlay.OpenedFiles)
 		{
-			if (CompareFiles(ExistingFile.second.Name, i))
+			if (CompareFiles(File.Name, Opened))
 			{
-				Found = true;
-				break;
+				Overlay.Replaced.insert(File.Name);
 			}
 		}
-		if (Found)
+	}
+	std::string Name = File.Name;
+	Files.insert({ Name, std::move(File) });
+}
+
+void workspace::UpdateFiles()
+{
+	auto NewFiles = GetAllUIFiles();
+
+	for (auto& i : NewFiles)
+	{
+		if (Files.contains(i))
 			continue;
 
-		std::ifstream Stream = std::ifstream(i);
-		std::stringstream ContentStream;
-		ContentStream << Stream.rdbuf();
-		Stream.close();
+		AddFile(FileData{
+			.Content = ReadFile(i),
+			.Name = i,
+			});
+	}
+}
 
-		Files.insert({
-			i, FileData{
-				.Content = ContentStream.str(),
-				.Name = i,
-			}
+void workspace::UpdateFilesAsync(std::function<void(size_t Loaded, size_t Total)> OnProgress, std::function<void()> OnFinished)
+{
+	IsIndexing = true;
+
+	auto IndexThread = std::thread([OnProgress, OnFinished]() {
+		// Files are read on this thread and added to the workspace in batches by background tasks,
+		// so messages arriving during indexing are answered with the files loaded so far.
+		constexpr size_t BATCH_SIZE = 32;
+		trace::SetThreadName("indexing");
+
+		auto NewFiles = GetAllUIFiles();
+		size_t Total = NewFiles.size();
+
+		scheduler::Post(scheduler::Priority::Background, [OnProgress, Total]() {
+			OnProgress(0, Total);
+			});
+
+		auto Batch = std::make_shared<std::vector<FileData>>();
+		for (size_t i = 0; i < NewFiles.size(); i++)
+		{
+			Batch->push_back(FileData{
+				.Content = ReadFile(NewFiles[i]),
+				.Name = NewFiles[i],
+				});
+
+			if (Batch->size() < BATCH_SIZE && i + 1 < NewFiles.size())
+				continue;
+
+			scheduler::Post(scheduler::Priority::Background, [OnProgress, Batch, Loaded = i + 1, Total]() {
+				trace::Span Span = trace::Span("AddFiles");
+				for (FileData& File : *Batch)
+				{
+					// The file might have been loaded by UpdateFiles() while it was being read.
+					if (Files.contains(File.Name))
+						continue;
+					AddFile(std::move(File));
+				}
+				OnProgress(Loaded, Total);
+				});
+			Batch = std::make_shared<std::vector<FileData>>();
+		}
+
+		scheduler::Post(scheduler::Priority::Background, [OnFinished]() {
+			IsIndexing = false;
+			OnFinished();
 			});
+		});
+	IndexThread.detach();
+}
+
+void workspace::LoadAllFiles(size_t Threads)
+{
+	auto NewFiles = GetAllUIFiles();
+	std::vector<FileData> Loaded = std::vector<FileData>(NewFiles.size());
+
+	// Each thread takes the next file that hasn't been read yet.
+	std::atomic<size_t> Next = 0;
+	auto ReadFiles = [&]() {
+		for (size_t i = Next++; i < NewFiles.size(); i = Next++)
+		{
+			Loaded[i] = FileData{
+				.Content = ReadFile(NewFiles[i]),
+				.Name = NewFiles[i],
+			};
+		}
+		};
+
+	std::vector<std::thread> Workers;
+	for (size_t i = 1; i < std::max<size_t>(Threads, 1); i++)
+	{
+		Workers.push_back(std::thread([&ReadFiles]() {
+			trace::SetThreadName("loader");
+			ReadFiles();
+			}));
+	}
+	{
+		trace::Span Span = trace::Span("ReadFiles");
+		ReadFiles();
+	}
+	for (std::thread& Worker : Workers)
+	{
+		Worker.join();
 	}
 
-	for (auto& i : Files)
+	for (FileData& File : Loaded)
+	{
+		if (Files.contains(File.Name))
+			continue;
+		AddFile(std::move(File));
+	}
+}
+
+void workspace::EnforceMemoryBudget()
+{
+	if (ClosedFileBudget == 0)
+		return;
+
+	std::vector<FileData*> Closed;
+	size_t ClosedSize = 0;
+	// Opened documents are kept in the overlays, so all files here are closed in at least one session.
+	for (auto& [Name, File] : Files)
+	{
+		if (!File.Content)
+			continue;
+		Closed.push_back(&File);
+		ClosedSize += File.Content->size();
+	}
+
+	std::sort(Closed.begin(), Closed.end(), [](FileData* a, FileData* b) {
+		return a->Content->size() > b->Content->size();
+		});
+
+	for (FileData* File : Closed)
 	{
-		i.second.Opened = false;
-		for (auto& Opened : OpenedFiles)
+		if (ClosedSize <= ClosedFileBudget)
+			break;
+		ClosedSize -= File->Content->size();
+		// Columns in diagnostics and references still need to be converted after the content is gone.
+		File->Lines = GetLineIndex(*File).Compact();
+		File->Content = nullptr;
+		File->SemanticTokens = {};
+		File->Evicted = true;
+	}
+}
+
+bool workspace::NeedsSummary(const FileData& File)
+{
+	return File.Evicted && !File.Summary;
+}
+
+workspace::ContentBuffer workspace::ReloadEvicted(FileData& File)
+{
+	ContentBuffer Content = ReadFile(File.Name);
+	File.Lines = LineIndex(Content).Compact();
+	return Content;
+}
+
+void workspace::ReportMemoryUsage()
+{
+	size_t ContentSize = 0, EditBufferSize = 0, TokensSize = 0, LineIndexSize = 0;
+	auto AddFile = [&](const FileData& File) {
+		if (File.Content)
+			ContentSize += File.Content->size();
+		if (File.OpenDocument)
+			EditBufferSize += File.OpenDocument->GetMemoryUsage();
+		if (File.Lines)
+			LineIndexSize += File.Lines->GetMemoryUsage();
+		// Compact indexes own the lines they keep.
+		if (File.Evicted && File.Lines)
+			LineIndexSize += File.Lines->GetContent()->size();
+		TokensSize += File.SemanticTokens.capacity() * sizeof(uint32_t);
+		};
+	for (auto& [Name, File] : Files)
+	{
+		AddFile(File);
+	}
+	for (auto& [Session, Overlay] : Overlays)
+	{
+		for (auto& [Uri, File] : Overlay.Documents)
 		{
-			if (CompareFiles(i.second.Name, Opened))
-			{
-				i.second.Opened = true;
-			}
+			AddFile(File);
 		}
 	}
+
+	stats::SetMemoryUsage("documents.content", ContentSize);
+	stats::SetMemoryUsage("documents.editBuffers", EditBufferSize);
+	stats::SetMemoryUsage("documents.semanticTokens", TokensSize);
+	stats::SetMemoryUsage("indexes.lineIndex", LineIndexSize);
+	stats::SetMemoryUsage("indexes.internedStrings", StrUtil::GetInternedMemoryUsage());
 }
 
 bool workspace::CompareFiles(std::string a, std::string b)
@@ -93,7 +277,9 @@ bool workspace::CompareFiles(std::string a, std::string b)
 		return false;
 	if (a == b)
 		return true;
-	return filesystem::equivalent(a, b);
+	// Files that don't exist (anymore) aren't equivalent to anything.
+	std::error_code Error;
+	return filesystem::equivalent(a, b, Error);
 }
 
 static void ReplaceAll(std::string& str, const std::string& from, const std::string& to)
@@ -121,37 +307,169 @@ std::string workspace::ConvertFilePath(std::string FilePathUri)
 	return FilePathUri.substr(UriSize);
 }
 
-void workspace::OnUriOpened(std::string Uri)
+std::string workspace::GetFileUri(std::string_view PathOrUri)
+{
+	const char* FileUri = "file:///";
+
+	if (PathOrUri.starts_with(FileUri))
+		return std::string(PathOrUri);
+
+	// Reverses ConvertFilePath().
+	std::string Uri = FileUri;
+	if (PathOrUri.starts_with('/'))
+		PathOrUri.remove_prefix(1);
+	for (char c : PathOrUri)
+	{
+		if (c == '\\')
+			Uri.push_back('/');
+		else if (c == ':')
+			Uri.append("%3A");
+		else
+			Uri.push_back(c);
+	}
+	return Uri;
+}
+
+workspace::Overlay& workspace::GetOverlay()
+{
+	return Overlays[session::GetCurrent()];
+}
+
+workspace::FileData* workspace::FindFile(std::string_view Key)
+{
+	auto Found = Overlays.find(session::GetCurrent());
+	if (Found != Overlays.end())
+	{
+		auto Document = Found->second.Documents.find(Key);
+		if (Document != Found->second.Documents.end())
+			return &Document->second;
+		if (Found->second.Replaced.contains(Key))
+			return nullptr;
+	}
+
+	auto File = Files.find(Key);
+	return File != Files.end() ? &File->second : nullptr;
+}
+
+std::vector<std::pair<std::string_view, workspace::FileData*>> workspace::GetVisibleFiles()
 {
-	OpenedFiles.push_back(ConvertFilePath(Uri));
+	std::vector<std::pair<std::string_view, FileData*>> Visible;
+	Visible.reserve(Files.size());
 
+	auto Found = Overlays.find(session::GetCurrent());
+	Overlay* Current = Found != Overlays.end() ? &Found->second : nullptr;
+	if (Current)
+	{
+		for (auto& [Uri, File] : Current->Documents)
+		{
+			Visible.push_back({ Uri, &File });
+		}
+	}
+	for (auto& [Name, File] : Files)
+	{
+		// A document can also be stored with the path of the file it replaces.
+		if (Current && (Current->Replaced.contains(Name) || Current->Documents.contains(Name)))
+			continue;
+		Visible.push_back({ Name, &File });
+	}
+	return Visible;
+}
+
+void workspace::OnUriOpened(std::string Uri)
+{
+	Overlay& Current = GetOverlay();
 	std::string Path = ConvertFilePath(Uri);
+	Current.OpenedFiles.push_back(Path);
+
+	FileData& Document = Current.Documents[Uri];
+	Document.Name = Path;
 
 	for (auto& i : Files)
 	{
 		if (CompareFiles(i.second.Name, Path))
 		{
-			Files.insert({
-				Uri, i.second
-				});
-			Files.erase(i.first);
-			return;
+			Current.Replaced.insert(i.first);
 		}
 	}
 }
 
 void workspace::OnUriClosed(std::string Uri)
 {
-	Files.erase(Uri);
+	Overlay& Current = GetOverlay();
+	Current.Documents.erase(Uri);
 
-	for (auto i = OpenedFiles.begin(); i < OpenedFiles.end(); i++)
+	std::string Path = ConvertFilePath(Uri);
+	for (auto i = Current.OpenedFiles.begin(); i < Current.OpenedFiles.end(); i++)
 	{
-		if (CompareFiles(*i, ConvertFilePath(Uri)))
+		if (CompareFiles(*i, Path))
 		{
-			OpenedFiles.erase(i);
+			Current.OpenedFiles.erase(i);
 			break;
 		}
 	}
+	std::erase_if(Current.Replaced, [&Path](const std::string& Name) {
+		return CompareFiles(Name, Path);
+		});
+}
+
+bool workspace::OnUriChangedOnDisk(std::string Uri, DiskChange Change)
+{
+	if (Change == DiskChange::Created)
+	{
+		size_t Loaded = Files.size();
+		UpdateFiles();
+		return Files.size() != Loaded;
+	}
+
+	if (Change == DiskChange::Deleted)
+	{
+		// The file is gone, so it can't be compared to the path anymore.
+		size_t Erased = std::erase_if(Files, [](const auto& File) {
+			return !filesystem::exists(File.first);
+			});
+		for (auto& [Session, Overlay] : Overlays)
+		{
+			std::erase_if(Overlay.Replaced, [](const std::string& Name) {
+				return !Files.contains(Name);
+				});
+		}
+		return Erased != 0;
+	}
+
+	std::string Path = ConvertFilePath(Uri);
+	for (auto& [Name, File] : Files)
+	{
+		if (!CompareFiles(Name, Path))
+			continue;
+		// Evicted files are read again by the next analysis.
+		if (File.Evicted)
+			File.Summary = nullptr;
+		else
+			File.Content = ReadFile(Name);
+		return true;
+	}
+	return false;
+}
+
+const workspace::LineIndex& workspace::GetLineIndex(FileData& File)
+{
+	if (File.Evicted && File.Lines)
+		return *File.Lines;
+	if (!File.Lines || File.Lines->GetContent() != File.Content)
+	{
+		File.Lines = std::make_shared<LineIndex>(File.Content);
+	}
+	return *File.Lines;
+}
+
+bool workspace::HasLineIndex(const FileData& File)
+{
+	return File.Content || (File.Evicted && File.Lines);
+}
+
+workspace::ContentBuffer workspace::MakeContent(std::string Content)
+{
+	return std::make_shared<const std::string>(std::move(Content));
 }
 
 std::string workspace::GetDisplayName(std::string PathOrUri)
@@ -1,30 +1,138 @@
 #include <string>
 #include <vector>
-#include <nlohmann/json.hpp>
+#include <map>
+#include <set>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include "Document.h"
+#include "LineIndex.h"
+
+namespace analysis
+{
+	struct FileSummary;
+}
 
 namespace workspace
 {
 	extern std::string CurrentWorkspacePath;
 
+	ContentBuffer MakeContent(std::string Content);
+
 	struct FileData
 	{
-		bool Opened = false;
-		nlohmann::json SemanticTokens = nlohmann::json::array();
-		std::string Content;
+		// Encoded semantic tokens of the opened document, updated with every analysis.
+		std::vector<uint32_t> SemanticTokens;
+		ContentBuffer Content;
 		std::string Name;
+		// Editable text of the file, if it is opened by the client.
+		std::unique_ptr<Document> OpenDocument;
+		// Line index of Content. Created by GetLineIndex() when needed. Evicted files keep a compact index.
+		std::shared_ptr<const LineIndex> Lines;
+		// True if Content was dropped to stay within ClosedFileBudget.
+		bool Evicted = false;
+		// Parse result of an evicted file, used by analyses instead of its content.
+		// Created by the first analysis after the eviction, or after the client reported a change of the file on disk.
+		std::shared_ptr<const analysis::FileSummary> Summary;
 	};
 
+	/**
+	 * Maximum number of bytes of closed file contents kept in memory. 0 means no limit.
+	 * Closed files over the budget only keep a compact line index and a summary of their parse result.
+	 * They are read from disk again only when the client reports that they changed (workspace/didChangeWatchedFiles).
+	 */
+	extern size_t ClosedFileBudget;
+
+	// Evicts the contents of closed files, largest first, until they fit into ClosedFileBudget.
+	void EnforceMemoryBudget();
+
+	// Returns true if the file is evicted and has no summary yet, or its summary was outdated by a change on disk.
+	bool NeedsSummary(const FileData& File);
+
+	/**
+	 * Reads the content of an evicted file from disk, to create its summary.
+	 * The compact line index is updated, the content isn't kept in the file.
+	 */
+	ContentBuffer ReloadEvicted(FileData& File);
+
+	// Reports the memory used by the workspace's files to the stats.
+	void ReportMemoryUsage();
+
+	// Returns the line index of the file's current content, creating it if it's outdated. Evicted files return their compact index.
+	const LineIndex& GetLineIndex(FileData& File);
+	// True if GetLineIndex() can convert columns of the file.
+	bool HasLineIndex(const FileData& File);
+
 	std::vector<std::string> GetAllUIFiles();
 	void UpdateFiles();
-	// First: uri, second: file info
-	extern std::map<std::string, FileData> Files;
-	// Contains paths to all opened files
-	extern std::vector<std::string> OpenedFiles;
+
+	/**
+	 * Loads all UI files in the workspace on a background thread.
+	 *
+	 * OnProgress is called with the number of loaded files and the total number of files.
+	 * OnFinished is called once all files have been added to Files.
+	 * Files are added and both callbacks are called by background tasks on the scheduler thread.
+	 */
+	void UpdateFilesAsync(std::function<void(size_t Loaded, size_t Total)> OnProgress, std::function<void()> OnFinished);
+
+	/**
+	 * Loads all UI files in the workspace, reading them on the given number of threads.
+	 * Blocks until all files have been added to Files.
+	 */
+	void LoadAllFiles(size_t Threads);
+
+	// True while UpdateFilesAsync is still loading files.
+	extern std::atomic<bool> IsIndexing;
+
+	// First: path, second: file info. The files on disk, shared by all sessions. Only accessed by tasks on the scheduler thread.
+	extern std::map<std::string, FileData, std::less<>> Files;
+
+	/**
+	 * The documents one client session has opened, layered over the files on disk.
+	 * Sessions edit their own copy of a document. Other sessions keep seeing the file on disk.
+	 */
+	struct Overlay
+	{
+		// First: uri, second: the opened document.
+		std::map<std::string, FileData, std::less<>> Documents;
+		// Paths of the opened documents.
+		std::vector<std::string> OpenedFiles;
+		// Keys of the files in Files that the opened documents replace.
+		std::set<std::string, std::less<>> Replaced;
+	};
+
+	// First: session id. Overlays are only accessed by tasks on the scheduler thread.
+	extern std::map<uint32_t, Overlay> Overlays;
+
+	// Returns the overlay of the session the calling task runs for, creating it if the session has none yet.
+	Overlay& GetOverlay();
+	// Returns the current session's opened document with the key, or the file on disk with it. nullptr if there is neither.
+	FileData* FindFile(std::string_view Key);
+	// Returns the files the current session sees: its opened documents, and the files on disk they don't replace.
+	std::vector<std::pair<std::string_view, FileData*>> GetVisibleFiles();
 
 	std::string ConvertFilePath(std::string FilePathUri);
+	// Returns the uri of a file. Opened documents are stored with their uri, files on disk with their path.
+	std::string GetFileUri(std::string_view PathOrUri);
 
+	// Adds the document to the current session's overlay. ScanFile() sets its content.
 	void OnUriOpened(std::string Uri);
+	// Removes the document from the current session's overlay, the session sees the file on disk again.
 	void OnUriClosed(std::string Uri);
+	// The types of workspace/didChangeWatchedFiles changes.
+	enum class DiskChange
+	{
+		Created = 1,
+		Changed = 2,
+		Deleted = 3,
+	};
+
+	/**
+	 * Called when the client reports that a file changed on disk. Changed files are read again, or lose their summary if they are evicted.
+	 * Created and deleted files are added to or removed from Files. Returns true if Files changed, so the sessions need to be analyzed again.
+	 */
+	bool OnUriChangedOnDisk(std::string Uri, DiskChange Change);
 
 	std::string GetDisplayName(std::string PathOrUri);
 
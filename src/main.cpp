@@ -1,12 +1,158 @@
 #include <iostream>
+#include <charconv>
+#include <string_view>
+#include <thread>
 #include "Protocol.h"
+#include "Workspace.h"
+#include "Scheduler.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Record.h"
+#include "Check.h"
+#include "Session.h"
+#include "Util/StrUtil.h"
+
+static void QueueMessage(Message msg)
+{
+	protocol::NotifyMessageRead(msg);
+	scheduler::Post(protocol::GetMessagePriority(msg), [msg]() {
+		// Responses to the message are sent to the session it was received from.
+		session::Scope Session = session::Scope(msg.Session);
+		auto Start = stats::Clock::now();
+		auto StartAllocations = allocations::GetThreadCounters();
+		{
+			// Span names need to outlive the message, so the method name is interned.
+			trace::Span Span = trace::Span(!trace::IsEnabled() || msg.Method.empty() ? "Response" : StrUtil::Intern(msg.Method).data());
+			protocol::HandleClientMessage(msg);
+		}
+		if (!msg.Method.empty())
+			stats::RecordMessage(msg.Method, Start - msg.ReceivedTime, stats::Clock::now() - Start, allocations::GetThreadCounters() - StartAllocations);
+		});
+}
+
+// Parses the value of a "--name=value" argument. Returns false if the value isn't a number.
+template<typename T>
+static bool ParseNumber(std::string_view Argument, T& Out)
+{
+	std::string_view Value = Argument.substr(Argument.find('=') + 1);
+	auto Result = std::from_chars(Value.data(), Value.data() + Value.size(), Out);
+	return Result.ec == std::errc() && Result.ptr == Value.data() + Value.size();
+}
 
 int main(int argc, char** argv)
 {
+	std::string CheckDirectory;
+	check::OutputFormat CheckFormat = check::OutputFormat::Text;
+	size_t CheckThreads = 0;
+	std::string DaemonSocket;
+	std::string ConnectSocket;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view Argument = argv[i];
+		if (Argument == "--check")
+		{
+			if (i + 1 >= argc || std::string_view(argv[i + 1]).starts_with("--"))
+			{
+				std::cerr << "--check expects the directory to check" << std::endl;
+				return 2;
+			}
+			CheckDirectory = argv[++i];
+		}
+		else if (Argument.starts_with("--format="))
+		{
+			if (!check::ParseFormat(Argument.substr(Argument.find('=') + 1), CheckFormat))
+			{
+				std::cerr << "unknown format: " << Argument << ", expected text, json or sarif" << std::endl;
+				return 2;
+			}
+		}
+		else if (Argument.starts_with("--jobs="))
+		{
+			if (!ParseNumber(Argument, CheckThreads))
+			{
+				std::cerr << "invalid number of jobs: " << Argument << ", expected the number of threads reading files" << std::endl;
+				return 2;
+			}
+		}
+		else if (Argument.starts_with("--daemon="))
+		{
+			DaemonSocket = std::string(Argument.substr(Argument.find('=') + 1));
+		}
+		else if (Argument.starts_with("--connect="))
+		{
+			ConnectSocket = std::string(Argument.substr(Argument.find('=') + 1));
+		}
+		else if (Argument.starts_with("--stats-interval="))
+		{
+			float Interval = 0;
+			if (!ParseNumber(Argument, Interval))
+			{
+				std::cerr << "invalid interval: " << Argument << ", expected a number of seconds" << std::endl;
+				return 2;
+			}
+			if (Interval > 0)
+				stats::StartPeriodicDump(Interval);
+		}
+		else if (Argument.starts_with("--trace="))
+		{
+			trace::Start(std::string(Argument.substr(Argument.find('=') + 1)));
+		}
+		else if (Argument.starts_with("--memory-budget="))
+		{
+			// In MiB.
+			double Budget = 0;
+			if (!ParseNumber(Argument, Budget) || Budget < 0)
+			{
+				std::cerr << "invalid memory budget: " << Argument << ", expected a number of MiB" << std::endl;
+				return 2;
+			}
+			workspace::ClosedFileBudget = size_t(Budget * 1024 * 1024);
+		}
+		else if (Argument.starts_with("--record="))
+		{
+			std::string File = std::string(Argument.substr(Argument.find('=') + 1));
+			if (!record::Start(File))
+				std::cerr << "failed to open recording file: " << File << std::endl;
+		}
+	}
+
+	// Forwards stdio to a running daemon. Without one, this process becomes a standalone server.
+	if (!ConnectSocket.empty())
+	{
+		if (session::Connect(ConnectSocket))
+			return 0;
+		std::cerr << "no daemon is listening on " << ConnectSocket << ", running standalone" << std::endl;
+	}
+
+	trace::SetThreadName("main");
 	protocol::Init();
-	while (true)
+
+	// Checks the directory instead of running as a language server.
+	if (!CheckDirectory.empty())
+	{
+		int Result = check::Run(CheckDirectory, CheckFormat, CheckThreads);
+		trace::Write();
+		return Result;
+	}
+
+	if (!DaemonSocket.empty())
 	{
-		auto msg = Message::ReadFromStdOut();
-		protocol::HandleClientMessage(msg);
+		if (!session::StartDaemon(DaemonSocket, QueueMessage, protocol::OnSessionClosed))
+			return 2;
+		scheduler::Run();
+		return 0;
 	}
-}
\ No newline at end of file
+
+	// Messages are read on their own thread, so new requests can be queued ahead of work that is already waiting.
+	auto ReadThread = std::thread([]() {
+		trace::SetThreadName("reader");
+		while (true)
+		{
+			QueueMessage(Message::ReadFromStdOut());
+		}
+		});
+	ReadThread.detach();
+
+	scheduler::Run();
+}
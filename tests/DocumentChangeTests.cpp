@@ -0,0 +1,117 @@
+/**
+ * Tests for DocumentChange::Decode().
+ *
+ * The decoder is only a fast path for FromJson(), so every message is decoded both ways and the results are compared.
+ * Messages the decoder can't handle need to be rejected by it, so they are parsed as json instead.
+ * The exit code is the number of failed tests.
+ */
+#include "DocumentChange.h"
+#include <iostream>
+#include <string>
+
+using nlohmann::json;
+
+static int Failed = 0;
+
+static void Fail(const std::string& Name, const std::string& Reason)
+{
+	std::cerr << "FAILED " << Name << ": " << Reason << std::endl;
+	Failed++;
+}
+
+static bool operator==(const DocumentChange::Position& a, const DocumentChange::Position& b)
+{
+	return a.Line == b.Line && a.Character == b.Character;
+}
+
+static bool IsEqual(const DocumentChange& a, const DocumentChange& b)
+{
+	if (a.Uri != b.Uri || a.Version != b.Version || a.Changes.size() != b.Changes.size())
+		return false;
+	for (size_t i = 0; i < a.Changes.size(); i++)
+	{
+		const DocumentChange::Change& x = a.Changes[i];
+		const DocumentChange::Change& y = b.Changes[i];
+		if (x.HasRange != y.HasRange || x.Text != y.Text)
+			return false;
+		if (x.HasRange && (!(x.Start == y.Start) || !(x.End == y.End)))
+			return false;
+	}
+	return true;
+}
+
+// The message is decoded by the fast path, with the same result as FromJson().
+static void ExpectDecoded(const std::string& Name, const std::string& Content, size_t ChangeCount)
+{
+	std::optional<DocumentChange> Decoded = DocumentChange::Decode(Content);
+	if (!Decoded)
+	{
+		Fail(Name, "not decoded");
+		return;
+	}
+	DocumentChange Expected = DocumentChange::FromJson(json::parse(Content).at("params"));
+	if (!IsEqual(*Decoded, Expected))
+		Fail(Name, "differs from FromJson()");
+	if (Decoded->Changes.size() != ChangeCount)
+		Fail(Name, "expected " + std::to_string(ChangeCount) + " changes, got " + std::to_string(Decoded->Changes.size()));
+}
+
+// The fast path rejects the message, so it's parsed as json.
+static void ExpectFallback(const std::string& Name, const std::string& Content)
+{
+	if (DocumentChange::Decode(Content))
+		Fail(Name, "decoded, but should have been left to FromJson()");
+}
+
+static std::string ChangeMessage(const std::string& Changes)
+{
+	return R"({"jsonrpc":"2.0","method":"textDocument/didChange","params":{"textDocument":{"uri":"file:///a.kui","version":3},"contentChanges":)"
+		+ Changes + "}}";
+}
+
+int main()
+{
+	ExpectDecoded("full text", ChangeMessage(R"([{"text":"element A {}"}])"), 1);
+
+	ExpectDecoded("range",
+		ChangeMessage(R"([{"range":{"start":{"line":1,"character":2},"end":{"line":3,"character":4}},"text":"x"}])"), 1);
+
+	ExpectDecoded("escaped text",
+		ChangeMessage(R"([{"text":"a\nb\t\"c\" \\ é 😀 \/"}])"), 1);
+
+	ExpectDecoded("multiple changes", ChangeMessage(R"([
+		{"range":{"start":{"line":0,"character":0},"end":{"line":0,"character":1}},"rangeLength":1,"text":""},
+		{"range":{"start":{"line":5,"character":10},"end":{"line":7,"character":0}},"text":"new\ntext"},
+		{"text":"replaced"}
+		])"), 3);
+
+	ExpectDecoded("reordered keys", R"({
+		"params":{
+			"contentChanges":[{"text":"x","range":{"end":{"character":4,"line":3},"start":{"character":2,"line":1}}}],
+			"textDocument":{"version":7,"uri":"file:///b.kui"}
+		},
+		"method":"textDocument/didChange",
+		"jsonrpc":"2.0"
+		})", 1);
+
+	ExpectDecoded("no changes", ChangeMessage("[]"), 0);
+
+	ExpectFallback("other method", R"({"jsonrpc":"2.0","method":"textDocument/didOpen","params":{"textDocument":{"uri":"file:///a.kui","text":"textDocument/didChange"}}})");
+	ExpectFallback("request", R"({"jsonrpc":"2.0","id":1,"method":"textDocument/didChange","params":{"textDocument":{"uri":"file:///a.kui"},"contentChanges":[]}})");
+	ExpectFallback("not json-rpc 2.0", R"({"jsonrpc":"1.0","method":"textDocument/didChange","params":{"textDocument":{"uri":"file:///a.kui"},"contentChanges":[]}})");
+	ExpectFallback("missing uri", R"({"jsonrpc":"2.0","method":"textDocument/didChange","params":{"textDocument":{},"contentChanges":[]}})");
+	ExpectFallback("invalid json", ChangeMessage(R"([{"text":"x"})"));
+	ExpectFallback("missing text", ChangeMessage(R"([{"range":{"start":{"line":1,"character":2},"end":{"line":3,"character":4}}}])"));
+	ExpectFallback("text is not a string", ChangeMessage(R"([{"text":5}])"));
+	ExpectFallback("only range start", ChangeMessage(R"([{"range":{"start":{"line":1,"character":2}},"text":"x"}])"));
+	ExpectFallback("missing character", ChangeMessage(R"([{"range":{"start":{"line":1},"end":{"line":3,"character":4}},"text":"x"}])"));
+	ExpectFallback("empty range", ChangeMessage(R"([{"range":{},"text":"x"}])"));
+	ExpectFallback("null range", ChangeMessage(R"([{"range":null,"text":"x"}])"));
+	ExpectFallback("float position", ChangeMessage(R"([{"range":{"start":{"line":1.5,"character":2},"end":{"line":3,"character":4}},"text":"x"}])"));
+	ExpectFallback("string position", ChangeMessage(R"([{"range":{"start":{"line":"1","character":2},"end":{"line":3,"character":4}},"text":"x"}])"));
+	ExpectFallback("position array", ChangeMessage(R"([{"range":{"start":[1,2],"end":{"line":3,"character":4}},"text":"x"}])"));
+
+	if (Failed == 0)
+		std::cout << "all tests passed" << std::endl;
+	return Failed;
+}
@@ -0,0 +1,292 @@
+/**
+ * Tests for handling client messages while the workspace is analyzed.
+ *
+ * The scheduler runs on its own thread and messages are queued like the server's reader thread queues them,
+ * so they can arrive while an analysis is running. Responses are captured from the server's output.
+ * Tests that don't need concurrent messages run the analysis on the main thread before the scheduler thread is started.
+ * The exit code is the number of failed tests.
+ */
+#include "Protocol.h"
+#include "Workspace.h"
+#include "Scheduler.h"
+#include "Stats.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using nlohmann::json;
+namespace filesystem = std::filesystem;
+
+static int Failed = 0;
+
+static void Fail(const std::string& Name, const std::string& Reason)
+{
+	std::cerr << "FAILED " << Name << ": " << Reason << std::endl;
+	Failed++;
+}
+
+static std::mutex OutputMutex;
+static std::condition_variable OutputReceived;
+static std::map<int32_t, json> Responses;
+// The number of times diagnostics were published for each file.
+static std::map<std::string, size_t> PublishedDiagnostics;
+static int32_t NextRequestID = 1;
+
+static void CaptureOutput(std::string_view Data)
+{
+	size_t ContentStart = Data.find("\r\n\r\n");
+	if (ContentStart == std::string_view::npos)
+		return;
+	json Content = json::parse(Data.substr(ContentStart + 4), nullptr, false);
+	if (!Content.is_object())
+		return;
+
+	std::unique_lock g{ OutputMutex };
+	if (Content.value("method", "") == "textDocument/publishDiagnostics")
+		PublishedDiagnostics[Content.at("/params/uri"_json_pointer)]++;
+	else if (Content.contains("id") && !Content.contains("method"))
+		Responses[Content.at("id").get<int32_t>()] = Content;
+	OutputReceived.notify_all();
+}
+
+// Queues a message from the client, like the server's reader thread.
+static void Receive(const std::string& Method, json Params, int32_t ID = -1)
+{
+	json Content = { { "jsonrpc", "2.0" }, { "method", Method }, { "params", Params } };
+	if (ID >= 0)
+		Content["id"] = ID;
+
+	Message msg = Message(Content);
+	msg.ReceivedTime = stats::Clock::now();
+	protocol::NotifyMessageRead(msg);
+	scheduler::Post(protocol::GetMessagePriority(msg), [msg]() {
+		protocol::HandleClientMessage(msg);
+		});
+}
+
+static int32_t Hover(const std::string& Uri, size_t Line, size_t Character)
+{
+	int32_t ID = NextRequestID++;
+	Receive("textDocument/hover", {
+		{ "textDocument", { { "uri", Uri } } },
+		{ "position", { { "line", Line }, { "character", Character } } },
+		}, ID);
+	return ID;
+}
+
+// Returns the response to the request, or nothing if it isn't answered within the timeout.
+static std::optional<json> WaitForResponse(int32_t ID, std::chrono::seconds Timeout = std::chrono::seconds(10))
+{
+	std::unique_lock g{ OutputMutex };
+	if (!OutputReceived.wait_for(g, Timeout, [ID]() { return Responses.contains(ID); }))
+		return std::nullopt;
+	return Responses[ID];
+}
+
+// Returns false if no diagnostics are published for the file within the timeout.
+static bool WaitForDiagnostics(const std::string& Uri, std::chrono::seconds Timeout = std::chrono::seconds(60))
+{
+	std::unique_lock g{ OutputMutex };
+	return OutputReceived.wait_for(g, Timeout, [&Uri]() { return PublishedDiagnostics.contains(Uri); });
+}
+
+static uint64_t GetPhaseCount(const char* Phase)
+{
+	return stats::GetStatsJson().at("phases").value(json::json_pointer("/" + std::string(Phase) + "/count"), uint64_t(0));
+}
+
+static void Open(const std::string& Uri, const std::string& Text)
+{
+	Receive("textDocument/didOpen", { { "textDocument", { { "uri", Uri }, { "languageId", "kui" }, { "version", 1 }, { "text", Text } } } });
+}
+
+static std::string WriteFile(const filesystem::path& Path, const std::string& Content)
+{
+	std::ofstream(Path, std::ios::binary) << Content;
+	return Path.generic_string();
+}
+
+// Files that make the analysis take long enough for messages to arrive while it runs.
+static void WriteFillerFiles(const filesystem::path& Directory)
+{
+	for (size_t File = 0; File < 200; File++)
+	{
+		std::string Content;
+		for (size_t Element = 0; Element < 20; Element++)
+		{
+			Content += "element Filler_" + std::to_string(File) + "_" + std::to_string(Element) + "\n{\n"
+				"\tvar Value = 1;\n"
+				"\tchild UIBackground\n\t{\n\t\topacity = Value;\n\t\tchild UIBackground\n\t\t{\n\t\t\topacity = Value;\n\t\t}\n\t}\n"
+				"}\n";
+		}
+		WriteFile(Directory / ("Filler" + std::to_string(File) + ".kui"), Content);
+	}
+}
+
+/*
+ * Closing a document cancels the analysis of an earlier edit, but doesn't queue a new analysis itself.
+ * A hover on the edited document waits for the analysis of the edit, so it's only answered if the analysis is run again.
+ */
+static void TestCloseDuringAnalysis(const filesystem::path& Directory)
+{
+	const std::string Name = "close during analysis, then hover";
+
+	std::string Edited = "global Color = 1;\n\nelement Edited\n{\n\tchild UIBackground\n\t{\n\t\tcolor = Color;\n\t}\n}\n";
+	std::string EditedUri = WriteFile(Directory / "Edited.kui", Edited);
+	std::string ClosedUri = WriteFile(Directory / "Closed.kui", "element Closed\n{\n}\n");
+
+	workspace::CurrentWorkspacePath = Directory.generic_string();
+	Open(EditedUri, Edited);
+	Open(ClosedUri, "element Closed\n{\n}\n");
+
+	// Both documents are opened before the first analysis starts, so it publishes the diagnostics of both.
+	if (!WaitForDiagnostics(ClosedUri))
+	{
+		Fail(Name, "the opened documents weren't analyzed");
+		return;
+	}
+
+	uint64_t Parsed = GetPhaseCount("parse");
+	// Moves the usage of the global down by one line.
+	Receive("textDocument/didChange", {
+		{ "textDocument", { { "uri", EditedUri }, { "version", 2 } } },
+		{ "contentChanges", { { { "text", "\n" + Edited } } } },
+		});
+
+	// Waits until the analysis of the edit has parsed the files, and is verifying them.
+	auto Start = stats::Clock::now();
+	while (GetPhaseCount("parse") == Parsed)
+	{
+		if (stats::Clock::now() - Start > std::chrono::seconds(60))
+		{
+			Fail(Name, "the edit wasn't analyzed");
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	Receive("textDocument/didClose", { { "textDocument", { { "uri", ClosedUri } } } });
+	std::optional<json> Response = WaitForResponse(Hover(EditedUri, 7, 11));
+	if (!Response)
+		Fail(Name, "the hover wasn't answered");
+	else if (!Response->contains("result"))
+		Fail(Name, "the hover failed: " + Response->dump());
+}
+
+// The diagnostics of the latest analysis and hovers at the given positions, to compare analyses of the same files.
+static std::vector<std::string> DescribeAnalysis(const std::vector<std::pair<std::string, std::pair<size_t, size_t>>>& Hovers)
+{
+	std::vector<std::string> Description;
+	for (const protocol::DiagnosticError& Error : protocol::GetDiagnostics())
+	{
+		Description.push_back(std::string(Error.File) + ":" + std::to_string(Error.Line) + ":" + std::to_string(Error.Begin) + ": " + Error.Message);
+	}
+	std::sort(Description.begin(), Description.end());
+
+	for (const auto& [File, Position] : Hovers)
+	{
+		Description.push_back("hover " + File + ":" + std::to_string(Position.first) + ":" + std::to_string(Position.second) + ": "
+			+ protocol::GetHoverMessage(File, Position.second, Position.first));
+	}
+	return Description;
+}
+
+/*
+ * Evicted files are parsed on their own, other files are parsed together. Elements used across files are resolved when verifying,
+ * which sees the summaries of evicted files together with the other files, so evicting files doesn't change the analysis.
+ * Runs on the calling thread, before the scheduler thread is started.
+ */
+static void TestEvictedFileUsingOtherFile(const filesystem::path& Directory)
+{
+	const std::string Name = "evicted file using an element of another file";
+
+	filesystem::create_directories(Directory);
+	std::string Base = WriteFile(Directory / "Base.kui",
+		"element Base\n{\n\tvar Size = 1;\n\tchild UIBackground\n\t{\n\t\topacity = Size;\n\t}\n}\n");
+	// Also sets a variable Base doesn't have, so verifying reports an error in this file.
+	std::string User = WriteFile(Directory / "User.kui",
+		"element User\n{\n\tchild Base\n\t{\n\t\tSize = 2;\n\t\tMissing = 3;\n\t}\n}\n");
+	// An opened document, which is never evicted, using elements of both files.
+	std::string Opened = (Directory / "Opened.kui").generic_string();
+
+	workspace::CurrentWorkspacePath = Directory.generic_string();
+	workspace::UpdateFiles();
+	protocol::ScanFile("element Opened\n{\n\tchild User\n\t{\n\t}\n\tchild Base\n\t{\n\t\tSize = 3;\n\t}\n}\n", Opened);
+	scheduler::RunPending();
+
+	// Lines and characters are zero based.
+	std::vector<std::pair<std::string, std::pair<size_t, size_t>>> Hovers = {
+		{ Opened, { 2, 8 } },
+		{ Opened, { 5, 8 } },
+		{ Opened, { 7, 3 } },
+		{ User, { 2, 8 } },
+		{ User, { 4, 3 } },
+		{ Base, { 5, 13 } },
+	};
+	std::vector<std::string> Expected = DescribeAnalysis(Hovers);
+	if (protocol::GetHoverMessage(Opened, 8, 2).find("User") == std::string::npos)
+		Fail(Name, "the element used from another file wasn't found");
+
+	// Evicts both closed files. The next analysis creates their summaries, the one after it reuses them.
+	workspace::ClosedFileBudget = 1;
+	workspace::EnforceMemoryBudget();
+	for (const std::string& File : { Base, User })
+	{
+		if (!workspace::Files.at(File).Evicted)
+			Fail(Name, File + " wasn't evicted");
+	}
+
+	for (const char* Analysis : { "with new summaries", "with reused summaries" })
+	{
+		protocol::UpdateAnalysis();
+		scheduler::RunPending();
+		std::vector<std::string> Actual = DescribeAnalysis(Hovers);
+		if (Actual == Expected)
+			continue;
+
+		std::string Difference;
+		for (const std::string& Line : Expected)
+			Difference += "\n  expected " + Line;
+		for (const std::string& Line : Actual)
+			Difference += "\n  actual   " + Line;
+		Fail(Name, std::string("the analysis ") + Analysis + " differs from the one without evicted files:" + Difference);
+	}
+
+	workspace::Files.clear();
+	workspace::Overlays.clear();
+	workspace::ClosedFileBudget = 0;
+	filesystem::remove_all(Directory);
+}
+
+int main()
+{
+	Message::SetOutput(CaptureOutput);
+
+	filesystem::path Directory = filesystem::temp_directory_path() / "kui-protocol-tests";
+	filesystem::remove_all(Directory);
+	filesystem::create_directories(Directory);
+
+	TestEvictedFileUsingOtherFile(Directory / "Evicted");
+
+	WriteFillerFiles(Directory);
+	std::thread(scheduler::Run).detach();
+
+	TestCloseDuringAnalysis(Directory);
+	filesystem::remove_all(Directory);
+
+	if (Failed == 0)
+		std::cout << "all tests passed" << std::endl;
+	std::cout << std::flush;
+	std::cerr << std::flush;
+	// The scheduler thread never returns, so the process ends without destroying the state it's still using.
+	std::quick_exit(Failed);
+}
@@ -0,0 +1,333 @@
+/**
+ * Benchmarks the language server's analysis and queries on generated workspaces.
+ *
+ * Usage: KlemmUIBenchmark [--files=<n,...>] [--elements=<n>] [--depth=<n>] [--globals=<n>] [--constants=<n>]
+ *                         [--cross-references=<0|1>] [--iterations=<n>] [--output=<file>] [--allocation-budget=<file>]
+ *
+ * One workspace is generated for each value of --files. The results are written as json to stdout or the output file.
+ *
+ * If the server library is built with KLEMMUI_LS_COUNT_ALLOCATIONS, the heap allocations of each operation are reported too.
+ * The allocation budget file maps operation names to the maximum number of allocations per call, for example
+ * { "GetHoverMessage": 200 }. The benchmark fails if an operation exceeds its budget at any scale.
+ */
+#include "Protocol.h"
+#include "Workspace.h"
+#include "Stats.h"
+#include "Scheduler.h"
+#include "Allocations.h"
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using nlohmann::json;
+namespace filesystem = std::filesystem;
+
+struct WorkspaceOptions
+{
+	size_t Files = 10;
+	size_t ElementsPerFile = 10;
+	size_t Depth = 3;
+	size_t GlobalsPerFile = 2;
+	size_t ConstantsPerFile = 2;
+	// If true, elements use an element defined in another file.
+	bool CrossReferences = true;
+
+	json ToJson() const
+	{
+		return {
+			{ "files", Files },
+			{ "elementsPerFile", ElementsPerFile },
+			{ "depth", Depth },
+			{ "globalsPerFile", GlobalsPerFile },
+			{ "constantsPerFile", ConstantsPerFile },
+			{ "crossReferences", CrossReferences },
+		};
+	}
+};
+
+struct GeneratedWorkspace
+{
+	std::vector<std::string> Files;
+	// A position in the first file that uses a global variable, used for hover and completion queries.
+	size_t QueryLine = 0;
+	size_t QueryCharacter = 0;
+};
+
+static std::string GenerateFile(const WorkspaceOptions& Options, size_t FileIndex, size_t& QueryLine, size_t& QueryCharacter)
+{
+	std::stringstream Out;
+	size_t Line = 0;
+	auto WriteLine = [&Out, &Line](size_t Indent, const std::string& Text) {
+		Out << std::string(Indent, '\t') << Text << '\n';
+		Line++;
+		};
+
+	std::string Suffix = std::to_string(FileIndex);
+
+	for (size_t i = 0; i < Options.GlobalsPerFile; i++)
+	{
+		WriteLine(0, "global Global_" + Suffix + "_" + std::to_string(i) + " = 0.5;");
+	}
+	for (size_t i = 0; i < Options.ConstantsPerFile; i++)
+	{
+		WriteLine(0, "const Const_" + Suffix + "_" + std::to_string(i) + " = 2;");
+	}
+
+	for (size_t Element = 0; Element < Options.ElementsPerFile; Element++)
+	{
+		WriteLine(0, "");
+		WriteLine(0, "element Element_" + Suffix + "_" + std::to_string(Element));
+		WriteLine(0, "{");
+		WriteLine(1, "var Value = 1;");
+		WriteLine(1, "width = 100%;");
+
+		for (size_t Depth = 0; Depth < Options.Depth; Depth++)
+		{
+			WriteLine(Depth + 1, "child UIBackground");
+			WriteLine(Depth + 1, "{");
+			if (Options.GlobalsPerFile)
+			{
+				if (Element == 0 && Depth == 0)
+				{
+					QueryLine = Line;
+					QueryCharacter = Depth + 2 + std::string_view("color = ").size();
+				}
+				WriteLine(Depth + 2, "color = Global_" + Suffix + "_0;");
+			}
+			if (Options.ConstantsPerFile)
+				WriteLine(Depth + 2, "padding = Const_" + Suffix + "_0;");
+			WriteLine(Depth + 2, "opacity = Value;");
+		}
+		for (size_t Depth = Options.Depth; Depth > 0; Depth--)
+		{
+			WriteLine(Depth, "}");
+		}
+
+		// Files only reference files with a lower index, so there are no cycles between elements.
+		if (Options.CrossReferences && FileIndex > 0)
+		{
+			WriteLine(1, "child Element_" + std::to_string(FileIndex / 2) + "_" + std::to_string(Element));
+			WriteLine(1, "{");
+			WriteLine(2, "Value = 2;");
+			WriteLine(1, "}");
+		}
+		WriteLine(0, "}");
+	}
+	return Out.str();
+}
+
+static GeneratedWorkspace GenerateWorkspace(const WorkspaceOptions& Options, const std::string& Directory)
+{
+	GeneratedWorkspace Out;
+	filesystem::remove_all(Directory);
+	filesystem::create_directories(Directory);
+
+	for (size_t i = 0; i < Options.Files; i++)
+	{
+		std::string Path = (filesystem::path(Directory) / ("File" + std::to_string(i) + ".kui")).generic_string();
+		size_t QueryLine = 0, QueryCharacter = 0;
+		std::ofstream(Path, std::ios::binary) << GenerateFile(Options, i, QueryLine, QueryCharacter);
+		if (i == 0)
+		{
+			Out.QueryLine = QueryLine;
+			Out.QueryCharacter = QueryCharacter;
+		}
+		Out.Files.push_back(Path);
+	}
+	return Out;
+}
+
+static json Measure(size_t Iterations, std::function<void()> Function)
+{
+	stats::Histogram Times;
+	allocations::Counters Allocated;
+	for (size_t i = 0; i < Iterations; i++)
+	{
+		auto StartAllocations = allocations::GetThreadCounters();
+		auto Start = stats::Clock::now();
+		Function();
+		Times.Add(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(stats::Clock::now() - Start).count()));
+		Allocated += allocations::GetThreadCounters() - StartAllocations;
+	}
+
+	json Out = Times.ToJson();
+	if (allocations::Enabled && Iterations)
+	{
+		Out["allocationsPerCall"] = double(Allocated.Count) / double(Iterations);
+		Out["allocatedBytesPerCall"] = double(Allocated.Bytes) / double(Iterations);
+	}
+	return Out;
+}
+
+static json RunBenchmark(const WorkspaceOptions& Options, size_t Iterations)
+{
+	using namespace workspace;
+
+	std::string Directory = (filesystem::temp_directory_path() / "kui-benchmark").generic_string();
+	GeneratedWorkspace Generated = GenerateWorkspace(Options, Directory);
+
+	Files.clear();
+	Overlays.clear();
+	CurrentWorkspacePath = Directory;
+	UpdateFiles();
+
+	const std::string& Target = Generated.Files[0];
+	std::string Content = *Files[Target].Content;
+	size_t Line = Generated.QueryLine, Character = Generated.QueryCharacter;
+
+	json Operations = json::object();
+	Operations["ScanFile"] = Measure(Iterations, [&]() {
+		protocol::ScanFile(Content, Target);
+		// Runs the analysis and publishing tasks queued by the scan.
+		scheduler::RunPending();
+		});
+	Operations["GetDocumentTokens"] = Measure(Iterations, [&]() {
+		protocol::tokens::GetDocumentTokens(Target);
+		});
+	Operations["GetHoverMessage"] = Measure(Iterations, [&]() {
+		protocol::GetHoverMessage(Target, Character, Line);
+		});
+	// Responses are written into the same buffer the server would send them from.
+	std::string Response;
+	Operations["GetTokenCompletions"] = Measure(Iterations, [&]() {
+		Response.clear();
+		JsonWriter Writer = JsonWriter(Response);
+		protocol::WriteCompletions(Target, Line, Character, Writer);
+		});
+	Operations["GetFoldingRanges"] = Measure(Iterations, [&]() {
+		Response.clear();
+		JsonWriter Writer = JsonWriter(Response);
+		protocol::WriteDocumentFoldingRanges(Target, Writer);
+		});
+	Operations["GetDocumentSymbols"] = Measure(Iterations, [&]() {
+		Response.clear();
+		JsonWriter Writer = JsonWriter(Response);
+		protocol::WriteDocumentSymbols(Target, Writer);
+		});
+	Operations["GetReferences"] = Measure(Iterations, [&]() {
+		Response.clear();
+		JsonWriter Writer = JsonWriter(Response);
+		protocol::WriteReferences(Target, Line, Character, true, Writer);
+		});
+	Operations["GetWorkspaceSymbols"] = Measure(Iterations, [&]() {
+		Response.clear();
+		JsonWriter Writer = JsonWriter(Response);
+		protocol::WriteWorkspaceSymbols("elem", Writer);
+		});
+
+	Files.clear();
+	filesystem::remove_all(Directory);
+
+	return {
+		{ "workspace", Options.ToJson() },
+		{ "iterations", Iterations },
+		{ "operations", Operations },
+	};
+}
+
+static std::vector<size_t> ParseList(std::string_view From)
+{
+	std::vector<size_t> Out;
+	while (!From.empty())
+	{
+		size_t Comma = From.find(',');
+		Out.push_back(std::stoul(std::string(From.substr(0, Comma))));
+		if (Comma == std::string_view::npos)
+			break;
+		From = From.substr(Comma + 1);
+	}
+	return Out;
+}
+
+int main(int argc, char** argv)
+{
+	WorkspaceOptions Options;
+	std::vector<size_t> FileCounts = { 10, 100, 500 };
+	size_t Iterations = 10;
+	std::string OutputFile;
+	json AllocationBudget = json::object();
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view Argument = argv[i];
+		size_t Equals = Argument.find('=');
+		std::string_view Name = Argument.substr(0, Equals);
+		std::string Value = Equals == std::string_view::npos ? "" : std::string(Argument.substr(Equals + 1));
+
+		if (Name == "--files")
+			FileCounts = ParseList(Value);
+		else if (Name == "--elements")
+			Options.ElementsPerFile = std::stoul(Value);
+		else if (Name == "--depth")
+			Options.Depth = std::stoul(Value);
+		else if (Name == "--globals")
+			Options.GlobalsPerFile = std::stoul(Value);
+		else if (Name == "--constants")
+			Options.ConstantsPerFile = std::stoul(Value);
+		else if (Name == "--cross-references")
+			Options.CrossReferences = Value != "0";
+		else if (Name == "--iterations")
+			Iterations = std::stoul(Value);
+		else if (Name == "--output")
+			OutputFile = Value;
+		else if (Name == "--allocation-budget")
+		{
+			std::ifstream BudgetFile = std::ifstream(Value);
+			if (!BudgetFile)
+			{
+				std::cerr << "failed to open allocation budget: " << Value << std::endl;
+				return 2;
+			}
+			AllocationBudget = json::parse(BudgetFile);
+		}
+		else
+		{
+			std::cerr << "unknown argument: " << Argument << std::endl;
+			return 2;
+		}
+	}
+
+	// Diagnostics and other messages the analysis sends to the client are discarded.
+	Message::SetOutput([](std::string_view) {});
+
+	if (!AllocationBudget.empty() && !allocations::Enabled)
+		std::cerr << "allocation budget is ignored, allocations are only counted with KLEMMUI_LS_COUNT_ALLOCATIONS" << std::endl;
+
+	json Results = json::array();
+	json BudgetExceeded = json::array();
+	for (size_t Count : FileCounts)
+	{
+		Options.Files = Count;
+		std::cerr << "benchmarking " << Count << " files..." << std::endl;
+		json Result = RunBenchmark(Options, Iterations);
+
+		// Looked up without operator[], which would add the operations the budget names but the benchmark doesn't measure.
+		const json& Operations = Result.at("operations");
+		for (auto& [Operation, Budget] : AllocationBudget.items())
+		{
+			auto Measured = Operations.find(Operation);
+			if (Measured == Operations.end() || !Measured->contains("allocationsPerCall")
+				|| Measured->at("allocationsPerCall").get<double>() <= Budget.get<double>())
+				continue;
+			std::cerr << Operation << " exceeds its allocation budget with " << Count << " files: "
+				<< Measured->at("allocationsPerCall") << " allocations per call, budget: " << Budget << std::endl;
+			BudgetExceeded.push_back({ { "operation", Operation }, { "files", Count } });
+		}
+		Results.push_back(Result);
+	}
+
+	json ResultJson = { { "results", Results } };
+	if (allocations::Enabled)
+		ResultJson["allocationBudgetExceeded"] = BudgetExceeded;
+	std::string ResultString = ResultJson.dump(2);
+	if (OutputFile.empty())
+		std::cout << ResultString << std::endl;
+	else
+		std::ofstream(OutputFile) << ResultString << std::endl;
+	return BudgetExceeded.empty() ? 0 : 1;
+}
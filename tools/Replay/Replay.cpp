@@ -0,0 +1,456 @@
+/**
+ * Replays a session recorded with --record=<file> against the language server.
+ *
+ * Usage: KlemmUIReplay [--speed=<factor>] [--json] [--timeout=<seconds>] <recording> <server executable> [server arguments...]
+ *
+ * --speed scales the recorded pace, 2 replays twice as fast. 0 sends every message as soon as possible.
+ * Responses are compared against the recorded responses and the latency of each request is reported per method.
+ * The exit code is 1 if a response differs from the recording or is missing.
+ */
+#include "Stats.h"
+#include <nlohmann/json.hpp>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+using nlohmann::json;
+
+struct RecordedMessage
+{
+	double Time = 0;
+	bool Incoming = false;
+	json Content;
+	// Raw messages couldn't be parsed by the server when recording, they are sent again as they are.
+	std::string Raw;
+};
+
+class ServerProcess
+{
+public:
+	bool Start(const std::vector<std::string>& Command);
+	bool Write(const std::string& Data);
+	// Reads one framed message. Returns false once the server closed its output.
+	bool ReadMessage(std::string& Out);
+	void CloseInput();
+	int Wait();
+
+private:
+	// Reads up to Size bytes, returns 0 on end of file.
+	size_t ReadSome(char* To, size_t Size);
+	bool ReadByte(char& Out);
+
+	char ReadBuffer[4096];
+	size_t ReadBufferSize = 0;
+	size_t ReadBufferPosition = 0;
+
+#ifdef _WIN32
+	HANDLE Input = nullptr;
+	HANDLE Output = nullptr;
+	PROCESS_INFORMATION Process = {};
+#else
+	int Input = -1;
+	int Output = -1;
+	pid_t Process = -1;
+#endif
+};
+
+#ifdef _WIN32
+bool ServerProcess::Start(const std::vector<std::string>& Command)
+{
+	SECURITY_ATTRIBUTES Attributes = { .nLength = sizeof(SECURITY_ATTRIBUTES), .bInheritHandle = TRUE };
+
+	HANDLE ChildInput = nullptr, ChildOutput = nullptr;
+	if (!CreatePipe(&ChildInput, &Input, &Attributes, 0) || !CreatePipe(&Output, &ChildOutput, &Attributes, 0))
+		return false;
+	SetHandleInformation(Input, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(Output, HANDLE_FLAG_INHERIT, 0);
+
+	std::string CommandLine;
+	for (const std::string& Argument : Command)
+	{
+		CommandLine.append("\"" + Argument + "\" ");
+	}
+
+	STARTUPINFOA StartupInfo = { .cb = sizeof(STARTUPINFOA) };
+	StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+	StartupInfo.hStdInput = ChildInput;
+	StartupInfo.hStdOutput = ChildOutput;
+	StartupInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	bool Started = CreateProcessA(nullptr, CommandLine.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &StartupInfo, &Process);
+	CloseHandle(ChildInput);
+	CloseHandle(ChildOutput);
+	return Started;
+}
+
+bool ServerProcess::Write(const std::string& Data)
+{
+	DWORD Written = 0;
+	return WriteFile(Input, Data.data(), DWORD(Data.size()), &Written, nullptr) && Written == Data.size();
+}
+
+size_t ServerProcess::ReadSome(char* To, size_t Size)
+{
+	DWORD Read = 0;
+	if (!ReadFile(Output, To, DWORD(Size), &Read, nullptr))
+		return 0;
+	return Read;
+}
+
+void ServerProcess::CloseInput()
+{
+	if (Input)
+		CloseHandle(Input);
+	Input = nullptr;
+}
+
+int ServerProcess::Wait()
+{
+	WaitForSingleObject(Process.hProcess, INFINITE);
+	DWORD ExitCode = 0;
+	GetExitCodeProcess(Process.hProcess, &ExitCode);
+	return int(ExitCode);
+}
+#else
+bool ServerProcess::Start(const std::vector<std::string>& Command)
+{
+	int InputPipe[2], OutputPipe[2];
+	if (pipe(InputPipe) != 0 || pipe(OutputPipe) != 0)
+		return false;
+
+	Process = fork();
+	if (Process < 0)
+		return false;
+
+	if (Process == 0)
+	{
+		dup2(InputPipe[0], STDIN_FILENO);
+		dup2(OutputPipe[1], STDOUT_FILENO);
+		close(InputPipe[0]);
+		close(InputPipe[1]);
+		close(OutputPipe[0]);
+		close(OutputPipe[1]);
+
+		std::vector<char*> Arguments;
+		for (const std::string& Argument : Command)
+		{
+			Arguments.push_back(const_cast<char*>(Argument.c_str()));
+		}
+		Arguments.push_back(nullptr);
+		execvp(Arguments[0], Arguments.data());
+		_exit(127);
+	}
+
+	close(InputPipe[0]);
+	close(OutputPipe[1]);
+	Input = InputPipe[1];
+	Output = OutputPipe[0];
+	return true;
+}
+
+bool ServerProcess::Write(const std::string& Data)
+{
+	size_t Written = 0;
+	while (Written < Data.size())
+	{
+		ssize_t Result = write(Input, Data.data() + Written, Data.size() - Written);
+		if (Result <= 0)
+			return false;
+		Written += size_t(Result);
+	}
+	return true;
+}
+
+size_t ServerProcess::ReadSome(char* To, size_t Size)
+{
+	ssize_t Result = read(Output, To, Size);
+	return Result > 0 ? size_t(Result) : 0;
+}
+
+void ServerProcess::CloseInput()
+{
+	if (Input >= 0)
+		close(Input);
+	Input = -1;
+}
+
+int ServerProcess::Wait()
+{
+	int Status = 0;
+	waitpid(Process, &Status, 0);
+	return WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+}
+#endif
+
+bool ServerProcess::ReadByte(char& Out)
+{
+	if (ReadBufferPosition == ReadBufferSize)
+	{
+		ReadBufferSize = ReadSome(ReadBuffer, sizeof(ReadBuffer));
+		ReadBufferPosition = 0;
+		if (ReadBufferSize == 0)
+			return false;
+	}
+	Out = ReadBuffer[ReadBufferPosition++];
+	return true;
+}
+
+bool ServerProcess::ReadMessage(std::string& Out)
+{
+	size_t ContentLength = 0;
+	std::string Line;
+	while (true)
+	{
+		char c;
+		if (!ReadByte(c))
+			return false;
+		if (c != '\n')
+		{
+			if (c != '\r')
+				Line.push_back(c);
+			continue;
+		}
+		if (Line.empty())
+			break;
+
+		constexpr std::string_view LENGTH_HEADER = "Content-Length: ";
+		if (Line.starts_with(LENGTH_HEADER))
+			ContentLength = std::stoul(Line.substr(LENGTH_HEADER.size()));
+		Line.clear();
+	}
+
+	Out.resize(ContentLength);
+	for (size_t i = 0; i < ContentLength; i++)
+	{
+		if (!ReadByte(Out[i]))
+			return false;
+	}
+	return true;
+}
+
+struct MethodResult
+{
+	stats::Histogram Latency;
+	size_t Mismatches = 0;
+	size_t Missing = 0;
+};
+
+struct PendingRequest
+{
+	std::string Method;
+	stats::Clock::time_point SentTime;
+};
+
+static std::mutex ResultsMutex;
+static std::condition_variable ResponseReceived;
+static std::map<std::string, MethodResult> Results;
+static std::map<std::string, PendingRequest> PendingRequests;
+static std::map<std::string, json> ExpectedResponses;
+static std::vector<std::string> MismatchDetails;
+static bool ServerExited = false;
+
+static std::vector<RecordedMessage> LoadRecording(const std::string& File)
+{
+	std::vector<RecordedMessage> Out;
+	std::ifstream In = std::ifstream(File);
+	std::string Line;
+	while (std::getline(In, Line))
+	{
+		if (Line.empty())
+			continue;
+		json Entry = json::parse(Line);
+		RecordedMessage Message = RecordedMessage{
+			.Time = Entry.at("time"),
+			.Incoming = Entry.at("direction") == "in",
+		};
+		if (Entry.contains("raw"))
+			Message.Raw = Entry.at("raw");
+		else
+			Message.Content = Entry.at("message");
+		Out.push_back(std::move(Message));
+	}
+	return Out;
+}
+
+static bool IsResponse(const json& Message)
+{
+	return Message.is_object() && Message.contains("id") && !Message.contains("method");
+}
+
+static void HandleServerMessage(const std::string& Content)
+{
+	json Message = json::parse(Content, nullptr, false);
+	if (!IsResponse(Message))
+		return;
+
+	auto ReceivedTime = stats::Clock::now();
+	std::unique_lock g{ ResultsMutex };
+	std::string ID = Message.at("id").dump();
+	auto Pending = PendingRequests.find(ID);
+	if (Pending == PendingRequests.end())
+		return;
+
+	MethodResult& Result = Results[Pending->second.Method];
+	Result.Latency.Add(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(ReceivedTime - Pending->second.SentTime).count()));
+
+	auto Expected = ExpectedResponses.find(ID);
+	if (Expected != ExpectedResponses.end())
+	{
+		Message.erase("jsonrpc");
+		json ExpectedMessage = Expected->second;
+		ExpectedMessage.erase("jsonrpc");
+		if (Message != ExpectedMessage)
+		{
+			Result.Mismatches++;
+			MismatchDetails.push_back(Pending->second.Method + " (id " + ID + ")");
+		}
+	}
+	PendingRequests.erase(Pending);
+	ResponseReceived.notify_all();
+}
+
+static void PrintReport(bool Json)
+{
+	if (Json)
+	{
+		json Out = json::object();
+		for (auto& [Method, Result] : Results)
+		{
+			json MethodJson = Result.Latency.ToJson();
+			MethodJson["mismatches"] = Result.Mismatches;
+			MethodJson["missing"] = Result.Missing;
+			Out[Method] = MethodJson;
+		}
+		std::cout << json{ { "methods", Out }, { "mismatches", MismatchDetails } }.dump(2) << std::endl;
+		return;
+	}
+
+	std::printf("%-40s %8s %10s %10s %10s %10s %10s %8s\n", "method", "count", "p50 ms", "p95 ms", "p99 ms", "max ms", "mismatch", "missing");
+	for (auto& [Method, Result] : Results)
+	{
+		std::printf("%-40s %8i %10.2f %10.2f %10.2f %10.2f %10i %8i\n",
+			Method.c_str(),
+			int(Result.Latency.Count),
+			double(Result.Latency.GetPercentile(50)) / 1000.0,
+			double(Result.Latency.GetPercentile(95)) / 1000.0,
+			double(Result.Latency.GetPercentile(99)) / 1000.0,
+			double(Result.Latency.Max) / 1000.0,
+			int(Result.Mismatches),
+			int(Result.Missing));
+	}
+	for (const std::string& Mismatch : MismatchDetails)
+	{
+		std::printf("response differs from recording: %s\n", Mismatch.c_str());
+	}
+}
+
+int main(int argc, char** argv)
+{
+	double Speed = 1;
+	double Timeout = 30;
+	bool JsonOutput = false;
+	std::string RecordingFile;
+	std::vector<std::string> ServerCommand;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view Argument = argv[i];
+		if (!RecordingFile.empty())
+			ServerCommand.push_back(argv[i]);
+		else if (Argument.starts_with("--speed="))
+			Speed = std::stod(std::string(Argument.substr(8)));
+		else if (Argument.starts_with("--timeout="))
+			Timeout = std::stod(std::string(Argument.substr(10)));
+		else if (Argument == "--json")
+			JsonOutput = true;
+		else
+			RecordingFile = Argument;
+	}
+
+	if (RecordingFile.empty() || ServerCommand.empty())
+	{
+		std::cerr << "usage: KlemmUIReplay [--speed=<factor>] [--json] [--timeout=<seconds>] <recording> <server executable> [server arguments...]" << std::endl;
+		return 2;
+	}
+
+	std::vector<RecordedMessage> Recording = LoadRecording(RecordingFile);
+	for (const RecordedMessage& Message : Recording)
+	{
+		if (!Message.Incoming && IsResponse(Message.Content))
+			ExpectedResponses[Message.Content.at("id").dump()] = Message.Content;
+	}
+
+	ServerProcess Server;
+	if (!Server.Start(ServerCommand))
+	{
+		std::cerr << "failed to start the server" << std::endl;
+		return 2;
+	}
+
+	auto ReadThread = std::thread([&Server]() {
+		std::string Content;
+		while (Server.ReadMessage(Content))
+		{
+			HandleServerMessage(Content);
+		}
+		// The server exited, nothing else will be answered.
+		std::unique_lock g{ ResultsMutex };
+		ServerExited = true;
+		ResponseReceived.notify_all();
+		});
+
+	auto StartTime = stats::Clock::now();
+	for (const RecordedMessage& Message : Recording)
+	{
+		if (!Message.Incoming)
+			continue;
+
+		if (Speed > 0)
+			std::this_thread::sleep_until(StartTime + std::chrono::duration_cast<stats::Clock::duration>(std::chrono::duration<double>(Message.Time / Speed)));
+
+		std::string Content = Message.Raw.empty() ? Message.Content.dump() : Message.Raw;
+		if (Message.Raw.empty() && Message.Content.contains("method") && Message.Content.contains("id"))
+		{
+			std::unique_lock g{ ResultsMutex };
+			PendingRequests[Message.Content.at("id").dump()] = PendingRequest{ Message.Content.at("method"), stats::Clock::now() };
+		}
+		if (!Server.Write("Content-Length: " + std::to_string(Content.size()) + "\r\n\r\n" + Content))
+			break;
+	}
+
+	{
+		std::unique_lock g{ ResultsMutex };
+		ResponseReceived.wait_for(g, std::chrono::duration<double>(Timeout), []() { return PendingRequests.empty() || ServerExited; });
+		for (auto& [ID, Pending] : PendingRequests)
+		{
+			Results[Pending.Method].Missing++;
+		}
+	}
+
+	Server.CloseInput();
+	Server.Wait();
+	ReadThread.join();
+
+	PrintReport(JsonOutput);
+
+	for (auto& [Method, Result] : Results)
+	{
+		if (Result.Mismatches || Result.Missing)
+			return 1;
+	}
+	return 0;
+}